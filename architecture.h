@@ -52,11 +52,13 @@ typedef struct
     uint32_t SR;
 } register_map_t;
 
+#define SR_FAULT_BUS_FLAG           (0x20000000)
 #define SR_FAULT_DECODE_FLAG        (0x40000000)
 #define SR_FAULT_FLAG               (0x80000000)
 #define SR_ALU_Z_FLAG               (0x00000001)
 #define SR_ALU_O_FLAG               (0x00000002)
 #define SR_ALU_N_FLAG               (0x00000004)
+#define SR_INT_ENABLE_FLAG          (0x00000008)
 
 #define SR_ALU_FLAG_MASK            (0x00000007)
 
@@ -1,5 +1,6 @@
 #!/usr/bin/python
 
+import os
 import sys
 
 def lambda_debug(val, message):
@@ -11,6 +12,8 @@ ENDIANNESS_BIG = 0
 
 ENDIANNESS = ENDIANNESS_LITTLE
 
+WORD_WIDTH = 4
+
 FLASH_OFFSET = 0x1000000
 FLASH_LENGTH = 256 * 1024
 
@@ -82,6 +85,8 @@ instr_dict = {
 "MOVW"  : (0x41, (1, 0, 0, 8), 8),
 "BALI"  : (0x42, (0, 0, 0, 5), 4),
 "JAL"   : (0x43, (1, 0, 0, 0), 4),
+"WFI"   : (0x44, (0, 0, 0, 0), 4),
+"RETI"  : (0x45, (0, 0, 0, 0), 4),
 }
 
 ##
@@ -481,14 +486,24 @@ def check_in_flash(regions):
 ##
 if __name__ == '__main__':
 
-    if len(sys.argv) != 3:
+    if len(sys.argv) not in (3, 4):
         print (
 """USAGE:
-    %s [ASM FILE] [OUT FILE]""" % (sys.argv[0]))
+    %s [ASM FILE] [OUT FILE] [SYM FILE]""" % (sys.argv[0]))
         exit(1)
 
     filelines = open(sys.argv[1]).readlines()
-    outfile = open(sys.argv[2], 'w')
+
+    # Write the binary to a new file and rename it over the old one at the
+    # end, so that emulators running the old one (which they map rather
+    # than copy) are not affected. Anything but a regular file (such as
+    # /dev/null) is written directly.
+    outname = sys.argv[2]
+
+    if os.path.isfile(outname) or not os.path.exists(outname):
+        outname += ".tmp"
+
+    outfile = open(outname, 'wb')
 
     # Declare lists for Region objects and memory contents.
     regions = []
@@ -612,7 +627,22 @@ if __name__ == '__main__':
         place_memory(region, memory, FLASH_OFFSET)
 
     # Write the memory contents to the output file.
-    for b in memory:
-        outfile.write(chr(b))
+    outfile.write(bytearray(memory))
 
     outfile.close()
+
+    if outname != sys.argv[2]:
+        os.rename(outname, sys.argv[2])
+
+    # Write the label addresses to the symbol file, if one was given, for the
+    # emulator's profiler. Each line is "<address> <label>", in hex.
+    if len(sys.argv) == 4:
+        symbols = sorted((_resolve_label(label), label)
+                         for label in region_labels.keys())
+
+        symfile = open(sys.argv[3], 'w')
+
+        for addr, label in symbols:
+            symfile.write("%08x %s\n" % (addr, label))
+
+        symfile.close()
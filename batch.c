@@ -0,0 +1,595 @@
+/**
+ * @brief Batch runner.
+ *
+ * Runs every image listed in a manifest on a machine of its own, spread over
+ * a pool of worker threads, and prints a JSON summary of the results to
+ * stdout. Each worker starts with a contiguous share of the images and, once
+ * it runs out, steals images from the other workers' queues.
+ *
+ * The manifest lists one image per line:
+ *
+ *  BINFILE [GOLDEN [BUDGET]]
+ *
+ * GOLDEN is a file holding the expected console output (everything the UART
+ * transmits and DUMP prints, in order), or "-" to skip the check. BUDGET is
+ * the number of instructions the image may retire before it is stopped and
+ * failed; without one, the batch's default budget applies (see batch_run()),
+ * so that an image that never halts cannot hang the batch, and 0 means no
+ * limit. Relative paths are relative to the directory of the manifest. Blank
+ * lines and lines starting with '#' are ignored.
+ */
+
+/*
+ * For memfd_create().
+ */
+#define _GNU_SOURCE
+
+#include "batch.h"
+#include "device_uart.h"
+#include "machine.h"
+#include "processor.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct
+{
+    char* binary;
+    char* golden;
+    uint64_t budget;
+
+    /*
+     * Results.
+     */
+    bool passed;
+    const char* reason;
+    uint64_t instret;
+    uint64_t output_size;
+    int64_t mismatch;
+    double seconds;
+} batch_job_t;
+
+/*
+ * A worker's queue of job indices. The owner takes jobs from the back; other
+ * workers steal them from the front.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    word_t* jobs;
+    word_t head;
+    word_t tail;
+} batch_queue_t;
+
+typedef struct
+{
+    batch_job_t* jobs;
+    word_t num_jobs;
+
+    batch_queue_t* queues;
+    int num_queues;
+
+    proc_engine_t engine;
+} batch_t;
+
+typedef struct
+{
+    batch_t* batch;
+    int index;
+} batch_worker_t;
+
+/**
+ * @brief Returns the seconds elapsed since the given time.
+ */
+static double batch_elapsed(const struct timespec* start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) +
+           (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+/**
+ * @brief Resolves a manifest path relative to the manifest's directory.
+ *        Returns NULL if memory runs out.
+ */
+static char* batch_path(const char* manifest, const char* path)
+{
+    const char* slash = strrchr(manifest, '/');
+    size_t dir_length = (slash != NULL) ? (size_t)(slash - manifest + 1) : 0;
+    char* resolved;
+
+    if(path[0] == '/')
+        dir_length = 0;
+
+    resolved = (char*)malloc(dir_length + strlen(path) + 1);
+
+    if(resolved == NULL)
+        return NULL;
+
+    memcpy(resolved, manifest, dir_length);
+    strcpy(resolved + dir_length, path);
+
+    return resolved;
+}
+
+/**
+ * @brief Frees the jobs of a batch.
+ */
+static void batch_free_jobs(batch_t* batch)
+{
+    word_t i;
+
+    for(i = 0; i < batch->num_jobs; i++)
+    {
+        free(batch->jobs[i].binary);
+        free(batch->jobs[i].golden);
+    }
+
+    free(batch->jobs);
+}
+
+/**
+ * @brief Reads the manifest into an array of jobs.
+ */
+static bool batch_load_manifest(const char* manifest, batch_t* batch,
+                                uint64_t default_budget)
+{
+    FILE* fp = fopen(manifest, "r");
+    char* line = NULL;
+    size_t line_size = 0;
+    char *binary, *golden, *budget, *save;
+    batch_job_t* grown;
+    batch_job_t* job;
+    bool ok = true;
+
+    if(fp == NULL)
+    {
+        fprintf(stderr, "Could not open manifest %s\n", manifest);
+        return false;
+    }
+
+    batch->jobs = NULL;
+    batch->num_jobs = 0;
+
+    while(getline(&line, &line_size, fp) >= 0)
+    {
+        binary = strtok_r(line, " \t\r\n", &save);
+
+        if((binary == NULL) || (binary[0] == '#'))
+            continue;
+
+        golden = strtok_r(NULL, " \t\r\n", &save);
+        budget = (golden != NULL) ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+
+        grown = (batch_job_t*)realloc(
+                batch->jobs, sizeof(batch_job_t) * (batch->num_jobs + 1));
+
+        if(grown == NULL)
+        {
+            ok = false;
+            break;
+        }
+
+        batch->jobs = grown;
+
+        job = &batch->jobs[batch->num_jobs++];
+        memset(job, 0, sizeof(batch_job_t));
+
+        job->binary = batch_path(manifest, binary);
+        job->golden = ((golden != NULL) && (strcmp(golden, "-") != 0)) ?
+                      batch_path(manifest, golden) : NULL;
+        job->budget = (budget != NULL) ? strtoull(budget, NULL, 0) :
+                      default_budget;
+        job->mismatch = -1;
+
+        if((job->binary == NULL) ||
+           ((job->golden == NULL) && (golden != NULL) &&
+            (strcmp(golden, "-") != 0)))
+        {
+            ok = false;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    if(!ok)
+    {
+        fprintf(stderr, "Out of memory reading manifest %s\n", manifest);
+        batch_free_jobs(batch);
+    }
+
+    return ok;
+}
+
+/**
+ * @brief Reads a whole file, returning its size through size.
+ */
+static byte_t* batch_read_file(const char* fname, uint64_t* size)
+{
+    FILE* fp = fopen(fname, "rb");
+    byte_t* data;
+    long length;
+
+    if(fp == NULL)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    length = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if(length < 0)
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    data = (byte_t*)malloc(length + 1);
+
+    if((data != NULL) && (fread(data, 1, length, fp) != (size_t)length))
+    {
+        free(data);
+        data = NULL;
+    }
+
+    fclose(fp);
+
+    (*size) = length;
+
+    return data;
+}
+
+/**
+ * @brief Compares the captured console output of a job with its golden
+ *        output.
+ */
+static void batch_check_output(batch_job_t* job, int fd)
+{
+    uint64_t golden_size, i;
+    byte_t* golden;
+    byte_t* output;
+    off_t output_size = lseek(fd, 0, SEEK_END);
+
+    if(output_size < 0)
+    {
+        job->reason = "could not read console output";
+        return;
+    }
+
+    job->output_size = output_size;
+
+    if(job->golden == NULL)
+    {
+        job->passed = true;
+        job->reason = "halted";
+        return;
+    }
+
+    golden = batch_read_file(job->golden, &golden_size);
+
+    if(golden == NULL)
+    {
+        job->reason = "could not read golden output";
+        return;
+    }
+
+    output = (byte_t*)malloc(job->output_size + 1);
+
+    if(output == NULL)
+    {
+        job->reason = "out of memory";
+    }
+    else if(pread(fd, output, job->output_size, 0) != (ssize_t)job->output_size)
+    {
+        job->reason = "could not read console output";
+    }
+    else
+    {
+        for(i = 0; (i < golden_size) && (i < job->output_size); i++)
+            if(golden[i] != output[i])
+                break;
+
+        if((i == golden_size) && (i == job->output_size))
+        {
+            job->passed = true;
+            job->reason = "output matches";
+        }
+        else
+        {
+            job->mismatch = i;
+            job->reason = "output mismatch";
+        }
+    }
+
+    free(output);
+    free(golden);
+}
+
+/**
+ * @brief Runs one image on a fresh machine, capturing its console output in
+ *        an anonymous file.
+ */
+static void batch_run_job(batch_t* batch, batch_job_t* job)
+{
+    struct timespec start;
+    FILE* console = NULL;
+    machine_t* m = NULL;
+    int fd;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /*
+     * The UART and DUMP share the file offset, so their output is
+     * interleaved in order.
+     */
+    fd = memfd_create("dankbox-console", MFD_CLOEXEC);
+
+    if(fd >= 0)
+        console = fdopen(dup(fd), "w");
+
+    if(console == NULL)
+        job->reason = "could not capture console output";
+    else if((m = machine_create()) == NULL)
+        job->reason = "could not create machine";
+    else if(!uart_init_fd(fd, NULL))
+        job->reason = "could not create UART";
+    else if(!proc_load_program(job->binary))
+        job->reason = "could not load binary";
+    else
+    {
+        m->console = console;
+
+        if(proc_run(batch->engine, job->budget ? job->budget :
+                    DEVICE_NO_EVENT))
+        {
+            device_flush();
+            batch_check_output(job, fd);
+        }
+        else
+            job->reason = "instruction budget exceeded";
+
+        job->instret = m->instret;
+    }
+
+    if(m != NULL)
+        machine_destroy(m);
+
+    if(console != NULL)
+        fclose(console);
+
+    if(fd >= 0)
+        close(fd);
+
+    job->seconds = batch_elapsed(&start);
+}
+
+/**
+ * @brief Takes a job index from a queue, from the back (the owner) or from
+ *        the front (a thief).
+ */
+static bool batch_queue_take(batch_queue_t* queue, bool back, word_t* job)
+{
+    bool taken = false;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if(queue->head != queue->tail)
+    {
+        (*job) = back ? queue->jobs[--queue->tail] : queue->jobs[queue->head++];
+        taken = true;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return taken;
+}
+
+/**
+ * @brief Runs jobs from the worker's own queue, then steals from the others
+ *        until every queue is empty.
+ */
+static void* batch_worker_main(void* arg)
+{
+    batch_worker_t* worker = (batch_worker_t*)arg;
+    batch_t* batch = worker->batch;
+    word_t job;
+    int i;
+
+    for(;;)
+    {
+        if(!batch_queue_take(&batch->queues[worker->index], true, &job))
+        {
+            /*
+             * Jobs are never added, so once every queue is empty the worker
+             * is done.
+             */
+            for(i = 1; i < batch->num_queues; i++)
+                if(batch_queue_take(&batch->queues[(worker->index + i) %
+                                                   batch->num_queues],
+                                    false, &job))
+                    break;
+
+            if(i >= batch->num_queues)
+                return NULL;
+        }
+
+        batch_run_job(batch, &batch->jobs[job]);
+    }
+}
+
+/**
+ * @brief Prints a string as a JSON string literal.
+ */
+static void batch_print_string(const char* s)
+{
+    putchar('"');
+
+    for(; *s; s++)
+    {
+        if((*s == '"') || (*s == '\\'))
+            printf("\\%c", *s);
+        else if((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+
+    putchar('"');
+}
+
+/**
+ * @brief Prints the JSON summary of a batch.
+ */
+static void batch_print_summary(batch_t* batch, double seconds)
+{
+    word_t i, passed = 0;
+    batch_job_t* job;
+
+    printf("{\n  \"engine\": ");
+    batch_print_string(proc_engine_name(batch->engine));
+    printf(",\n  \"threads\": %d,\n  \"images\": [", batch->num_queues);
+
+    for(i = 0; i < batch->num_jobs; i++)
+    {
+        job = &batch->jobs[i];
+        passed += job->passed;
+
+        printf("%s\n    {\"binary\": ", i ? "," : "");
+        batch_print_string(job->binary);
+        printf(", \"passed\": %s, \"reason\": ",
+               job->passed ? "true" : "false");
+        batch_print_string(job->reason);
+        printf(", \"instructions\": %llu, \"output_bytes\": %llu",
+               (unsigned long long)job->instret,
+               (unsigned long long)job->output_size);
+
+        if(job->mismatch >= 0)
+            printf(", \"mismatch_offset\": %lld", (long long)job->mismatch);
+
+        printf(", \"seconds\": %.6f}", job->seconds);
+    }
+
+    printf("\n  ],\n  \"passed\": %u,\n  \"failed\": %u,\n"
+           "  \"seconds\": %.6f\n}\n", passed, batch->num_jobs - passed,
+           seconds);
+}
+
+/**
+ * @brief Runs every image in a manifest on the given number of worker threads
+ *        (0 for one per host core) and prints a JSON summary. Images with no
+ *        budget in the manifest get default_budget (0 for no limit). Returns
+ *        true if every image passed.
+ */
+bool batch_run(const char* manifest, proc_engine_t engine, int threads,
+               uint64_t default_budget)
+{
+    batch_worker_t* workers;
+    pthread_t* thread_ids;
+    struct timespec start;
+    batch_t batch;
+    word_t i, passed = 0;
+    int w, started = 0;
+    bool ok = true;
+
+    if(!batch_load_manifest(manifest, &batch, default_budget))
+        return false;
+
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if((word_t)threads > batch.num_jobs)
+        threads = batch.num_jobs;
+
+    if(threads < 1)
+        threads = 1;
+
+    batch.engine = engine;
+    batch.num_queues = threads;
+    batch.queues = (batch_queue_t*)calloc(threads, sizeof(batch_queue_t));
+    workers = (batch_worker_t*)calloc(threads, sizeof(batch_worker_t));
+    thread_ids = (pthread_t*)calloc(threads, sizeof(pthread_t));
+
+    if((batch.queues == NULL) || (workers == NULL) || (thread_ids == NULL))
+        ok = false;
+
+    /*
+     * Deal the jobs out in contiguous shares.
+     */
+    for(w = 0; ok && (w < threads); w++)
+    {
+        batch_queue_t* queue = &batch.queues[w];
+
+        queue->jobs = (word_t*)malloc(sizeof(word_t) *
+                                      (batch.num_jobs / threads + 1));
+
+        if(queue->jobs == NULL)
+        {
+            ok = false;
+            break;
+        }
+
+        pthread_mutex_init(&queue->lock, NULL);
+
+        queue->head = queue->tail = 0;
+
+        for(i = batch.num_jobs * w / threads;
+            i < batch.num_jobs * (w + 1) / threads; i++)
+            queue->jobs[queue->tail++] = i;
+
+        workers[w].batch = &batch;
+        workers[w].index = w;
+    }
+
+    if(ok)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        /*
+         * Workers steal from every queue, so if some threads cannot be
+         * started, the others (or this thread) run their jobs instead.
+         */
+        for(w = 0; w < threads; w++)
+            if(pthread_create(&thread_ids[started], NULL, batch_worker_main,
+                              &workers[w]) == 0)
+                started++;
+
+        if(started < threads)
+            batch_worker_main(&workers[0]);
+
+        for(w = 0; w < started; w++)
+            pthread_join(thread_ids[w], NULL);
+
+        batch_print_summary(&batch, batch_elapsed(&start));
+
+        for(i = 0; i < batch.num_jobs; i++)
+            passed += batch.jobs[i].passed;
+    }
+    else
+        fprintf(stderr, "Out of memory starting the batch\n");
+
+    for(w = 0; (batch.queues != NULL) && (w < threads); w++)
+    {
+        if(batch.queues[w].jobs == NULL)
+            break;
+
+        pthread_mutex_destroy(&batch.queues[w].lock);
+        free(batch.queues[w].jobs);
+    }
+
+    batch_free_jobs(&batch);
+    free(batch.queues);
+    free(workers);
+    free(thread_ids);
+
+    return ok && (passed == batch.num_jobs);
+}
@@ -0,0 +1,18 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "processor.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The instruction budget of images the manifest gives none, unless -n says
+ * otherwise: a few seconds of emulation.
+ */
+#define BATCH_DEFAULT_BUDGET (1000000000ull)
+
+bool batch_run(const char* manifest, proc_engine_t engine, int threads,
+               uint64_t default_budget);
+
+#endif // BATCH_H
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+
+##
+##  Benchmark harness for the DankBoxEmulator.
+##
+##  Assembles the benchmark workloads (programs/bench_*.asm), runs each of them
+##  several times on each execution engine, and reports the guest MIPS, the
+##  host time per guest instruction and its spread, compared against a stored
+##  baseline. Every engine must produce the same console output for a workload;
+##  a run that fails or disagrees makes the harness exit with status 1.
+##
+
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+
+BENCHMARKS = ["memcpy", "crc32", "sort", "puts", "recursion"]
+ENGINES = ["switch", "threaded", "block", "jit"]
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+BASELINE = os.path.join(ROOT, "programs", "bench_baseline.json")
+
+PERF_RE = re.compile(r"^(\d+) instructions in ([0-9.]+) s", re.MULTILINE)
+
+##
+##  Assembles a workload, unless its binary is newer than its source.
+##
+def assemble(name):
+    source = os.path.join(ROOT, "programs", "bench_%s.asm" % name)
+    binary = os.path.join(ROOT, "binaries", "bench_%s.bin" % name)
+
+    if (os.path.exists(binary) and
+        os.path.getmtime(binary) >= os.path.getmtime(source)):
+        return binary
+
+    if not os.path.isdir(os.path.dirname(binary)):
+        os.makedirs(os.path.dirname(binary))
+
+    subprocess.check_call([sys.executable, os.path.join(ROOT, "asm.py"),
+                           source, binary])
+
+    return binary
+
+##
+##  Runs a workload once. Returns (console output, instructions, seconds), or
+##  None if the emulator failed.
+##
+def run(emu, engine, binary):
+    proc = subprocess.run([emu, "-p", "-e", engine, "-u", "/dev/null", binary],
+                          stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    match = PERF_RE.search(proc.stderr.decode())
+
+    if proc.returncode != 0 or match is None:
+        sys.stderr.write(proc.stderr.decode())
+        return None
+
+    return (proc.stdout, int(match.group(1)), float(match.group(2)))
+
+def main():
+    parser = argparse.ArgumentParser(description=
+            "Runs the DankCore benchmark workloads on the emulator.")
+    parser.add_argument("-n", "--runs", type=int, default=5,
+                        help="runs of each workload per engine (default 5)")
+    parser.add_argument("-e", "--engines", default=",".join(ENGINES),
+                        help="comma-separated engines (default: all)")
+    parser.add_argument("-b", "--benchmarks", default=",".join(BENCHMARKS),
+                        help="comma-separated workloads (default: all)")
+    parser.add_argument("--emu", default=os.path.join(ROOT, "emu"),
+                        help="the emulator binary (default ./emu)")
+    parser.add_argument("--baseline", default=BASELINE,
+                        help="the baseline file (default %(default)s)")
+    parser.add_argument("--save", action="store_true",
+                        help="store the results as the new baseline")
+    args = parser.parse_args()
+
+    try:
+        baseline = json.load(open(args.baseline))
+    except (IOError, ValueError):
+        baseline = {}
+
+    results = {}
+    ok = True
+
+    print("%-10s %-9s %12s %9s %9s %8s %9s %8s" %
+          ("workload", "engine", "instructions", "MIPS", "ns/instr",
+           "stdev", "baseline", "change"))
+
+    for name in args.benchmarks.split(","):
+        binary = assemble(name)
+        expected = None
+
+        for engine in args.engines.split(","):
+            runs = [run(args.emu, engine, binary) for i in range(args.runs)]
+
+            if None in runs:
+                print("%-10s %-9s FAILED" % (name, engine))
+                ok = False
+                continue
+
+            # Every run, on every engine, must print the same thing.
+            if expected is None:
+                expected = runs[0][0]
+
+            if any(output != expected for output, _, _ in runs):
+                print("%-10s %-9s OUTPUT DIFFERS" % (name, engine))
+                ok = False
+                continue
+
+            instret = runs[0][1]
+            ns = [seconds * 1e9 / instret for _, _, seconds in runs]
+            median = statistics.median(ns)
+            stdev = statistics.stdev(ns) if len(ns) > 1 else 0.0
+            mips = 1e3 / median
+
+            key = "%s/%s" % (name, engine)
+            results[key] = round(mips, 2)
+
+            if key in baseline:
+                change = "%+7.1f%%" % ((mips / baseline[key] - 1) * 100)
+                base = "%9.2f" % baseline[key]
+            else:
+                change = "%8s" % "-"
+                base = "%9s" % "-"
+
+            print("%-10s %-9s %12d %9.2f %9.2f %7.1f%% %s %s" %
+                  (name, engine, instret, mips, median,
+                   stdev / median * 100, base, change))
+            sys.stdout.flush()
+
+    if args.save:
+        baseline.update(results)
+
+        with open(args.baseline, "w") as f:
+            json.dump(baseline, f, indent=2, sort_keys=True)
+            f.write("\n")
+
+    return 0 if ok else 1
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,348 @@
+/**
+ * @brief Lockstep co-simulation.
+ *
+ * Runs a candidate execution engine and the reference interpreter (the switch
+ * engine) side by side, on two machines loaded with the same image, and
+ * checks that they agree. The candidate runs for a check interval, then the
+ * reference runs up to exactly the same guest time, and their registers and
+ * cycle counts (and, optionally, their memory) are compared. A WFI may sleep
+ * past the end of an interval, in which case the check is made where it
+ * wakes.
+ *
+ * Both machines take snapshots at the checks (see snapshot.h). When a check
+ * fails, both go back to the last check that passed and run forward again, one
+ * instruction at a time, to find the first instruction whose results differ.
+ * Device reads and interrupts are replayed from the log while they do, so the
+ * devices cannot cause the difference.
+ *
+ * The reference machine executes the idle loops that the candidate skips
+ * (see processor_idle.c), so the skipping is checked too.
+ *
+ * The reference machine's UART writes to stdout and the candidate's to
+ * /dev/null, so the program's output appears once.
+ */
+
+#include "cosim.h"
+#include "cycles.h"
+#include "device_uart.h"
+#include "machine.h"
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * The number of differing memory words that a divergence report lists.
+ */
+#define COSIM_MAX_MEM_DIFFS (8)
+
+#define COSIM_MEMORY_SIZE (ARCH_ROM_SIZE + ARCH_RAM_SIZE)
+
+typedef struct
+{
+    machine_t* reference;
+    machine_t* candidate;
+    proc_engine_t engine;
+    bool check_memory;
+
+    /*
+     * The guest time and PC of the last check that passed.
+     */
+    uint64_t agreed;
+    word_t agreed_pc;
+} cosim_t;
+
+/**
+ * @brief Creates a machine running the given image, with its UART writing to
+ *        the given sink, and the given cycle model (or the default if NULL).
+ */
+static machine_t* cosim_create(const char* binary, const char* sink,
+                               const char* cycle_model)
+{
+    machine_t* m = machine_create();
+
+    if(m == NULL)
+        return NULL;
+
+    if(((cycle_model != NULL) && !cycles_load(cycle_model)) ||
+       !uart_init(sink, NULL) || !proc_load_program(binary) ||
+       !snapshot_init(SNAPSHOT_DEFAULT_INTERVAL))
+    {
+        machine_destroy(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+/**
+ * @brief Returns the guest address of an offset into machine->memory.
+ */
+static word_t cosim_memory_addr(word_t offset)
+{
+    if(offset < ARCH_ROM_SIZE)
+        return ARCH_ROM_OFFSET + offset;
+
+    return ARCH_RAM_OFFSET + offset - ARCH_ROM_SIZE;
+}
+
+/**
+ * @brief Checks whether the two machines are in the same state.
+ */
+static bool cosim_agree(const cosim_t* cosim)
+{
+    const machine_t* reference = cosim->reference;
+    const machine_t* candidate = cosim->candidate;
+
+    if((reference->instret != candidate->instret) ||
+       (reference->cycles != candidate->cycles) ||
+       (memcmp(&reference->regs, &candidate->regs,
+               sizeof(register_map_t)) != 0))
+        return false;
+
+    return !cosim->check_memory ||
+           (memcmp(reference->memory, candidate->memory,
+                   COSIM_MEMORY_SIZE) == 0);
+}
+
+/**
+ * @brief Prints how the two machines differ.
+ */
+static void cosim_print_diff(const cosim_t* cosim)
+{
+    static const char* const names[] =
+    {
+        "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "R8", "R9", "R10",
+        "R11", "PC", "LR", "SP", "SR"
+    };
+    const machine_t* reference = cosim->reference;
+    const machine_t* candidate = cosim->candidate;
+    const word_t* ref_regs = (const word_t*)&reference->regs;
+    const word_t* cand_regs = (const word_t*)&candidate->regs;
+    word_t ref_word, cand_word;
+    word_t i, diffs = 0;
+
+    fprintf(stderr, "%-10s %12s %12s\n", "", "reference",
+            proc_engine_name(cosim->engine));
+
+    if(reference->instret != candidate->instret)
+        fprintf(stderr, "%-10s %12llu %12llu\n", "instret",
+                (unsigned long long)reference->instret,
+                (unsigned long long)candidate->instret);
+
+    if(reference->cycles != candidate->cycles)
+        fprintf(stderr, "%-10s %12llu %12llu\n", "cycles",
+                (unsigned long long)reference->cycles,
+                (unsigned long long)candidate->cycles);
+
+    for(i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        if(ref_regs[i] != cand_regs[i])
+            fprintf(stderr, "%-10s   0x%08x   0x%08x\n", names[i],
+                    ref_regs[i], cand_regs[i]);
+
+    if(!cosim->check_memory)
+        return;
+
+    for(i = 0; i < COSIM_MEMORY_SIZE; i += sizeof(word_t))
+    {
+        memcpy(&ref_word, reference->memory + i, sizeof(word_t));
+        memcpy(&cand_word, candidate->memory + i, sizeof(word_t));
+
+        if(ref_word == cand_word)
+            continue;
+
+        if(diffs++ == COSIM_MAX_MEM_DIFFS)
+        {
+            fprintf(stderr, "(more memory differs)\n");
+            break;
+        }
+
+        fprintf(stderr, "0x%08x   0x%08x   0x%08x\n", cosim_memory_addr(i),
+                ref_word, cand_word);
+    }
+}
+
+/**
+ * @brief Runs the candidate until the given guest time (or the end of a WFI
+ *        sleeping past it), then the reference up to the same time. Returns
+ *        true if the candidate halted.
+ */
+static bool cosim_advance(cosim_t* cosim, uint64_t limit)
+{
+    bool halted;
+
+    machine_bind(cosim->candidate);
+    halted = proc_run(cosim->engine, limit);
+
+    machine_bind(cosim->reference);
+
+    if(machine->instret < cosim->candidate->instret)
+        proc_run(PROC_ENGINE_SWITCH, cosim->candidate->instret);
+
+    return halted;
+}
+
+/**
+ * @brief Checks that the reference halts where the candidate did.
+ */
+static bool cosim_reference_halts(cosim_t* cosim)
+{
+    machine_bind(cosim->reference);
+
+    return proc_run(PROC_ENGINE_SWITCH, machine->instret + 1) &&
+           (machine->instret == cosim->candidate->instret);
+}
+
+/**
+ * @brief Records that the machines agree, taking snapshots if they are due.
+ */
+static void cosim_passed(cosim_t* cosim)
+{
+    cosim->agreed = cosim->candidate->instret;
+    cosim->agreed_pc = cosim->candidate->regs.PC;
+
+    machine_bind(cosim->reference);
+    snapshot_poll();
+
+    machine_bind(cosim->candidate);
+    snapshot_poll();
+}
+
+/**
+ * @brief Takes both machines back to the last check that passed and runs
+ *        them forward in the smallest steps the candidate can make, until
+ *        they differ. Prints the first difference.
+ */
+static void cosim_narrow(cosim_t* cosim)
+{
+    uint64_t limit = cosim->candidate->instret;
+    uint64_t before;
+    word_t pc, instr;
+    bool halted;
+
+    machine_bind(cosim->reference);
+    snapshot_goto(cosim->agreed);
+
+    machine_bind(cosim->candidate);
+    snapshot_goto(cosim->agreed);
+
+    if(cosim_agree(cosim))
+    {
+        while(cosim->candidate->instret < limit)
+        {
+            before = cosim->candidate->instret;
+            pc = cosim->candidate->regs.PC;
+
+            machine_bind(cosim->candidate);
+            instr = mem_page_bias(pc) ? get_mem_word(pc) : 0;
+
+            halted = cosim_advance(cosim, before + 1);
+
+            if(!cosim_agree(cosim) ||
+               (halted && !cosim_reference_halts(cosim)))
+            {
+                fprintf(stderr, "Divergence at instruction %llu "
+                        "(PC=0x%08x: 0x%08x), %llu instruction(s) "
+                        "executed together by %s\n",
+                        (unsigned long long)before, pc, instr,
+                        (unsigned long long)(cosim->candidate->instret -
+                                             before),
+                        proc_engine_name(cosim->engine));
+                cosim_print_diff(cosim);
+                return;
+            }
+
+            if(halted)
+                break;
+        }
+    }
+
+    /*
+     * The divergence did not happen again from the snapshot: report where it
+     * was seen.
+     */
+    fprintf(stderr, "Divergence between instruction %llu (PC=0x%08x) and "
+            "instruction %llu, which could not be narrowed down\n",
+            (unsigned long long)cosim->agreed, cosim->agreed_pc,
+            (unsigned long long)limit);
+}
+
+/**
+ * @brief Runs an image on the given candidate engine and on the reference
+ *        interpreter in lockstep, comparing them every interval instructions,
+ *        until the program halts or reaches the instruction limit. Both
+ *        machines use the given cycle model (or the default if NULL). Returns
+ *        false (after printing the first difference) if they diverge.
+ */
+bool cosim_run(const char* binary, proc_engine_t engine, uint64_t interval,
+               bool check_memory, uint64_t instret_limit,
+               const char* cycle_model)
+{
+    cosim_t cosim;
+    uint64_t checks = 0;
+    uint64_t limit;
+    bool halted = false;
+    bool agreed = true;
+
+    memset(&cosim, 0, sizeof(cosim));
+
+    cosim.engine = engine;
+    cosim.check_memory = check_memory;
+
+    cosim.reference = cosim_create(binary, NULL, cycle_model);
+    cosim.candidate = cosim_create(binary, "/dev/null", cycle_model);
+
+    if((cosim.reference == NULL) || (cosim.candidate == NULL))
+    {
+        if(cosim.reference != NULL)
+            machine_destroy(cosim.reference);
+
+        return false;
+    }
+
+    /*
+     * The reference executes idle loops that the candidate skips.
+     */
+    cosim.reference->idle_skip = false;
+
+    if(interval == 0)
+        interval = 1;
+
+    cosim.agreed_pc = cosim.candidate->regs.PC;
+
+    while(!halted && (cosim.candidate->instret < instret_limit))
+    {
+        limit = cosim.candidate->instret + interval;
+
+        if(limit > instret_limit)
+            limit = instret_limit;
+
+        halted = cosim_advance(&cosim, limit);
+        checks++;
+
+        if(!cosim_agree(&cosim) || (halted && !cosim_reference_halts(&cosim)))
+        {
+            cosim_narrow(&cosim);
+            agreed = false;
+            break;
+        }
+
+        cosim_passed(&cosim);
+    }
+
+    machine_bind(cosim.reference);
+    fflush(stdout);
+    device_flush();
+
+    if(agreed)
+        fprintf(stderr, "%s agreed with the reference for %llu instructions "
+                "(%llu checks)%s\n", proc_engine_name(engine),
+                (unsigned long long)cosim.candidate->instret,
+                (unsigned long long)checks,
+                halted ? "" : "; instruction limit reached");
+
+    machine_destroy(cosim.candidate);
+    machine_destroy(cosim.reference);
+
+    return agreed;
+}
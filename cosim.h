@@ -0,0 +1,13 @@
+#ifndef COSIM_H
+#define COSIM_H
+
+#include "processor.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool cosim_run(const char* binary, proc_engine_t engine, uint64_t interval,
+               bool check_memory, uint64_t instret_limit,
+               const char* cycle_model);
+
+#endif // COSIM_H
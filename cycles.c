@@ -0,0 +1,120 @@
+#include "cycles.h"
+#include "machine.h"
+#include "processor.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/**
+ * @brief Gives the current machine the default cycle model: 1 cycle per
+ *        instruction, with no penalties.
+ */
+void cycles_init()
+{
+    cycle_model_t* model = &machine->cycle_model;
+    word_t i;
+
+    memset(model, 0, sizeof(cycle_model_t));
+
+    for(i = 0; i < 256; i++)
+        model->opcodes[i] = 1;
+}
+
+/**
+ * @brief Sets one entry of the current machine's cycle model. Returns false
+ *        if there is no entry by that name.
+ */
+static bool cycles_set(const char* name, word_t cost)
+{
+    cycle_model_t* model = &machine->cycle_model;
+    word_t i;
+
+    if(strcmp(name, "narrow") == 0)
+        model->narrow = cost;
+    else if(strcmp(name, "unaligned") == 0)
+        model->unaligned = cost;
+    else if(strcmp(name, "mmio") == 0)
+        model->mmio = cost;
+    else if(strcmp(name, "branch") == 0)
+        model->branch = cost;
+    else if(strcmp(name, "dma") == 0)
+        model->dma = cost;
+    else if(strcmp(name, "dma_word") == 0)
+        model->dma_word = cost;
+    else if(strcmp(name, "default") == 0)
+    {
+        for(i = 0; i < 256; i++)
+            model->opcodes[i] = cost;
+    }
+    else
+    {
+        for(i = 0; i < 256; i++)
+            if((proc_opcode_name(i) != NULL) &&
+               (strcasecmp(proc_opcode_name(i), name) == 0))
+                break;
+
+        if(i == 256)
+            return false;
+
+        model->opcodes[i] = cost;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Loads the current machine's cycle model from a file (see cycles.h).
+ *        Returns false (after printing why) if the file cannot be read or has
+ *        a line that is not a valid entry.
+ */
+bool cycles_load(const char* fname)
+{
+    FILE* fp = fopen(fname, "r");
+    char* line = NULL;
+    size_t line_size = 0;
+    char *name, *cost, *end, *save;
+    unsigned long value;
+    word_t number = 0;
+    bool ok = true;
+
+    if(fp == NULL)
+    {
+        fprintf(stderr, "Could not open cycle model %s: %s\n", fname,
+                strerror(errno));
+        return false;
+    }
+
+    while(ok && (getline(&line, &line_size, fp) >= 0))
+    {
+        number++;
+
+        name = strtok_r(line, " \t\r\n", &save);
+
+        if((name == NULL) || (name[0] == '#'))
+            continue;
+
+        cost = strtok_r(NULL, " \t\r\n", &save);
+        value = (cost != NULL) ? strtoul(cost, &end, 0) : 0;
+
+        if((cost == NULL) || (*end != '\0') || (value > UINT16_MAX))
+        {
+            fprintf(stderr, "%s:%u: expected a cost from 0 to %u after %s\n",
+                    fname, number, UINT16_MAX, name);
+            ok = false;
+        }
+        else if(!cycles_set(name, value))
+        {
+            fprintf(stderr, "%s:%u: unknown opcode or penalty %s\n", fname,
+                    number, name);
+            ok = false;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    return ok;
+}
@@ -0,0 +1,62 @@
+/**
+ * @brief The cycle cost model.
+ *
+ * The machine counts guest time in retired instructions (machine->instret);
+ * the cycle model estimates how long the same code would take on DankCore
+ * hardware, in machine->cycles. Every instruction costs its opcode's cycles,
+ * plus penalties for what it does:
+ *
+ *  narrow      for a halfword or byte load or store,
+ *  unaligned   for a load or store whose address is not a multiple of its
+ *              width,
+ *  mmio        for a load or store that goes to a device,
+ *  branch      for a jump or branch that is taken (any instruction that
+ *              changes the PC).
+ *
+ * The opcode cost and the narrow penalty are folded into each predecoded
+ * instruction, so a retirement adds one precomputed number; the other
+ * penalties are only added on the paths that incur them. Guest code reads the
+ * counts through the counter device (see device_counter.c).
+ *
+ * The model also sets how long the DMA engine takes over a transfer, in guest
+ * time rather than cycles, since the processor carries on meanwhile (see
+ * device_dma.c):
+ *
+ *  dma         for each transfer,
+ *  dma_word    for each word transferred.
+ *
+ * The default model costs 1 cycle per instruction with no penalties, so that
+ * the cycles equal the instructions, and DMA transfers take no time. A model
+ * is loaded from a text file with one "NAME COST" pair per line, where NAME
+ * is an opcode mnemonic (such as LOAD), one of the penalties above, or
+ * "default" to set every opcode.
+ * Blank lines and lines starting with '#' are ignored; later lines override
+ * earlier ones. The model must be loaded before the program, whose
+ * instructions are predecoded with it.
+ */
+
+#ifndef CYCLES_H
+#define CYCLES_H
+
+#include "architecture.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct
+{
+    uint16_t opcodes[256];
+
+    word_t narrow;
+    word_t unaligned;
+    word_t mmio;
+    word_t branch;
+
+    word_t dma;
+    word_t dma_word;
+} cycle_model_t;
+
+void cycles_init();
+bool cycles_load(const char* fname);
+
+#endif // CYCLES_H
@@ -0,0 +1,277 @@
+#include "debug.h"
+#include "devices.h"
+#include "machine.h"
+#include "processor.h"
+#include "snapshot.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG_LINE_SIZE (256)
+
+static volatile sig_atomic_t debug_interrupted;
+
+static void debug_interrupt(int sig)
+{
+    (void)sig;
+
+    debug_interrupted = 1;
+}
+
+/**
+ * @brief Checks whether width bytes at addr are plain memory, which the
+ *        monitor can read without side effects.
+ */
+static bool debug_in_memory(word_t addr, word_t width)
+{
+    return mem_page_bias(addr) && mem_page_bias(addr + width - 1);
+}
+
+/**
+ * @brief Prints where the machine is: the number and PC of the next
+ *        instruction to execute, and the instruction.
+ */
+static void debug_print_location()
+{
+    regidx_t ra, rb, rc;
+    word_t pc = machine->regs.PC;
+    word_t instr, imm;
+    opcode_t opcode;
+
+    fprintf(stderr, "%llu\t0x%08x: ", (unsigned long long)machine->instret,
+            pc);
+
+    if(!debug_in_memory(pc, sizeof(word_t)))
+    {
+        fprintf(stderr, "(not in memory)\n");
+        return;
+    }
+
+    instr = get_mem_word(pc);
+    proc_instr_decode(instr, &ra, &rb, &rc, &imm, &opcode);
+
+    fprintf(stderr, "0x%08x  (OPC: 0x%02x, RA: %d, RB: %d, RC: %d, "
+            "IMM: 0x%04x)\n", instr, opcode, ra, rb, rc, imm);
+}
+
+/**
+ * @brief Prints the registers, four per line.
+ */
+static void debug_print_regs()
+{
+    static const char* const names[] =
+    {
+        "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "R8", "R9", "R10",
+        "R11", "PC", "LR", "SP", "SR"
+    };
+    word_t i;
+
+    for(i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        fprintf(stderr, "  %s=0x%08x%s", names[i], proc_reg(i),
+                ((i % 4) == 3) ? "\n" : "");
+}
+
+/**
+ * @brief Prints count words of memory from addr.
+ */
+static void debug_print_mem(word_t addr, word_t count)
+{
+    word_t i;
+
+    addr &= ~(sizeof(word_t) - 1);
+
+    for(i = 0; i < count; i++, addr += sizeof(word_t))
+    {
+        if((i % 4) == 0)
+            fprintf(stderr, "%s0x%08x:", i ? "\n" : "", addr);
+
+        if(debug_in_memory(addr, sizeof(word_t)))
+            fprintf(stderr, " 0x%08x", get_mem_word(addr));
+        else
+            fprintf(stderr, " (device)  ");
+    }
+
+    fprintf(stderr, "\n");
+}
+
+/**
+ * @brief Runs the processor with the given engine until it halts or the user
+ *        interrupts it, stopping every so often to take a snapshot.
+ */
+static bool debug_continue(proc_engine_t engine)
+{
+    struct sigaction action, previous;
+    bool halted = false;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = debug_interrupt;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &previous);
+
+    debug_interrupted = 0;
+
+    while(!debug_interrupted && !halted)
+    {
+        halted = proc_run(engine, snapshot_next());
+        snapshot_poll();
+    }
+
+    sigaction(SIGINT, &previous, NULL);
+
+    return !halted;
+}
+
+/**
+ * @brief Prints the monitor's commands.
+ */
+static void debug_print_help()
+{
+    fprintf(stderr,
+            "  s [N]           step forward N instructions (default 1)\n"
+            "  rs [N]          step back N instructions (default 1)\n"
+            "  c               continue until the program halts or ^C\n"
+            "  g N             go to instruction N, forward or back\n"
+            "  w ADDR [WIDTH]  go back to the last instruction that changed\n"
+            "                  WIDTH bytes (default 4) of memory at ADDR\n"
+            "  r               print the registers\n"
+            "  x ADDR [N]      print N words (default 4) of memory at ADDR\n"
+            "  q               quit\n");
+}
+
+/**
+ * @brief Runs the loaded program under an interactive monitor that reads
+ *        commands from stdin and can step execution back as well as
+ *        forward. A snapshot is taken every interval instructions (see
+ *        snapshot.h).
+ */
+bool debug_run(proc_engine_t engine, uint64_t interval)
+{
+    char line[DEBUG_LINE_SIZE];
+    char command[DEBUG_LINE_SIZE];
+    unsigned long long arg1, arg2;
+    uint64_t target, found;
+    int args;
+
+    if(!snapshot_init(interval))
+    {
+        fprintf(stderr, "Could not start taking snapshots\n");
+        return false;
+    }
+
+    fprintf(stderr, "Snapshot every %llu instructions; type h for help\n",
+            (unsigned long long)interval);
+    debug_print_location();
+
+    for(;;)
+    {
+        fprintf(stderr, "(emu) ");
+
+        if(fgets(line, sizeof(line), stdin) == NULL)
+            break;
+
+        arg1 = arg2 = 0;
+        args = sscanf(line, "%255s %lli %lli", command, &arg1, &arg2);
+
+        if(args < 1)
+            continue;
+
+        if(args < 2)
+            arg1 = 1;
+
+        if(strcmp(command, "q") == 0)
+            break;
+        else if(strcmp(command, "h") == 0)
+        {
+            debug_print_help();
+            continue;
+        }
+        else if(strcmp(command, "r") == 0)
+        {
+            debug_print_regs();
+            continue;
+        }
+        else if(strcmp(command, "x") == 0)
+        {
+            if(args < 2)
+            {
+                debug_print_help();
+                continue;
+            }
+
+            debug_print_mem(arg1, (args < 3) ? 4 : arg2);
+            continue;
+        }
+        else if(strcmp(command, "s") == 0)
+        {
+            if(!snapshot_step(arg1))
+                fprintf(stderr, "Halted\n");
+        }
+        else if(strcmp(command, "rs") == 0)
+        {
+            target = (arg1 < machine->instret) ? machine->instret - arg1 : 0;
+
+            if(!snapshot_goto(target))
+                fprintf(stderr, "Can only go back to instruction %llu\n",
+                        (unsigned long long)snapshot_oldest());
+        }
+        else if(strcmp(command, "g") == 0)
+        {
+            if(args < 2)
+            {
+                debug_print_help();
+                continue;
+            }
+
+            if(!snapshot_goto(arg1))
+                fprintf(stderr, "Can only go to instructions from %llu "
+                        "until the program halts\n",
+                        (unsigned long long)snapshot_oldest());
+        }
+        else if(strcmp(command, "c") == 0)
+        {
+            if(debug_continue(engine))
+                fprintf(stderr, "Interrupted\n");
+            else
+                fprintf(stderr, "Halted\n");
+        }
+        else if(strcmp(command, "w") == 0)
+        {
+            if(args < 2)
+            {
+                debug_print_help();
+                continue;
+            }
+
+            if(args < 3)
+                arg2 = sizeof(word_t);
+
+            if((arg2 < 1) || (arg2 > sizeof(word_t)) ||
+               !debug_in_memory(arg1, arg2))
+            {
+                fprintf(stderr, "Can only watch 1 to 4 bytes of memory\n");
+                continue;
+            }
+
+            if(snapshot_find_change(arg1, arg2, &found))
+                fprintf(stderr, "Changed by instruction %llu\n",
+                        (unsigned long long)found);
+            else
+                fprintf(stderr, "Not changed since instruction %llu\n",
+                        (unsigned long long)snapshot_oldest());
+        }
+        else
+        {
+            debug_print_help();
+            continue;
+        }
+
+        debug_print_location();
+    }
+
+    fflush(stdout);
+    device_flush();
+
+    return true;
+}
@@ -0,0 +1,11 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include "processor.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool debug_run(proc_engine_t engine, uint64_t interval);
+
+#endif // DEBUG_H
@@ -0,0 +1,115 @@
+/**
+ * @brief The counter device.
+ *
+ * Lets guest code time itself. Four read-only word registers give the 64-bit
+ * cycle count under the cycle model (see cycles.h) and the 64-bit number of
+ * instructions retired, as of the start of the instruction that reads them:
+ *
+ *  0x00 CYCLE_LO    0x04 CYCLE_HI    0x08 INSTRET_LO    0x0C INSTRET_HI
+ *
+ * Reading a LO register latches the whole count, and the following read of
+ * its HI register returns the upper half of the latched count, so the two
+ * halves always belong together. Accesses narrower than a word, and all
+ * writes, fault.
+ */
+
+#include "device_counter.h"
+
+#include "architecture.h"
+#include "devices.h"
+#include "machine.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define COUNTER_DEVICE_ADDR_OFFSET (0x50001000)
+#define COUNTER_DEVICE_MAP_SIZE (4 * 4)
+
+#define COUNTER_CYCLE_LO (0x0)
+#define COUNTER_CYCLE_HI (0x4)
+#define COUNTER_INSTRET_LO (0x8)
+#define COUNTER_INSTRET_HI (0xC)
+
+typedef struct
+{
+    /*
+     * The upper halves latched by the last reads of CYCLE_LO and INSTRET_LO.
+     */
+    word_t cycle_hi;
+    word_t instret_hi;
+} counter_t;
+
+static word_t counter_read_word(device_mapping_t* device, word_t addr)
+{
+    counter_t* counter = (counter_t*)device->context;
+    word_t value = 0;
+
+    switch(addr - COUNTER_DEVICE_ADDR_OFFSET)
+    {
+        case COUNTER_CYCLE_LO:
+            counter->cycle_hi = (word_t)(machine->cycles >> 32);
+            value = (word_t)machine->cycles;
+            break;
+
+        case COUNTER_CYCLE_HI:
+            value = counter->cycle_hi;
+            break;
+
+        case COUNTER_INSTRET_LO:
+            counter->instret_hi = (word_t)(machine->instret >> 32);
+            value = (word_t)machine->instret;
+            break;
+
+        case COUNTER_INSTRET_HI:
+            value = counter->instret_hi;
+            break;
+    }
+
+    if(machine->verbosity)
+        printf("COUNTER READ WORD @0x%08x: 0x%08x\n", addr, value);
+
+    return value;
+}
+
+static void counter_destroy(device_mapping_t* device)
+{
+    free(device->context);
+}
+
+static const device_mapping_t counter_device_mapping =
+{
+    .base = COUNTER_DEVICE_ADDR_OFFSET,
+    .size = COUNTER_DEVICE_MAP_SIZE,
+    .read_byte = NULL,
+    .read_hword = NULL,
+    .read_word = counter_read_word,
+    .write_byte = NULL,
+    .write_hword = NULL,
+    .write_word = NULL,
+    .update = NULL,
+    .flush = NULL,
+    .destroy = counter_destroy
+};
+
+/**
+ * @brief Adds the counter device to the current machine.
+ */
+bool counter_init()
+{
+    device_mapping_t device_mapping = counter_device_mapping;
+    counter_t* counter = (counter_t*)calloc(1, sizeof(counter_t));
+
+    if(counter == NULL)
+        return false;
+
+    device_mapping.context = counter;
+
+    if(device_register(&device_mapping) == NULL)
+    {
+        free(counter);
+        return false;
+    }
+
+    return true;
+}
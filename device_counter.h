@@ -0,0 +1,8 @@
+#ifndef DEVICE_COUNTER_H
+#define DEVICE_COUNTER_H
+
+#include <stdbool.h>
+
+bool counter_init();
+
+#endif // DEVICE_COUNTER_H
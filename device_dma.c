@@ -0,0 +1,434 @@
+/**
+ * @brief The DMA engine.
+ *
+ * Copies and fills guest memory in bulk, with five word registers:
+ *
+ *  0x00 SRC        the source address; the value to fill with; or the device
+ *                  register to read
+ *  0x04 DST        the destination address
+ *  0x08 LEN        the number of bytes to transfer
+ *  0x0C CONTROL    bits 0-1 MODE, bit 2 INTEN; writing 1 to bit 31 START
+ *                  starts a transfer (read as 0)
+ *  0x10 STATUS     bit 0 BUSY (read-only), bit 1 DONE, bit 2 ERROR; writing
+ *                  1s clears DONE and ERROR
+ *
+ * The modes are:
+ *
+ *  0 COPY      copies LEN bytes from SRC to DST, as if through a buffer, so
+ *              the ranges may overlap,
+ *  1 FILL      fills LEN bytes at DST with copies of the word in SRC (the last
+ *              one cut short if LEN is not a multiple of 4),
+ *  2 DEVICE    reads the device register at SRC LEN / 4 times, storing the
+ *              words from DST up.
+ *
+ * Starting a transfer clears DONE and ERROR and sets BUSY; the registers are
+ * latched, and may be written again at once. Starting one while BUSY is set
+ * does nothing. The memory ranges must each lie in one region of ROM or RAM,
+ * and in DEVICE mode, SRC must be a word register and LEN a multiple of 4.
+ * Otherwise, nothing is transferred and ERROR is set. Accesses narrower than a
+ * word fault.
+ *
+ * A transfer takes the guest time given by the "dma" and "dma_word" entries
+ * of the cycle model (see cycles.h); with the default model, it finishes when
+ * the devices are next serviced. The processor carries on meanwhile, and the
+ * whole transfer is done when it finishes, with memmove() and memset() on the
+ * host memory backing the guest's: BUSY clears, DONE is set, and with INTEN
+ * set, the DMA interrupt line is raised (see device_intc.c). Memory therefore
+ * only changes at device events, so loops polling it or STATUS are still
+ * skipped (see processor_idle.c). Writes to ROM keep the predecoded
+ * instructions coherent.
+ *
+ * Finished transfers are logged as device actions, and done again when
+ * instructions are re-executed (see devices.c); the reads of DEVICE mode are
+ * replayed from the log like any other device reads.
+ */
+
+#include "device_dma.h"
+
+#include "architecture.h"
+#include "device_intc.h"
+#include "devices.h"
+#include "machine.h"
+#include "memmap.h"
+#include "processor.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DMA_DEVICE_ADDR_OFFSET (0x50004000)
+#define DMA_DEVICE_MAP_SIZE (5 * 4)
+
+#define DMA_SRC (0x0)
+#define DMA_DST (0x4)
+#define DMA_LEN (0x8)
+#define DMA_CONTROL (0xC)
+#define DMA_STATUS (0x10)
+
+#define DMA_CONTROL_MODE_MASK (3 << 0)
+#define DMA_CONTROL_INTEN (1 << 2)
+#define DMA_CONTROL_START (1u << 31)
+
+#define DMA_STATUS_BUSY (1 << 0)
+#define DMA_STATUS_DONE (1 << 1)
+#define DMA_STATUS_ERROR (1 << 2)
+
+#define DMA_MODE_COPY (0)
+#define DMA_MODE_FILL (1)
+#define DMA_MODE_DEVICE (2)
+
+/*
+ * The arguments of a transfer, as logged (see device_log_action()).
+ */
+#define DMA_ARG_MODE (0)
+#define DMA_ARG_SRC (1)
+#define DMA_ARG_DST (2)
+#define DMA_ARG_LEN (3)
+
+typedef struct
+{
+    word_t src;
+    word_t dst;
+    word_t len;
+    word_t control;
+    word_t status;
+
+    /*
+     * The transfer in flight while BUSY is set, whether it is one that fails,
+     * and the guest time at which it finishes.
+     */
+    word_t transfer[DEVICE_ACTION_ARGS];
+    bool failed;
+    uint64_t done_at;
+} dma_t;
+
+/**
+ * @brief Checks that a range of guest addresses lies in one region backed by
+ *        host memory, so that it is contiguous on the host too.
+ */
+static bool dma_range_valid(word_t addr, word_t len)
+{
+    uintptr_t bias = mem_page_bias(addr);
+    word_t page;
+
+    if((bias == 0) || (addr + len < addr))
+        return false;
+
+    for(page = mem_page_index(addr) + 1;
+        page <= mem_page_index(addr + len - 1); page++)
+        if(machine->page_table[page] != bias)
+            return false;
+
+    return true;
+}
+
+/**
+ * @brief Checks that a transfer can be done.
+ */
+static bool dma_transfer_valid(const word_t* transfer)
+{
+    device_mapping_t* device_mapping;
+    word_t src = transfer[DMA_ARG_SRC];
+    word_t len = transfer[DMA_ARG_LEN];
+
+    if(transfer[DMA_ARG_MODE] > DMA_MODE_DEVICE)
+        return false;
+
+    if(len == 0)
+        return true;
+
+    if(!dma_range_valid(transfer[DMA_ARG_DST], len))
+        return false;
+
+    switch(transfer[DMA_ARG_MODE])
+    {
+        case DMA_MODE_COPY:
+            return dma_range_valid(src, len);
+
+        case DMA_MODE_FILL:
+            return true;
+
+        case DMA_MODE_DEVICE:
+            return !(src & (sizeof(word_t) - 1)) &&
+                   !(len & (sizeof(word_t) - 1)) &&
+                   device_get_mapping_for_addr(src, &device_mapping) &&
+                   (device_mapping->read_word != NULL);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Fills len bytes of host memory with copies of a word.
+ */
+static void dma_fill(byte_t* dst, word_t value, word_t len)
+{
+    word_t i;
+
+    if(value == (value & 0xff) * 0x01010101u)
+    {
+        memset(dst, value & 0xff, len);
+        return;
+    }
+
+    for(i = 0; i + sizeof(word_t) <= len; i += sizeof(word_t))
+        memcpy(dst + i, &value, sizeof(word_t));
+
+    memcpy(dst + i, &value, len - i);
+}
+
+/**
+ * @brief Does a (valid) transfer. Also redoes logged transfers while
+ *        instructions are being re-executed.
+ */
+static void dma_transfer(const word_t* transfer)
+{
+    word_t src = transfer[DMA_ARG_SRC];
+    word_t dst = transfer[DMA_ARG_DST];
+    word_t len = transfer[DMA_ARG_LEN];
+    byte_t* host = (byte_t*)mem_host_addr(dst);
+    word_t value;
+    word_t i;
+
+    if(len == 0)
+        return;
+
+    switch(transfer[DMA_ARG_MODE])
+    {
+        case DMA_MODE_COPY:
+            memmove(host, (byte_t*)mem_host_addr(src), len);
+            break;
+
+        case DMA_MODE_FILL:
+            dma_fill(host, src, len);
+            break;
+
+        case DMA_MODE_DEVICE:
+            for(i = 0; i < len; i += sizeof(word_t))
+            {
+                value = device_read_word(src);
+                memcpy(host + i, &value, sizeof(word_t));
+            }
+            break;
+    }
+
+    proc_predecode_check(dst, len);
+}
+
+/**
+ * @brief Starts a transfer with the latched registers, unless one is in
+ *        flight.
+ */
+static void dma_start(dma_t* dma)
+{
+    cycle_model_t* model = &machine->cycle_model;
+    word_t words;
+
+    if(dma->status & DMA_STATUS_BUSY)
+        return;
+
+    dma->transfer[DMA_ARG_MODE] = dma->control & DMA_CONTROL_MODE_MASK;
+    dma->transfer[DMA_ARG_SRC] = dma->src;
+    dma->transfer[DMA_ARG_DST] = dma->dst;
+    dma->transfer[DMA_ARG_LEN] = dma->len;
+
+    dma->failed = !dma_transfer_valid(dma->transfer);
+    dma->status = DMA_STATUS_BUSY;
+    dma->done_at = machine->instret;
+
+    if(!dma->failed)
+    {
+        words = (dma->len + sizeof(word_t) - 1) / sizeof(word_t);
+        dma->done_at += model->dma + (uint64_t)model->dma_word * words;
+    }
+}
+
+static word_t dma_read_word(device_mapping_t* device, word_t addr)
+{
+    dma_t* dma = (dma_t*)device->context;
+    word_t value = 0;
+
+    switch(addr - DMA_DEVICE_ADDR_OFFSET)
+    {
+        case DMA_SRC:
+            value = dma->src;
+            break;
+
+        case DMA_DST:
+            value = dma->dst;
+            break;
+
+        case DMA_LEN:
+            value = dma->len;
+            break;
+
+        case DMA_CONTROL:
+            value = dma->control;
+            break;
+
+        case DMA_STATUS:
+            value = dma->status;
+            break;
+    }
+
+    if(machine->verbosity)
+        printf("DMA READ WORD @0x%08x: 0x%08x\n", addr, value);
+
+    return value;
+}
+
+static void dma_write_word(device_mapping_t* device, word_t addr, word_t value)
+{
+    dma_t* dma = (dma_t*)device->context;
+
+    if(machine->verbosity)
+        printf("DMA WRITE WORD @0x%08x: 0x%08x\n", addr, value);
+
+    switch(addr - DMA_DEVICE_ADDR_OFFSET)
+    {
+        case DMA_SRC:
+            dma->src = value;
+            break;
+
+        case DMA_DST:
+            dma->dst = value;
+            break;
+
+        case DMA_LEN:
+            dma->len = value;
+            break;
+
+        case DMA_CONTROL:
+            dma->control =
+                    value & (DMA_CONTROL_MODE_MASK | DMA_CONTROL_INTEN);
+
+            if(value & DMA_CONTROL_START)
+                dma_start(dma);
+            break;
+
+        case DMA_STATUS:
+            dma->status &= ~(value & (DMA_STATUS_DONE | DMA_STATUS_ERROR));
+            break;
+    }
+}
+
+/**
+ * @brief Schedules an event for the end of the transfer in flight, after any
+ *        access, and finishes the transfer at that event.
+ */
+static void dma_update(device_mapping_t* device, uint64_t now)
+{
+    dma_t* dma = (dma_t*)device->context;
+
+    if(!(dma->status & DMA_STATUS_BUSY))
+        return;
+
+    if(now < dma->done_at)
+    {
+        device_schedule(device, dma->done_at);
+        return;
+    }
+
+    device_schedule(device, DEVICE_NO_EVENT);
+
+    if(dma->failed)
+        dma->status = DMA_STATUS_DONE | DMA_STATUS_ERROR;
+    else
+    {
+        dma_transfer(dma->transfer);
+        device_log_action(device, dma->transfer);
+
+        dma->status = DMA_STATUS_DONE;
+    }
+
+    if(dma->control & DMA_CONTROL_INTEN)
+        intc_raise(INTC_LINE_DMA);
+}
+
+/**
+ * @brief Every register reads the same until the end of the transfer in
+ *        flight, which is a device event.
+ */
+static bool dma_poll_stable(device_mapping_t* device, word_t addr,
+                            word_t* value)
+{
+    dma_t* dma = (dma_t*)device->context;
+
+    switch(addr - DMA_DEVICE_ADDR_OFFSET)
+    {
+        case DMA_SRC:
+            *value = dma->src;
+            return true;
+
+        case DMA_DST:
+            *value = dma->dst;
+            return true;
+
+        case DMA_LEN:
+            *value = dma->len;
+            return true;
+
+        case DMA_CONTROL:
+            *value = dma->control;
+            return true;
+
+        case DMA_STATUS:
+            *value = dma->status;
+            return true;
+    }
+
+    return false;
+}
+
+static void dma_replay(device_mapping_t* device, const word_t* args)
+{
+    (void)device;
+
+    dma_transfer(args);
+}
+
+static void dma_destroy(device_mapping_t* device)
+{
+    free(device->context);
+}
+
+static const device_mapping_t dma_device_mapping =
+{
+    .base = DMA_DEVICE_ADDR_OFFSET,
+    .size = DMA_DEVICE_MAP_SIZE,
+    .read_byte = NULL,
+    .read_hword = NULL,
+    .read_word = dma_read_word,
+    .write_byte = NULL,
+    .write_hword = NULL,
+    .write_word = dma_write_word,
+    .update = dma_update,
+    .poll_stable = dma_poll_stable,
+    .replay = dma_replay,
+    .flush = NULL,
+    .destroy = dma_destroy
+};
+
+/**
+ * @brief Adds the DMA engine to the current machine.
+ */
+bool dma_init()
+{
+    device_mapping_t device_mapping = dma_device_mapping;
+    dma_t* dma = (dma_t*)calloc(1, sizeof(dma_t));
+
+    if(dma == NULL)
+        return false;
+
+    device_mapping.context = dma;
+
+    if(device_register(&device_mapping) == NULL)
+    {
+        free(dma);
+        return false;
+    }
+
+    return true;
+}
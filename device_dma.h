@@ -0,0 +1,8 @@
+#ifndef DEVICE_DMA_H
+#define DEVICE_DMA_H
+
+#include <stdbool.h>
+
+bool dma_init();
+
+#endif // DEVICE_DMA_H
@@ -0,0 +1,287 @@
+/**
+ * @brief The interrupt controller.
+ *
+ * Collects the interrupt lines of the other devices and interrupts the
+ * processor, with five word registers:
+ *
+ *  0x00 PENDING    the lines that are pending; writing 1s clears them
+ *  0x04 ENABLE     the lines that may interrupt the processor
+ *  0x08 RAISE      writing 1s makes lines pending (read as 0)
+ *  0x0C VECTORS    the address of the vector table (word-aligned)
+ *  0x10 ACTIVE     the line last taken, 0xFFFFFFFF before the first
+ *                  (read-only)
+ *
+ * A line is raised either by its device, once (the timer, when it reaches 0),
+ * or while a condition holds (the UART, while its receive FIFO holds data).
+ * Raised lines stay pending until they are taken or cleared; conditions are
+ * sampled every time the devices are serviced, and cannot be cleared but by
+ * their device. A device whose condition starts to hold on another thread
+ * (the UART, when input arrives) kicks the machine so that it is serviced at
+ * once (see device_kick()). Accesses narrower than a word fault.
+ *
+ * When the devices have been serviced, if an enabled line is pending and the
+ * processor has interrupts enabled (SR_INT_ENABLE_FLAG), the lowest such line
+ * is taken: it stops being pending, and the processor pushes the PC and the
+ * SR, disables interrupts and jumps to the handler whose address is word
+ * <line> of the vector table. The handler returns with RETI, which pops them
+ * again. Handlers are not preempted, since taking an interrupt disables
+ * interrupts; a handler may re-enable them itself. A WFI instruction sleeps
+ * until an enabled line is pending (see processor_idle.c).
+ *
+ * Every engine services the devices at exactly the same guest times, so
+ * interrupts are taken at the same instruction whatever the engine. They are
+ * logged, and taken again from the log when instructions are re-executed (see
+ * devices.c).
+ */
+
+#include "device_intc.h"
+
+#include "architecture.h"
+#include "devices.h"
+#include "machine.h"
+#include "memmap.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define INTC_DEVICE_ADDR_OFFSET (0x50003000)
+#define INTC_DEVICE_MAP_SIZE (5 * 4)
+
+#define INTC_PENDING (0x0)
+#define INTC_ENABLE (0x4)
+#define INTC_RAISE (0x8)
+#define INTC_VECTORS (0xC)
+#define INTC_ACTIVE (0x10)
+
+#define INTC_LINE_MASK ((word_t)((1ul << INTC_NUM_LINES) - 1))
+
+#define INTC_NO_LINE ((word_t)-1)
+
+typedef struct intc
+{
+    word_t pending;
+    word_t enable;
+    word_t vectors;
+    word_t active;
+
+    /*
+     * The lines raised by conditions, as of the last time they were sampled,
+     * and the conditions.
+     */
+    word_t levels;
+
+    struct
+    {
+        bool (*level)(void* context);
+        void* context;
+    } sources[INTC_NUM_LINES];
+} intc_t;
+
+/**
+ * @brief Samples the conditions attached to the lines, and works out whether
+ *        an enabled line is pending.
+ */
+static void intc_sample(intc_t* intc)
+{
+    word_t line;
+
+    intc->levels = 0;
+
+    for(line = 0; line < INTC_NUM_LINES; line++)
+        if((intc->sources[line].level != NULL) &&
+           intc->sources[line].level(intc->sources[line].context))
+            intc->levels |= 1 << line;
+
+    machine->irq_pending =
+            ((intc->pending | intc->levels) & intc->enable) != 0;
+}
+
+/**
+ * @brief Returns the handler for a line from the vector table, or 0 if the
+ *        table is not in ROM or RAM.
+ */
+static word_t intc_vector(const intc_t* intc, word_t line)
+{
+    word_t addr = intc->vectors + line * sizeof(word_t);
+
+    if(!mem_page_bias(addr))
+        return 0;
+
+    return *(word_t*)mem_host_addr(addr);
+}
+
+static word_t intc_read_word(device_mapping_t* device, word_t addr)
+{
+    intc_t* intc = (intc_t*)device->context;
+    word_t value = 0;
+
+    switch(addr - INTC_DEVICE_ADDR_OFFSET)
+    {
+        case INTC_PENDING:
+            intc_sample(intc);
+            value = intc->pending | intc->levels;
+            break;
+
+        case INTC_ENABLE:
+            value = intc->enable;
+            break;
+
+        case INTC_VECTORS:
+            value = intc->vectors;
+            break;
+
+        case INTC_ACTIVE:
+            value = intc->active;
+            break;
+    }
+
+    if(machine->verbosity)
+        printf("INTC READ WORD @0x%08x: 0x%08x\n", addr, value);
+
+    return value;
+}
+
+static void intc_write_word(device_mapping_t* device, word_t addr,
+                            word_t value)
+{
+    intc_t* intc = (intc_t*)device->context;
+
+    if(machine->verbosity)
+        printf("INTC WRITE WORD @0x%08x: 0x%08x\n", addr, value);
+
+    switch(addr - INTC_DEVICE_ADDR_OFFSET)
+    {
+        case INTC_PENDING:
+            intc->pending &= ~value;
+            break;
+
+        case INTC_ENABLE:
+            intc->enable = value & INTC_LINE_MASK;
+            break;
+
+        case INTC_RAISE:
+            intc->pending |= value & INTC_LINE_MASK;
+            break;
+
+        case INTC_VECTORS:
+            intc->vectors = value & ~(word_t)(sizeof(word_t) - 1);
+            break;
+    }
+}
+
+/**
+ * @brief Called after an access. An interrupt that the access raised or
+ *        enabled is taken at the end of the same servicing.
+ */
+static void intc_update(device_mapping_t* device, uint64_t now)
+{
+    (void)now;
+
+    intc_sample((intc_t*)device->context);
+}
+
+/**
+ * @brief Called at the end of every servicing of the devices (see
+ *        devices.h): takes the highest-priority enabled pending line, if the
+ *        processor has interrupts enabled.
+ */
+static void intc_poll()
+{
+    intc_t* intc = machine->intc;
+    word_t line;
+
+    intc_sample(intc);
+
+    if(!machine->irq_pending ||
+       !(machine->regs.SR & SR_INT_ENABLE_FLAG))
+        return;
+
+    line = __builtin_ctz((intc->pending | intc->levels) & intc->enable);
+
+    intc->pending &= ~(1 << line);
+    intc->active = line;
+
+    intc_sample(intc);
+
+    device_interrupt(intc_vector(intc, line));
+}
+
+static void intc_destroy(device_mapping_t* device)
+{
+    free(device->context);
+
+    machine->intc = NULL;
+}
+
+static const device_mapping_t intc_device_mapping =
+{
+    .base = INTC_DEVICE_ADDR_OFFSET,
+    .size = INTC_DEVICE_MAP_SIZE,
+    .read_byte = NULL,
+    .read_hword = NULL,
+    .read_word = intc_read_word,
+    .write_byte = NULL,
+    .write_hword = NULL,
+    .write_word = intc_write_word,
+    .update = intc_update,
+    .flush = NULL,
+    .destroy = intc_destroy
+};
+
+/**
+ * @brief Makes a line pending. Called by devices from their update, so that
+ *        the interrupt is taken at the end of the same servicing.
+ */
+void intc_raise(word_t line)
+{
+    if(machine->intc == NULL)
+        return;
+
+    machine->intc->pending |= 1 << line;
+
+    intc_sample(machine->intc);
+}
+
+/**
+ * @brief Raises a line for as long as a condition holds. The condition is
+ *        called with the given context whenever the devices are serviced.
+ */
+void intc_attach(word_t line, bool (*level)(void* context), void* context)
+{
+    if(machine->intc == NULL)
+        return;
+
+    machine->intc->sources[line].level = level;
+    machine->intc->sources[line].context = context;
+}
+
+/**
+ * @brief Adds the interrupt controller to the current machine. Must be added
+ *        before the devices that raise its lines.
+ */
+bool intc_init()
+{
+    device_mapping_t device_mapping = intc_device_mapping;
+    intc_t* intc = (intc_t*)calloc(1, sizeof(intc_t));
+
+    if(intc == NULL)
+        return false;
+
+    intc->active = INTC_NO_LINE;
+
+    device_mapping.context = intc;
+
+    if(device_register(&device_mapping) == NULL)
+    {
+        free(intc);
+        return false;
+    }
+
+    machine->intc = intc;
+    machine->irq_pending = false;
+    machine->device_interrupt_poll = intc_poll;
+
+    return true;
+}
@@ -0,0 +1,21 @@
+#ifndef DEVICE_INTC_H
+#define DEVICE_INTC_H
+
+#include "architecture.h"
+
+#include <stdbool.h>
+
+/*
+ * The interrupt lines, in priority order (line 0 is taken first).
+ */
+#define INTC_NUM_LINES (16)
+
+#define INTC_LINE_TIMER (0)
+#define INTC_LINE_UART (1)
+#define INTC_LINE_DMA (2)
+
+bool intc_init();
+void intc_raise(word_t line);
+void intc_attach(word_t line, bool (*level)(void* context), void* context);
+
+#endif // DEVICE_INTC_H
@@ -0,0 +1,304 @@
+/**
+ * @brief The timer device.
+ *
+ * A down-counter clocked by guest time, one tick per instruction retired,
+ * with four word registers:
+ *
+ *  0x00 CONTROL    bit 0 ENABLE, bit 1 TICKINT, bit 16 COUNTFLAG (read-only)
+ *  0x04 RELOAD     the value the counter restarts from
+ *  0x08 CURRENT    the counter
+ *  0x0C STATUS     bit 0 COUNTFLAG (read-only)
+ *
+ * While enabled with a nonzero RELOAD, the counter counts down from RELOAD to
+ * 0 and then starts again from RELOAD, so it reaches 0 every RELOAD + 1
+ * ticks. COUNTFLAG is set whenever it reaches 0, and cleared by reading
+ * CONTROL or writing CURRENT; reading STATUS leaves it alone, so that it can
+ * be polled. Writing RELOAD or CURRENT restarts the count from RELOAD.
+ * Disabling the timer stops the counter where it is. With TICKINT set, the
+ * timer also raises its interrupt line whenever the counter reaches 0 (see
+ * device_intc.c). Accesses narrower than a word fault.
+ *
+ * The counter is not stepped: its value is worked out from the guest time
+ * when it is read, and the device only schedules an event for the next time
+ * it reaches 0. Until then, reads of STATUS (and of CONTROL, while COUNTFLAG
+ * is clear) are stable, so loops polling them are skipped (see
+ * processor_idle.c).
+ */
+
+#include "device_timer.h"
+
+#include "architecture.h"
+#include "device_intc.h"
+#include "devices.h"
+#include "machine.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TIMER_DEVICE_ADDR_OFFSET (0x50002000)
+#define TIMER_DEVICE_MAP_SIZE (4 * 4)
+
+#define TIMER_CONTROL (0x0)
+#define TIMER_RELOAD (0x4)
+#define TIMER_CURRENT (0x8)
+#define TIMER_STATUS (0xC)
+
+#define TIMER_CONTROL_ENABLE (1 << 0)
+#define TIMER_CONTROL_TICKINT (1 << 1)
+#define TIMER_CONTROL_COUNTFLAG (1 << 16)
+
+#define TIMER_STATUS_COUNTFLAG (1 << 0)
+
+typedef struct
+{
+    word_t control;
+    word_t reload;
+
+    /*
+     * The guest time at which the counter was last at RELOAD while enabled,
+     * and its value while it is disabled.
+     */
+    uint64_t start;
+    word_t stopped;
+
+    /*
+     * COUNTFLAG as of the last time it was worked out, and that time: it is
+     * also set if the counter has reached 0 since.
+     */
+    bool countflag;
+    uint64_t countflag_at;
+} timer_device_t;
+
+/**
+ * @brief Returns true if the counter is running.
+ */
+static bool timer_running(const timer_device_t* timer)
+{
+    return (timer->control & TIMER_CONTROL_ENABLE) && (timer->reload != 0);
+}
+
+/**
+ * @brief Works out the value of the counter at the given guest time.
+ */
+static word_t timer_current(const timer_device_t* timer, uint64_t now)
+{
+    if(!timer_running(timer))
+        return timer->stopped;
+
+    return timer->reload -
+           (word_t)((now - timer->start) % ((uint64_t)timer->reload + 1));
+}
+
+/**
+ * @brief Works out COUNTFLAG at the given guest time.
+ */
+static bool timer_countflag(const timer_device_t* timer, uint64_t now)
+{
+    uint64_t since;
+
+    if(timer->countflag || !timer_running(timer))
+        return timer->countflag;
+
+    /*
+     * The counter reached 0 last at now - since (if it has yet).
+     */
+    if(now - timer->start < timer->reload)
+        return false;
+
+    since = (now - timer->start - timer->reload) %
+            ((uint64_t)timer->reload + 1);
+
+    return now - since > timer->countflag_at;
+}
+
+/**
+ * @brief Brings COUNTFLAG up to the given guest time.
+ */
+static void timer_sync(timer_device_t* timer, uint64_t now)
+{
+    timer->countflag = timer_countflag(timer, now);
+    timer->countflag_at = now;
+}
+
+/**
+ * @brief Restarts the count from RELOAD at the given guest time.
+ */
+static void timer_restart(timer_device_t* timer, uint64_t now)
+{
+    timer->start = now;
+    timer->stopped = timer->reload;
+}
+
+static word_t timer_read_word(device_mapping_t* device, word_t addr)
+{
+    timer_device_t* timer = (timer_device_t*)device->context;
+    uint64_t now = machine->instret;
+    word_t value = 0;
+
+    switch(addr - TIMER_DEVICE_ADDR_OFFSET)
+    {
+        case TIMER_CONTROL:
+            value = timer->control;
+
+            if(timer_countflag(timer, now))
+                value |= TIMER_CONTROL_COUNTFLAG;
+
+            timer->countflag = false;
+            timer->countflag_at = now;
+            break;
+
+        case TIMER_RELOAD:
+            value = timer->reload;
+            break;
+
+        case TIMER_CURRENT:
+            value = timer_current(timer, now);
+            break;
+
+        case TIMER_STATUS:
+            if(timer_countflag(timer, now))
+                value = TIMER_STATUS_COUNTFLAG;
+            break;
+    }
+
+    if(machine->verbosity)
+        printf("TIMER READ WORD @0x%08x: 0x%08x\n", addr, value);
+
+    return value;
+}
+
+static void timer_write_word(device_mapping_t* device, word_t addr,
+                             word_t value)
+{
+    timer_device_t* timer = (timer_device_t*)device->context;
+    uint64_t now = machine->instret;
+    word_t current;
+
+    if(machine->verbosity)
+        printf("TIMER WRITE WORD @0x%08x: 0x%08x\n", addr, value);
+
+    timer_sync(timer, now);
+
+    switch(addr - TIMER_DEVICE_ADDR_OFFSET)
+    {
+        case TIMER_CONTROL:
+            /*
+             * Carry the counter's value across a change of state.
+             */
+            current = timer_current(timer, now);
+
+            timer->control =
+                    value & (TIMER_CONTROL_ENABLE | TIMER_CONTROL_TICKINT);
+
+            if(timer_running(timer))
+                timer->start = now - (timer->reload - current);
+            else
+                timer->stopped = current;
+            break;
+
+        case TIMER_RELOAD:
+            timer->reload = value;
+            timer_restart(timer, now);
+            break;
+
+        case TIMER_CURRENT:
+            timer->countflag = false;
+            timer_restart(timer, now);
+            break;
+    }
+}
+
+/**
+ * @brief Schedules an event for the next time the counter reaches 0, after
+ *        any access and after each such event, and raises the interrupt line
+ *        if it just has.
+ */
+static void timer_update(device_mapping_t* device, uint64_t now)
+{
+    timer_device_t* timer = (timer_device_t*)device->context;
+    word_t current = timer_current(timer, now);
+
+    if(!timer_running(timer))
+    {
+        device_schedule(device, DEVICE_NO_EVENT);
+        return;
+    }
+
+    if((current == 0) && (timer->control & TIMER_CONTROL_TICKINT))
+        intc_raise(INTC_LINE_TIMER);
+
+    device_schedule(device, now + (current ? current :
+                                    (uint64_t)timer->reload + 1));
+}
+
+static bool timer_poll_stable(device_mapping_t* device, word_t addr,
+                              word_t* value)
+{
+    timer_device_t* timer = (timer_device_t*)device->context;
+    uint64_t now = machine->instret;
+
+    if(timer_countflag(timer, now))
+        return false;
+
+    switch(addr - TIMER_DEVICE_ADDR_OFFSET)
+    {
+        case TIMER_CONTROL:
+            *value = timer->control;
+            return true;
+
+        case TIMER_RELOAD:
+            *value = timer->reload;
+            return true;
+
+        case TIMER_STATUS:
+            *value = 0;
+            return true;
+    }
+
+    return false;
+}
+
+static void timer_destroy(device_mapping_t* device)
+{
+    free(device->context);
+}
+
+static const device_mapping_t timer_device_mapping =
+{
+    .base = TIMER_DEVICE_ADDR_OFFSET,
+    .size = TIMER_DEVICE_MAP_SIZE,
+    .read_byte = NULL,
+    .read_hword = NULL,
+    .read_word = timer_read_word,
+    .write_byte = NULL,
+    .write_hword = NULL,
+    .write_word = timer_write_word,
+    .update = timer_update,
+    .poll_stable = timer_poll_stable,
+    .flush = NULL,
+    .destroy = timer_destroy
+};
+
+/**
+ * @brief Adds the timer device to the current machine.
+ */
+bool timer_init()
+{
+    device_mapping_t device_mapping = timer_device_mapping;
+    timer_device_t* timer = (timer_device_t*)calloc(1, sizeof(timer_device_t));
+
+    if(timer == NULL)
+        return false;
+
+    device_mapping.context = timer;
+
+    if(device_register(&device_mapping) == NULL)
+    {
+        free(timer);
+        return false;
+    }
+
+    return true;
+}
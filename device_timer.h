@@ -0,0 +1,8 @@
+#ifndef DEVICE_TIMER_H
+#define DEVICE_TIMER_H
+
+#include <stdbool.h>
+
+bool timer_init();
+
+#endif // DEVICE_TIMER_H
@@ -1,16 +1,66 @@
+/*
+ * For accept4() and the pseudo-terminal functions.
+ */
+#define _GNU_SOURCE
+
 #include "device_uart.h"
 
 #include "architecture.h"
+#include "device_intc.h"
 #include "devices.h"
-#include "global_config.h"
+#include "machine.h"
+
+#include "ring.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
 
 #define UART_DEVICE_ADDR_OFFSET (0x50000000)
 #define UART_DEVICE_MAP_SIZE (4 * 3)
 
+#define UART_CONTROL_TX_FLAG (0x1)
+
+/*
+ * Read-only receive status, refreshed on every read of the control register:
+ * whether the receive FIFO holds any data, whether the input source has
+ * closed for good, and (in the upper halfword) the number of bytes in the
+ * FIFO, saturating at 0xFFFF.
+ */
+#define UART_CONTROL_RX_READY_FLAG (0x2)
+#define UART_CONTROL_RX_CLOSED_FLAG (0x4)
+#define UART_CONTROL_RX_DEPTH_SHIFT (16)
+#define UART_CONTROL_RX_DEPTH_MAX (0xFFFF)
+
+/*
+ * Size of the transmit ring between the emulation thread and the I/O thread.
+ */
+#define UART_TX_RING_SIZE (64 * 1024)
+
+/*
+ * Size of the receive FIFO between the input thread and the emulation thread.
+ */
+#define UART_RX_RING_SIZE (4 * 1024)
+
+/*
+ * How long the input thread backs off when the receive FIFO is full, in
+ * microseconds.
+ */
+#define UART_RX_BACKOFF_US (1000)
+
 typedef struct
 {
     word_t txbuf;
@@ -18,74 +68,873 @@ typedef struct
     word_t control;
 } uart_regs_t;
 
-uart_regs_t uart_regs;
+/*
+ * The state of one UART.
+ */
+typedef struct
+{
+    uart_regs_t regs;
+
+    /*
+     * Transmit path. Characters are pushed into a ring by the emulation
+     * thread and written out in batches by a dedicated I/O thread.
+     */
+    ring_t tx_ring;
+    int tx_fd;
+    FILE* tx_pipe;
+    bool tx_owned;
+
+    bool tx_async;
+    pthread_t tx_thread;
+    pthread_mutex_t tx_lock;
+    pthread_cond_t tx_ready;
+    pthread_cond_t tx_drained;
+    atomic_bool tx_waiting;
+    bool tx_stop;
+
+    /*
+     * Receive path. An input thread waits on the source with epoll and fills
+     * the receive FIFO, which the guest drains through rxbuf. The UART's
+     * interrupt line is raised while the FIFO holds data. The emulation
+     * thread can wait for data on rx_filled.
+     */
+    ring_t rx_ring;
+    int rx_fd;
+    int rx_listen_fd;
+    int rx_pty_slave_fd;
+    int rx_epoll_fd;
+    int rx_wake_fd;
+    int rx_stdin_flags;
+    const char* rx_socket_path;
+
+    bool rx_async;
+    bool rx_regular;
+    pthread_t rx_thread;
+    atomic_bool rx_closed;
+    pthread_mutex_t rx_lock;
+    pthread_cond_t rx_filled;
+
+    /*
+     * The machine to kick when the receive FIFO stops being empty.
+     */
+    machine_t* rx_machine;
+} uart_t;
+
+/**
+ * @brief Writes everything in the transmit ring to the sink, sleeping while
+ *        the ring is empty.
+ */
+static void* uart_tx_main(void* arg)
+{
+    uart_t* uart = (uart_t*)arg;
+    struct iovec iov[2];
+    ssize_t written;
+    bool done;
+    int segments;
+
+    for(;;)
+    {
+        segments = ring_peek(&uart->tx_ring, iov);
+
+        if(segments == 0)
+        {
+            /*
+             * Announce that we are about to sleep before re-checking the ring,
+             * so that a producer either sees the flag or we see its data.
+             */
+            pthread_mutex_lock(&uart->tx_lock);
+
+            atomic_store(&uart->tx_waiting, true);
+            pthread_cond_broadcast(&uart->tx_drained);
+
+            while((ring_count(&uart->tx_ring) == 0) && !uart->tx_stop)
+                pthread_cond_wait(&uart->tx_ready, &uart->tx_lock);
+
+            atomic_store(&uart->tx_waiting, false);
+            done = uart->tx_stop && (ring_count(&uart->tx_ring) == 0);
+
+            pthread_mutex_unlock(&uart->tx_lock);
+
+            if(done)
+                return NULL;
+
+            continue;
+        }
+
+        written = writev(uart->tx_fd, iov, segments);
+
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            /*
+             * The sink has gone away; drop the output rather than stall the
+             * guest.
+             */
+            written = iov[0].iov_len + ((segments > 1) ? iov[1].iov_len : 0);
+        }
 
-byte_t* uart_get_byte(word_t addr)
+        ring_consume(&uart->tx_ring, written);
+    }
+}
+
+/**
+ * @brief Wakes the I/O thread if it is waiting for data.
+ */
+static void uart_tx_wake(uart_t* uart)
 {
-    if(global_verbosity)
-        printf("UART GET BYTE @0x%08x\n", addr);
+    if(!atomic_load(&uart->tx_waiting))
+        return;
 
-    return ((byte_t*)(((byte_t*)&uart_regs) +
-                      (addr - UART_DEVICE_ADDR_OFFSET)));
+    pthread_mutex_lock(&uart->tx_lock);
+    pthread_cond_signal(&uart->tx_ready);
+    pthread_mutex_unlock(&uart->tx_lock);
 }
 
-hword_t* uart_get_hword(word_t addr)
+/**
+ * @brief Queues a character for transmission, waiting for the I/O thread if
+ *        the ring is full.
+ */
+static void uart_tx_push(uart_t* uart, byte_t c)
 {
-    if(global_verbosity)
-        printf("UART GET HWORD @0x%08x\n", addr);
+    while(ring_push(&uart->tx_ring, &c, 1) == 0)
+    {
+        uart_tx_wake(uart);
+        sched_yield();
+    }
 
-    return ((hword_t*)(((byte_t*)&uart_regs) +
-                       (addr - UART_DEVICE_ADDR_OFFSET)));
+    uart_tx_wake(uart);
 }
 
-word_t* uart_get_word(word_t addr)
+/**
+ * @brief Transmits the character in txbuf if the transmit flag is set.
+ */
+static void uart_transmit(uart_t* uart)
 {
-    if(global_verbosity)
-        printf("UART GET WORD @0x%08x\n", addr);
+    if(!(uart->regs.control & UART_CONTROL_TX_FLAG))
+        return;
+
+    /*
+     * Verbose output is interleaved with the transmitted characters, so it
+     * is written synchronously to keep it in order.
+     */
+    if(machine->verbosity)
+        printf("UART WRITING CHARACTER: %c\n", (char)uart->regs.txbuf);
+    else if(uart->tx_async)
+        uart_tx_push(uart, (byte_t)uart->regs.txbuf);
+    else
+    {
+        byte_t c = (byte_t)uart->regs.txbuf;
 
-    return ((word_t*)(((byte_t*)&uart_regs) +
-                      (addr - UART_DEVICE_ADDR_OFFSET)));
+        if(write(uart->tx_fd, &c, 1) < 0)
+        {
+            /*
+             * As in the I/O thread, output to a closed sink is dropped.
+             */
+        }
+    }
+
+    /*
+     * Clear the flag.
+     */
+    uart->regs.control &= ~UART_CONTROL_TX_FLAG;
 }
 
-bool uart_get_addr_in_map(word_t addr)
+/**
+ * @brief Wakes the emulation thread if it is waiting for input.
+ */
+static void uart_rx_signal(uart_t* uart)
 {
-    return (addr >= UART_DEVICE_ADDR_OFFSET) && 
-           (addr < UART_DEVICE_ADDR_OFFSET + UART_DEVICE_MAP_SIZE);
+    pthread_mutex_lock(&uart->rx_lock);
+    pthread_cond_signal(&uart->rx_filled);
+    pthread_mutex_unlock(&uart->rx_lock);
 }
 
-void uart_update()
+/**
+ * @brief Stops watching the input source, closing it unless it is stdin.
+ */
+static void uart_rx_close_source(uart_t* uart)
 {
-    if(global_verbosity)
-        printf("UART UPDATE\n");
+    if(!uart->rx_regular)
+        epoll_ctl(uart->rx_epoll_fd, EPOLL_CTL_DEL, uart->rx_fd, NULL);
+
+    if(uart->rx_fd != STDIN_FILENO)
+        close(uart->rx_fd);
+
+    uart->rx_fd = -1;
+    uart->rx_regular = false;
+
     /*
-     * Write the rxbuf to stdout if the transmit flag is set.
+     * A socket listener accepts the next client; any other source is gone for
+     * good.
      */
-    if (uart_regs.control & 0x1)
+    if(uart->rx_listen_fd < 0)
     {
-        if(global_verbosity)
-            printf("UART WRITING CHARACTER: %c\n", (char)uart_regs.txbuf);
-        else
-            printf("%c", (char)uart_regs.txbuf);
+        atomic_store(&uart->rx_closed, true);
+        uart_rx_signal(uart);
+    }
+}
+
+/**
+ * @brief Reads whatever the input source has available into the receive
+ *        FIFO.
+ */
+static void uart_rx_fill(uart_t* uart)
+{
+    byte_t buffer[UART_RX_RING_SIZE];
+    word_t space;
+    ssize_t count;
+
+    for(;;)
+    {
+        space = uart->rx_ring.size - ring_count(&uart->rx_ring);
+
+        /*
+         * Leave the data with the source until the guest makes room.
+         */
+        if(space == 0)
+        {
+            usleep(UART_RX_BACKOFF_US);
+            return;
+        }
+
+        count = read(uart->rx_fd, buffer, space);
+
+        if(count > 0)
+        {
+            ring_push(&uart->rx_ring, buffer, count);
+            uart_rx_signal(uart);
+
+            /*
+             * If the FIFO holds no more than was just pushed, it has been
+             * empty since the last push: have the devices serviced now, so
+             * that the interrupt line is raised without waiting for the next
+             * event.
+             */
+            if(ring_count(&uart->rx_ring) <= (word_t)count)
+                device_kick(uart->rx_machine);
+
+            continue;
+        }
+
+        if((count < 0) && (errno == EINTR))
+            continue;
+
+        if((count < 0) && (errno == EAGAIN))
+            return;
+
+        /*
+         * End of input, or the other end of a pseudo-terminal or socket went
+         * away.
+         */
+        uart_rx_close_source(uart);
+        return;
+    }
+}
 
+/**
+ * @brief Waits for input on the source (and for clients on a socket) and
+ *        moves it into the receive FIFO.
+ */
+static void* uart_rx_main(void* arg)
+{
+    uart_t* uart = (uart_t*)arg;
+    struct epoll_event events[4];
+    struct epoll_event event;
+    int count, client, i;
 
+    for(;;)
+    {
         /*
-         * Clear the flag.
+         * Regular files cannot be watched with epoll but are always readable.
          */
-        uart_regs.control &= ~0x1;
+        count = epoll_wait(uart->rx_epoll_fd, events, 4,
+                           uart->rx_regular ? 0 : -1);
+
+        if(count < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            return NULL;
+        }
+
+        if(uart->rx_regular)
+            uart_rx_fill(uart);
+
+        for(i = 0; i < count; i++)
+        {
+            if(events[i].data.fd == uart->rx_wake_fd)
+                return NULL;
+
+            if(events[i].data.fd == uart->rx_listen_fd)
+            {
+                client = accept4(uart->rx_listen_fd, NULL, NULL,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+                if(client < 0)
+                    continue;
+
+                /*
+                 * Serve one client at a time.
+                 */
+                if(uart->rx_fd >= 0)
+                {
+                    close(client);
+                    continue;
+                }
+
+                uart->rx_fd = client;
+
+                event.events = EPOLLIN;
+                event.data.fd = client;
+                epoll_ctl(uart->rx_epoll_fd, EPOLL_CTL_ADD, client, &event);
+            }
+            else if(events[i].data.fd == uart->rx_fd)
+                uart_rx_fill(uart);
+        }
+    }
+}
+
+/**
+ * @brief Opens a pseudo-terminal in raw mode, returning its (non-blocking)
+ *        master side.
+ */
+static int uart_rx_open_pty(uart_t* uart)
+{
+    struct termios attributes;
+    const char* name;
+    int master;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if(master < 0)
+        return -1;
+
+    if((grantpt(master) != 0) || (unlockpt(master) != 0) ||
+       ((name = ptsname(master)) == NULL))
+    {
+        close(master);
+        return -1;
+    }
+
+    /*
+     * Hold the slave side open so the master does not report a hangup every
+     * time a terminal program disconnects from it.
+     */
+    uart->rx_pty_slave_fd = open(name, O_RDWR | O_NOCTTY);
+
+    if(uart->rx_pty_slave_fd < 0)
+    {
+        close(master);
+        return -1;
+    }
+
+    if(tcgetattr(uart->rx_pty_slave_fd, &attributes) == 0)
+    {
+        cfmakeraw(&attributes);
+        tcsetattr(uart->rx_pty_slave_fd, TCSANOW, &attributes);
+    }
+
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+
+    fprintf(stderr, "UART input on %s\n", name);
+
+    return master;
+}
+
+/**
+ * @brief Creates a Unix socket listening at the given path.
+ */
+static int uart_rx_open_socket(uart_t* uart, const char* path)
+{
+    struct sockaddr_un address;
+    int listener;
+
+    if(strlen(path) >= sizeof(address.sun_path))
+        return -1;
+
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if(listener < 0)
+        return -1;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    unlink(path);
+
+    if((bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0) ||
+       (listen(listener, 1) != 0))
+    {
+        close(listener);
+        return -1;
+    }
+
+    uart->rx_socket_path = path;
+
+    return listener;
+}
+
+/**
+ * @brief Opens the input source and starts the input thread.
+ */
+static bool uart_rx_init(uart_t* uart, const char* rx_source)
+{
+    struct epoll_event event;
+    int watch_fd;
+
+    atomic_init(&uart->rx_closed, false);
+
+    if(!ring_init(&uart->rx_ring, UART_RX_RING_SIZE))
+        return false;
+
+    /*
+     * Without a source the FIFO simply stays empty.
+     */
+    if(rx_source == NULL)
+        return true;
+
+    if(strcmp(rx_source, "-") == 0)
+    {
+        uart->rx_fd = STDIN_FILENO;
+        uart->rx_stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
+        fcntl(STDIN_FILENO, F_SETFL, uart->rx_stdin_flags | O_NONBLOCK);
+    }
+    else if(strcmp(rx_source, "pty") == 0)
+        uart->rx_fd = uart_rx_open_pty(uart);
+    else if(strncmp(rx_source, "unix:", 5) == 0)
+        uart->rx_listen_fd = uart_rx_open_socket(uart, rx_source + 5);
+
+    if((uart->rx_fd < 0) && (uart->rx_listen_fd < 0))
+        return false;
+
+    uart->rx_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    uart->rx_wake_fd = eventfd(0, EFD_CLOEXEC);
+
+    if((uart->rx_epoll_fd < 0) || (uart->rx_wake_fd < 0))
+        return false;
+
+    event.events = EPOLLIN;
+    event.data.fd = uart->rx_wake_fd;
+    epoll_ctl(uart->rx_epoll_fd, EPOLL_CTL_ADD, uart->rx_wake_fd, &event);
+
+    watch_fd = (uart->rx_listen_fd >= 0) ? uart->rx_listen_fd : uart->rx_fd;
+
+    event.events = EPOLLIN;
+    event.data.fd = watch_fd;
+
+    if(epoll_ctl(uart->rx_epoll_fd, EPOLL_CTL_ADD, watch_fd, &event) != 0)
+    {
+        if(errno != EPERM)
+            return false;
+
+        uart->rx_regular = true;
     }
+
+    uart->rx_async = (pthread_create(&uart->rx_thread, NULL, uart_rx_main,
+                                     uart) == 0);
+
+    return uart->rx_async;
+}
+
+/**
+ * @brief Pops up to width bytes from the receive FIFO, packed little-endian
+ *        into the returned value. The depth field of the control register
+ *        says how many of them are valid.
+ */
+static word_t uart_rx_pop(uart_t* uart, word_t width)
+{
+    word_t value = 0;
+
+    ring_pop(&uart->rx_ring, (byte_t*)&value, width);
+
+    uart->regs.rxbuf = value;
+
+    return value;
+}
+
+/**
+ * @brief Refreshes the receive status bits of the control register.
+ */
+static void uart_rx_status(uart_t* uart)
+{
+    word_t depth = ring_count(&uart->rx_ring);
+
+    uart->regs.control &= ~(UART_CONTROL_RX_READY_FLAG |
+                           UART_CONTROL_RX_CLOSED_FLAG |
+                           (UART_CONTROL_RX_DEPTH_MAX <<
+                            UART_CONTROL_RX_DEPTH_SHIFT));
+
+    if(depth > UART_CONTROL_RX_DEPTH_MAX)
+        depth = UART_CONTROL_RX_DEPTH_MAX;
+
+    if(depth != 0)
+        uart->regs.control |= UART_CONTROL_RX_READY_FLAG;
+    else if(atomic_load(&uart->rx_closed))
+        uart->regs.control |= UART_CONTROL_RX_CLOSED_FLAG;
+
+    uart->regs.control |= depth << UART_CONTROL_RX_DEPTH_SHIFT;
+}
+
+/**
+ * @brief Reads width bytes of the register file. A read of rxbuf consumes
+ *        that many bytes from the receive FIFO.
+ */
+static word_t uart_read(uart_t* uart, word_t addr, word_t width)
+{
+    word_t offset = addr - UART_DEVICE_ADDR_OFFSET;
+    word_t value = 0;
+
+    if(offset + width > UART_DEVICE_MAP_SIZE)
+        width = UART_DEVICE_MAP_SIZE - offset;
+
+    if(offset == offsetof(uart_regs_t, rxbuf))
+        return uart_rx_pop(uart, width);
+
+    uart_rx_status(uart);
+
+    memcpy(&value, ((byte_t*)&uart->regs) + offset, width);
+
+    return value;
+}
+
+/**
+ * @brief Writes width bytes of the register file. A write that sets the
+ *        transmit flag in the control register sends the character
+ *        immediately.
+ */
+static void uart_write(uart_t* uart, word_t addr, word_t value,
+                       word_t width)
+{
+    word_t offset = addr - UART_DEVICE_ADDR_OFFSET;
+
+    if(offset + width > UART_DEVICE_MAP_SIZE)
+        width = UART_DEVICE_MAP_SIZE - offset;
+
+    memcpy(((byte_t*)&uart->regs) + offset, &value, width);
+
+    if(offset + width > offsetof(uart_regs_t, control))
+        uart_transmit(uart);
+}
+
+static byte_t uart_read_byte(device_mapping_t* device, word_t addr)
+{
+    uart_t* uart = (uart_t*)device->context;
+
+    if(machine->verbosity)
+        printf("UART READ BYTE @0x%08x\n", addr);
+
+    return (byte_t)uart_read(uart, addr, sizeof(byte_t));
+}
+
+static hword_t uart_read_hword(device_mapping_t* device, word_t addr)
+{
+    uart_t* uart = (uart_t*)device->context;
+
+    if(machine->verbosity)
+        printf("UART READ HWORD @0x%08x\n", addr);
+
+    return (hword_t)uart_read(uart, addr, sizeof(hword_t));
+}
+
+static word_t uart_read_word(device_mapping_t* device, word_t addr)
+{
+    uart_t* uart = (uart_t*)device->context;
+
+    if(machine->verbosity)
+        printf("UART READ WORD @0x%08x\n", addr);
+
+    return uart_read(uart, addr, sizeof(word_t));
+}
+
+static void uart_write_byte(device_mapping_t* device, word_t addr,
+                            byte_t value)
+{
+    uart_t* uart = (uart_t*)device->context;
+
+    if(machine->verbosity)
+        printf("UART WRITE BYTE @0x%08x: 0x%02x\n", addr, value);
+
+    uart_write(uart, addr, value, sizeof(byte_t));
+}
+
+static void uart_write_hword(device_mapping_t* device, word_t addr,
+                             hword_t value)
+{
+    uart_t* uart = (uart_t*)device->context;
+
+    if(machine->verbosity)
+        printf("UART WRITE HWORD @0x%08x: 0x%04x\n", addr, value);
+
+    uart_write(uart, addr, value, sizeof(hword_t));
+}
+
+static void uart_write_word(device_mapping_t* device, word_t addr,
+                            word_t value)
+{
+    uart_t* uart = (uart_t*)device->context;
+
+    if(machine->verbosity)
+        printf("UART WRITE WORD @0x%08x: 0x%08x\n", addr, value);
+
+    uart_write(uart, addr, value, sizeof(word_t));
+}
+
+/**
+ * @brief The condition that raises the UART's interrupt line: the receive
+ *        FIFO holds data.
+ */
+static bool uart_rx_level(void* context)
+{
+    return ring_count(&((uart_t*)context)->rx_ring) != 0;
+}
+
+/**
+ * @brief Reads of the control register are stable while nothing is received:
+ *        input that arrives while a loop polling it is skipped is seen as
+ *        arriving at the end of the skip, like input that arrives between two
+ *        reads. The other registers are not polled.
+ */
+static bool uart_poll_stable(device_mapping_t* device, word_t addr,
+                             word_t* value)
+{
+    uart_t* uart = (uart_t*)device->context;
+
+    if(addr - UART_DEVICE_ADDR_OFFSET != offsetof(uart_regs_t, control))
+        return false;
+
+    uart_rx_status(uart);
+
+    *value = uart->regs.control;
+
+    return true;
+}
+
+/**
+ * @brief Blocks until the receive FIFO holds data. Returns false (at once, if
+ *        there is no input thread) if the input source has closed for good
+ *        instead.
+ */
+static bool uart_wait(device_mapping_t* device)
+{
+    uart_t* uart = (uart_t*)device->context;
+
+    if(!uart->rx_async)
+        return false;
+
+    if(ring_count(&uart->rx_ring) != 0)
+        return true;
+
+    pthread_mutex_lock(&uart->rx_lock);
+
+    while((ring_count(&uart->rx_ring) == 0) && !atomic_load(&uart->rx_closed))
+        pthread_cond_wait(&uart->rx_filled, &uart->rx_lock);
+
+    pthread_mutex_unlock(&uart->rx_lock);
+
+    return ring_count(&uart->rx_ring) != 0;
+}
+
+/**
+ * @brief Waits until every character transmitted so far has been written to
+ *        the sink.
+ */
+static void uart_flush(device_mapping_t* device)
+{
+    uart_t* uart = (uart_t*)device->context;
+
+    if(!uart->tx_async)
+        return;
+
+    pthread_mutex_lock(&uart->tx_lock);
+
+    while(ring_count(&uart->tx_ring) != 0)
+    {
+        pthread_cond_signal(&uart->tx_ready);
+        pthread_cond_wait(&uart->tx_drained, &uart->tx_lock);
+    }
+
+    pthread_mutex_unlock(&uart->tx_lock);
+}
+
+/**
+ * @brief Drains the transmit ring, stops the I/O threads, closes the sink and
+ *        source and frees the UART. Also releases a partially initialized
+ *        UART.
+ */
+static void uart_destroy(device_mapping_t* device)
+{
+    uart_t* uart = (uart_t*)device->context;
+    uint64_t wake = 1;
+
+    if(uart->rx_async)
+    {
+        if(write(uart->rx_wake_fd, &wake, sizeof(wake)) == sizeof(wake))
+            pthread_join(uart->rx_thread, NULL);
+    }
+
+    if(uart->rx_fd >= 0)
+        uart_rx_close_source(uart);
+
+    if(uart->rx_stdin_flags >= 0)
+        fcntl(STDIN_FILENO, F_SETFL, uart->rx_stdin_flags);
+
+    if(uart->rx_pty_slave_fd >= 0)
+        close(uart->rx_pty_slave_fd);
+
+    if(uart->rx_listen_fd >= 0)
+    {
+        close(uart->rx_listen_fd);
+        unlink(uart->rx_socket_path);
+    }
+
+    if(uart->rx_epoll_fd >= 0)
+        close(uart->rx_epoll_fd);
+
+    if(uart->rx_wake_fd >= 0)
+        close(uart->rx_wake_fd);
+
+    if(uart->tx_async)
+    {
+        pthread_mutex_lock(&uart->tx_lock);
+        uart->tx_stop = true;
+        pthread_cond_signal(&uart->tx_ready);
+        pthread_mutex_unlock(&uart->tx_lock);
+
+        pthread_join(uart->tx_thread, NULL);
+    }
+
+    if(uart->tx_pipe != NULL)
+        pclose(uart->tx_pipe);
+    else if(uart->tx_owned)
+        close(uart->tx_fd);
+
+    ring_free(&uart->tx_ring);
+    ring_free(&uart->rx_ring);
+
+    pthread_mutex_destroy(&uart->tx_lock);
+    pthread_cond_destroy(&uart->tx_ready);
+    pthread_cond_destroy(&uart->tx_drained);
+    pthread_mutex_destroy(&uart->rx_lock);
+    pthread_cond_destroy(&uart->rx_filled);
+
+    free(uart);
 }
 
-static device_mapping_t uart_device_mapping =
+static const device_mapping_t uart_device_mapping =
 {
-    .get_byte = uart_get_byte,
-    .get_hword = uart_get_hword,
-    .get_word = uart_get_word,
-    .get_addr_in_device_map = uart_get_addr_in_map,
-    .update = uart_update
+    .base = UART_DEVICE_ADDR_OFFSET,
+    .size = UART_DEVICE_MAP_SIZE,
+    .read_byte = uart_read_byte,
+    .read_hword = uart_read_hword,
+    .read_word = uart_read_word,
+    .write_byte = uart_write_byte,
+    .write_hword = uart_write_hword,
+    .write_word = uart_write_word,
+    .update = NULL,
+    .poll_stable = uart_poll_stable,
+    .wait = uart_wait,
+    .flush = uart_flush,
+    .destroy = uart_destroy
 };
 
-void uart_init()
+/**
+ * @brief Adds a UART writing to the given sink to the current machine. The
+ *        UART closes the sink when it is destroyed if it owns it.
+ */
+static bool uart_create(int tx_fd, FILE* tx_pipe, bool tx_owned,
+                        const char* rx_source)
+{
+    device_mapping_t device_mapping = uart_device_mapping;
+    uart_t* uart = (uart_t*)calloc(1, sizeof(uart_t));
+
+    if(uart == NULL)
+        return false;
+
+    uart->tx_fd = tx_fd;
+    uart->tx_pipe = tx_pipe;
+    uart->tx_owned = tx_owned;
+    uart->rx_fd = uart->rx_listen_fd = uart->rx_pty_slave_fd = -1;
+    uart->rx_epoll_fd = uart->rx_wake_fd = uart->rx_stdin_flags = -1;
+    uart->rx_machine = machine;
+
+    pthread_mutex_init(&uart->tx_lock, NULL);
+    pthread_cond_init(&uart->tx_ready, NULL);
+    pthread_cond_init(&uart->tx_drained, NULL);
+    pthread_mutex_init(&uart->rx_lock, NULL);
+    pthread_cond_init(&uart->rx_filled, NULL);
+
+    device_mapping.context = uart;
+
+    if(!uart_rx_init(uart, rx_source))
+    {
+        fprintf(stderr, "Could not open UART source %s\n", rx_source);
+        uart_destroy(&device_mapping);
+        return false;
+    }
+
+    /*
+     * Fall back to writing synchronously if the I/O thread cannot be
+     * started.
+     */
+    atomic_init(&uart->tx_waiting, false);
+
+    uart->tx_async = ring_init(&uart->tx_ring, UART_TX_RING_SIZE) &&
+                     (pthread_create(&uart->tx_thread, NULL, uart_tx_main,
+                                     uart) == 0);
+
+    if(device_register(&device_mapping) == NULL)
+    {
+        uart_destroy(&device_mapping);
+        return false;
+    }
+
+    intc_attach(INTC_LINE_UART, uart_rx_level, uart);
+
+    return true;
+}
+
+/**
+ * @brief Adds a UART to the current machine. Transmitted characters are
+ *        written to the given sink: NULL or "-" for stdout, "|command" to
+ *        pipe them to a command, or otherwise the path of a file or named
+ *        pipe. Received characters are read from the given source: NULL for
+ *        none, "-" for stdin, "pty" for a new pseudo-terminal, or "unix:PATH"
+ *        for a Unix socket listening at PATH.
+ */
+bool uart_init(const char* tx_sink, const char* rx_source)
 {
-    device_register(&uart_device_mapping);
+    FILE* tx_pipe = NULL;
+    int tx_fd = STDOUT_FILENO;
+
+    if((tx_sink != NULL) && (strcmp(tx_sink, "-") != 0))
+    {
+        if(tx_sink[0] == '|')
+        {
+            tx_pipe = popen(tx_sink + 1, "w");
+            tx_fd = (tx_pipe != NULL) ? fileno(tx_pipe) : -1;
+        }
+        else
+            tx_fd = open(tx_sink, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if(tx_fd < 0)
+        {
+            fprintf(stderr, "Could not open UART sink %s\n", tx_sink);
+            return false;
+        }
+    }
+
+    return uart_create(tx_fd, tx_pipe, tx_fd != STDOUT_FILENO, rx_source);
 }
 
+/**
+ * @brief Adds a UART that writes transmitted characters to an open file
+ *        descriptor, which the caller keeps ownership of.
+ */
+bool uart_init_fd(int tx_fd, const char* rx_source)
+{
+    return uart_create(tx_fd, NULL, false, rx_source);
+}
@@ -1,6 +1,9 @@
 #ifndef DEVICE_UART_H
 #define DEVICE_UART_H
 
-void uart_init();
+#include <stdbool.h>
+
+bool uart_init(const char* tx_sink, const char* rx_source);
+bool uart_init_fd(int tx_fd, const char* rx_source);
 
 #endif // DEVICE_UART_H
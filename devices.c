@@ -1,98 +1,982 @@
 #include "devices.h"
+#include "machine.h"
+#include "memmap.h"
+#include "stats.h"
 
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-typedef struct device_mapping_node_t
+/*
+ * The device input log records the value of every device read, so that
+ * instructions can be re-executed deterministically (see snapshot.h) without
+ * the devices seeing the accesses twice. Re-execution makes the same reads in
+ * the same order, so only the values are kept, run-length encoded because
+ * guests mostly poll status registers that rarely change.
+ *
+ * Interrupts, and devices acting on guest memory by themselves (such as the
+ * DMA engine finishing a transfer), are not caused by instructions, so they
+ * are logged separately as actions, with the guest time at which they
+ * happened. While instructions are re-executed, the devices are not updated;
+ * the logged actions are done again instead.
+ */
+typedef struct
 {
-    device_mapping_t* device_mapping;
-    struct device_mapping_node_t* next_node;
-} device_mapping_node_t;
+    word_t value;
+    word_t repeat;
+} device_log_entry_t;
+
+typedef struct
+{
+    uint64_t instret;
+
+    /*
+     * The device that acted, with the arguments to its replay callback, or
+     * NULL for an interrupt, with the handler in args[0].
+     */
+    device_mapping_t* device;
+    word_t args[DEVICE_ACTION_ARGS];
+} device_log_action_t;
+
+typedef struct device_log
+{
+    device_log_entry_t* entries;
+    word_t count;
+    word_t capacity;
+
+    /*
+     * The position of entries[0] in the log, which grows from the front as
+     * entries are trimmed.
+     */
+    uint64_t first;
+
+    /*
+     * The logged actions, and the position of actions[0].
+     */
+    device_log_action_t* actions;
+    word_t action_count;
+    word_t action_capacity;
+    uint64_t action_first;
+
+    /*
+     * The next read and the next action to replay.
+     */
+    device_log_pos_t replay;
+} device_log_t;
+
+/**
+ * @brief Initializes the machine's (empty) device registry.
+ */
+void device_init()
+{
+    machine->device_index = NULL;
+    machine->device_count = 0;
+    machine->device_last_hit = NULL;
 
-device_mapping_node_t* device_mappings = NULL;
+    machine->device_mmio_touched = false;
+    machine->instret_limit = DEVICE_NO_EVENT;
+    machine->device_next_event = DEVICE_NO_EVENT;
+    atomic_init(&machine->device_kicked, false);
+
+    machine->device_touched = NULL;
+    machine->device_num_touched = 0;
+    machine->device_events = NULL;
+    machine->device_num_events = 0;
+
+    machine->device_bus_fault_handler = NULL;
+    machine->device_interrupt_poll = NULL;
+    machine->device_interrupt_entry = NULL;
+    machine->device_log = NULL;
+    machine->device_replay_end = 0;
+}
 
 /**
- * @brief Prepends a device mapping to the device mapping list.
+ * @brief Shuts down and unregisters all of the machine's devices.
  */
-void device_register(device_mapping_t* device_mapping)
+void device_destroy()
 {
-    device_mapping_node_t* new_node =
-            (device_mapping_node_t*)malloc(sizeof(device_mapping_node_t));
+    word_t i;
+
+    for(i = 0; i < machine->device_count; i++)
+    {
+        if(machine->device_index[i]->destroy != NULL)
+            machine->device_index[i]->destroy(machine->device_index[i]);
+
+        free(machine->device_index[i]);
+    }
+
+    free(machine->device_index);
+    free(machine->device_touched);
+    free(machine->device_events);
+
+    if(machine->device_log != NULL)
+    {
+        free(machine->device_log->entries);
+        free(machine->device_log->actions);
+    }
+
+    free(machine->device_log);
+
+    device_init();
+}
+
+/**
+ * @brief Registers a copy of a device mapping for its address range, returning
+ *        the machine's copy. Fails (returning NULL) if the range overlaps a
+ *        device that is already registered, or if memory runs out.
+ */
+device_mapping_t* device_register(const device_mapping_t* device_template)
+{
+    device_mapping_t** index = machine->device_index;
+    device_mapping_t** grown;
+    device_mapping_t* device_mapping;
+    word_t count = machine->device_count;
+    word_t base = device_template->base;
+    word_t end = base + device_template->size;
+    word_t i, pos;
+
+    /*
+     * Find the insertion point, checking for overlap with the neighbours.
+     */
+    for(pos = 0; (pos < count) && (index[pos]->base < base); pos++);
+
+    if(((pos > 0) && (index[pos - 1]->base + index[pos - 1]->size > base)) ||
+       ((pos < count) && (index[pos]->base < end)))
+    {
+        fprintf(stderr, "Device @0x%08x (0x%x bytes) overlaps a registered "
+                "device\n", base, device_template->size);
+        return NULL;
+    }
+
+    /*
+     * Grow the arrays one at a time, keeping each one that grew: the machine
+     * stays consistent with its old count whichever allocation fails.
+     */
+    grown = (device_mapping_t**)realloc(
+            index, sizeof(device_mapping_t*) * (count + 1));
+
+    if(grown == NULL)
+        return NULL;
+
+    machine->device_index = index = grown;
+
+    grown = (device_mapping_t**)realloc(
+            machine->device_touched, sizeof(device_mapping_t*) * (count + 1));
+
+    if(grown == NULL)
+        return NULL;
+
+    machine->device_touched = grown;
 
-    new_node->next_node = device_mappings;
-    new_node->device_mapping = device_mapping;
-    device_mappings = new_node;
+    grown = (device_mapping_t**)realloc(
+            machine->device_events, sizeof(device_mapping_t*) * (count + 1));
+
+    if(grown == NULL)
+        return NULL;
+
+    machine->device_events = grown;
+
+    device_mapping = (device_mapping_t*)malloc(sizeof(device_mapping_t));
+
+    if(device_mapping == NULL)
+        return NULL;
+
+    (*device_mapping) = (*device_template);
+
+    device_mapping->event_deadline = DEVICE_NO_EVENT;
+    device_mapping->event_slot = -1;
+    device_mapping->touched = false;
+
+    for(i = count; i > pos; i--)
+        index[i] = index[i - 1];
+
+    index[pos] = device_mapping;
+    machine->device_count = count + 1;
+
+    /*
+     * Pages covered entirely by the device resolve straight from the page
+     * table; partially covered pages go through the index.
+     */
+    word_t first_page = (base + MEM_PAGE_MASK) & ~MEM_PAGE_MASK;
+    word_t last_page = end & ~MEM_PAGE_MASK;
+
+    if((first_page < last_page) && (first_page >= base))
+        mem_map_device(first_page, last_page - first_page, device_mapping);
+
+    return device_mapping;
 }
 
 /**
- * @brief Walks the list of devices, looking for one whose mapped addresses
- *        contain the provided address.
+ * @brief Finds the device whose mapped addresses contain the provided
+ *        address. Tries the page table, then the last device hit, then
+ *        binary searches the device index.
  */
 bool device_get_mapping_for_addr(word_t addr,
                                  device_mapping_t** device_mapping_ptr)
 {
-    device_mapping_node_t* cur_node = device_mappings;
+    device_mapping_t* device_mapping = mem_page_device(addr);
+    word_t low, high, mid;
+
+    if(device_mapping == NULL)
+    {
+        device_mapping = machine->device_last_hit;
+
+        if((device_mapping == NULL) ||
+           !device_contains_addr(device_mapping, addr))
+        {
+            /*
+             * Find the last device with a base at or below the address.
+             */
+            low = 0;
+            high = machine->device_count;
+
+            while(low < high)
+            {
+                mid = (low + high) / 2;
+
+                if(machine->device_index[mid]->base <= addr)
+                    low = mid + 1;
+                else
+                    high = mid;
+            }
+
+            if((low == 0) ||
+               !device_contains_addr(machine->device_index[low - 1], addr))
+                return false;
+
+            device_mapping = machine->device_index[low - 1];
+            machine->device_last_hit = device_mapping;
+        }
+    }
+
+    (*device_mapping_ptr) = device_mapping;
+
+    return true;
+}
+
+/**
+ * @brief Marks a device as accessed, so that it is serviced at the next
+ *        poll. Devices without an update callback react to accesses through
+ *        their read and write handlers alone.
+ */
+static void device_touch(device_mapping_t* device_mapping)
+{
+    if(device_mapping->touched || (device_mapping->update == NULL))
+        return;
+
+    machine->device_mmio_touched = true;
+    device_mapping->touched = true;
+    machine->device_touched[machine->device_num_touched++] = device_mapping;
+}
+
+/**
+ * @brief Appends the value of a device read to the input log, if it is being
+ *        kept, and returns the value.
+ */
+static word_t device_log_record(word_t value)
+{
+    device_log_t* log = machine->device_log;
+    device_log_entry_t* entries;
+
+    if(log == NULL)
+        return value;
+
+    if((log->count > 0) && (log->entries[log->count - 1].value == value) &&
+       (log->entries[log->count - 1].repeat != (word_t)-1))
+    {
+        log->entries[log->count - 1].repeat++;
+        return value;
+    }
+
+    if(log->count == log->capacity)
+    {
+        entries = (device_log_entry_t*)realloc(
+                log->entries, sizeof(device_log_entry_t) * log->capacity * 2);
+
+        /*
+         * Out of memory: the read cannot be replayed, but the guest can
+         * carry on.
+         */
+        if(entries == NULL)
+            return value;
+
+        log->entries = entries;
+        log->capacity *= 2;
+    }
+
+    log->entries[log->count].value = value;
+    log->entries[log->count].repeat = 1;
+    log->count++;
+
+    return value;
+}
+
+/**
+ * @brief Returns the next value from the input log, in place of a device
+ *        read that is being re-executed.
+ */
+static word_t device_log_replay_read()
+{
+    device_log_t* log = machine->device_log;
+    device_log_entry_t* entry;
 
-    while((cur_node != NULL) &&
-          (!cur_node->device_mapping->get_addr_in_device_map(addr)))
-        cur_node = cur_node->next_node;
+    for(;;)
+    {
+        if(log->replay.entry - log->first >= log->count)
+            return 0;
 
-    if(cur_node == NULL)
-            return false;
+        entry = &log->entries[log->replay.entry - log->first];
 
-    (*device_mapping_ptr) = cur_node->device_mapping;
+        if(log->replay.repeat < entry->repeat)
+        {
+            log->replay.repeat++;
+            return entry->value;
+        }
 
-    return true; 
+        log->replay.entry++;
+        log->replay.repeat = 0;
+    }
+}
+
+/**
+ * @brief Reports an access that no device decodes.
+ */
+static void device_fault(word_t addr, bool write)
+{
+    if(machine->device_bus_fault_handler != NULL)
+        machine->device_bus_fault_handler(addr, write);
 }
 
 /**
- * @brief Returns an address to a byte for a memory-mapped device.
+ * @brief Reads a byte from a memory-mapped device.
  */
-byte_t* device_get_byte(word_t addr)
+byte_t device_read_byte(word_t addr)
 {
     device_mapping_t* device_mapping;
 
-    if(!device_get_mapping_for_addr(addr, &device_mapping))
+    if(!device_get_mapping_for_addr(addr, &device_mapping) ||
+       (device_mapping->read_byte == NULL))
+    {
+        device_fault(addr, false);
         return 0;
+    }
 
-    return device_mapping->get_byte(addr);
+    if(device_replaying())
+        return (byte_t)device_log_replay_read();
+
+    device_touch(device_mapping);
+
+    return (byte_t)device_log_record(
+            device_mapping->read_byte(device_mapping, addr));
 }
 
 /**
- * @brief Returns an address to a halfword for a memory-mapped device.
+ * @brief Writes a byte to a memory-mapped device.
  */
-hword_t* device_get_hword(word_t addr)
+void device_write_byte(word_t addr, byte_t value)
 {
     device_mapping_t* device_mapping;
 
-    if(!device_get_mapping_for_addr(addr, &device_mapping))
+    if(!device_get_mapping_for_addr(addr, &device_mapping) ||
+       (device_mapping->write_byte == NULL))
+    {
+        device_fault(addr, true);
+        return;
+    }
+
+    if(device_replaying())
+        return;
+
+    device_touch(device_mapping);
+
+    device_mapping->write_byte(device_mapping, addr, value);
+}
+
+/**
+ * @brief Reads a halfword from a memory-mapped device.
+ */
+hword_t device_read_hword(word_t addr)
+{
+    device_mapping_t* device_mapping;
+
+    if(!device_get_mapping_for_addr(addr, &device_mapping) ||
+       (device_mapping->read_hword == NULL))
+    {
+        device_fault(addr, false);
         return 0;
+    }
+
+    if(device_replaying())
+        return (hword_t)device_log_replay_read();
+
+    device_touch(device_mapping);
+
+    return (hword_t)device_log_record(
+            device_mapping->read_hword(device_mapping, addr));
+}
+
+/**
+ * @brief Writes a halfword to a memory-mapped device.
+ */
+void device_write_hword(word_t addr, hword_t value)
+{
+    device_mapping_t* device_mapping;
+
+    if(!device_get_mapping_for_addr(addr, &device_mapping) ||
+       (device_mapping->write_hword == NULL))
+    {
+        device_fault(addr, true);
+        return;
+    }
+
+    if(device_replaying())
+        return;
 
-    return device_mapping->get_hword(addr);
+    device_touch(device_mapping);
+
+    device_mapping->write_hword(device_mapping, addr, value);
 }
 
 /**
- * @brief Returns an address to a word for a memory-mapped device.
+ * @brief Reads a word from a memory-mapped device.
  */
-word_t* device_get_word(word_t addr)
+word_t device_read_word(word_t addr)
 {
     device_mapping_t* device_mapping;
 
-    if(!device_get_mapping_for_addr(addr, &device_mapping))
+    if(!device_get_mapping_for_addr(addr, &device_mapping) ||
+       (device_mapping->read_word == NULL))
+    {
+        device_fault(addr, false);
         return 0;
+    }
 
-    return device_mapping->get_word(addr);
+    if(device_replaying())
+        return (word_t)device_log_replay_read();
+
+    device_touch(device_mapping);
+
+    return (word_t)device_log_record(
+            device_mapping->read_word(device_mapping, addr));
 }
 
 /**
- * @brief Updates all registered devices.
+ * @brief Writes a word to a memory-mapped device.
  */
-void device_update()
+void device_write_word(word_t addr, word_t value)
 {
-     device_mapping_node_t* cur_node = device_mappings;
+    device_mapping_t* device_mapping;
 
-    while(cur_node != NULL)
+    if(!device_get_mapping_for_addr(addr, &device_mapping) ||
+       (device_mapping->write_word == NULL))
     {
-        cur_node->device_mapping->update();
-        cur_node = cur_node->next_node;
+        device_fault(addr, true);
+        return;
     }
+
+    if(device_replaying())
+        return;
+
+    device_touch(device_mapping);
+
+    device_mapping->write_word(device_mapping, addr, value);
+}
+
+/**
+ * @brief Checks whether word reads of a device register are stable (see
+ *        devices.h), so that a loop polling it can be skipped, and if so gets
+ *        the value they return.
+ */
+bool device_poll_stable(word_t addr, word_t* value)
+{
+    device_mapping_t* device_mapping;
+
+    return device_get_mapping_for_addr(addr, &device_mapping) &&
+           (device_mapping->poll_stable != NULL) &&
+           device_mapping->poll_stable(device_mapping, addr, value);
+}
+
+/**
+ * @brief Blocks the host thread until a device has input for the guest.
+ *        Returns false if no device can ever have any.
+ */
+bool device_wait()
+{
+    word_t i;
+
+    for(i = 0; i < machine->device_count; i++)
+        if((machine->device_index[i]->wait != NULL) &&
+           machine->device_index[i]->wait(machine->device_index[i]))
+            return true;
+
+    return false;
+}
+
+/**
+ * @brief Flushes the host-side output of all devices.
+ */
+void device_flush()
+{
+    word_t i;
+
+    for(i = 0; i < machine->device_count; i++)
+        if(machine->device_index[i]->flush != NULL)
+            machine->device_index[i]->flush(machine->device_index[i]);
+}
+
+/**
+ * @brief Returns the guest time of the next logged action to replay, or
+ *        DEVICE_NO_EVENT if there is none.
+ */
+static uint64_t device_log_next_action()
+{
+    device_log_t* log = machine->device_log;
+    uint64_t index = log->replay.action - log->action_first;
+
+    if(index >= log->action_count)
+        return DEVICE_NO_EVENT;
+
+    return log->actions[index].instret;
+}
+
+/**
+ * @brief Returns the earliest device deadline, or DEVICE_NO_EVENT if no
+ *        event is scheduled.
+ */
+uint64_t device_next_deadline()
+{
+    return machine->device_num_events ?
+           machine->device_events[0]->event_deadline : DEVICE_NO_EVENT;
+}
+
+/**
+ * @brief Recomputes the time of the next event: the earliest device deadline
+ *        or the instruction limit, whichever comes first. While instructions
+ *        are being re-executed, the devices are not updated, and the next
+ *        event is instead the next logged action or the end of the replay.
+ *        While the machine is kicked, it is now.
+ */
+static void device_events_update()
+{
+    uint64_t next = device_next_deadline();
+
+    if(device_replaying())
+    {
+        next = device_log_next_action();
+
+        if(machine->device_replay_end < next)
+            next = machine->device_replay_end;
+    }
+
+    if(machine->instret_limit < next)
+        next = machine->instret_limit;
+
+    __atomic_store_n(&machine->device_next_event, next, __ATOMIC_RELAXED);
+
+    /*
+     * A kick may have come in after the last servicing; either it is seen
+     * here, or its own store comes after this one (see device_kick()).
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if(atomic_load_explicit(&machine->device_kicked, memory_order_relaxed))
+        __atomic_store_n(&machine->device_next_event, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Sets the guest time at which the engines stop running.
+ */
+void device_set_instret_limit(uint64_t limit)
+{
+    machine->instret_limit = limit;
+
+    device_events_update();
+}
+
+/**
+ * @brief Swaps two entries of the event heap.
+ */
+static void device_events_swap(word_t a, word_t b)
+{
+    device_mapping_t** events = machine->device_events;
+    device_mapping_t* tmp = events[a];
+
+    events[a] = events[b];
+    events[b] = tmp;
+
+    events[a]->event_slot = a;
+    events[b]->event_slot = b;
+}
+
+/**
+ * @brief Restores the heap property for the entry at the given slot.
+ */
+static void device_events_fix(word_t slot)
+{
+    device_mapping_t** events = machine->device_events;
+    word_t count = machine->device_num_events;
+    word_t parent, child;
+
+    while((slot > 0) &&
+          (events[slot]->event_deadline <
+           events[parent = (slot - 1) / 2]->event_deadline))
+    {
+        device_events_swap(slot, parent);
+        slot = parent;
+    }
+
+    while((child = 2 * slot + 1) < count)
+    {
+        if((child + 1 < count) &&
+           (events[child + 1]->event_deadline < events[child]->event_deadline))
+            child++;
+
+        if(events[slot]->event_deadline <= events[child]->event_deadline)
+            break;
+
+        device_events_swap(slot, child);
+        slot = child;
+    }
+
+    device_events_update();
+}
+
+/**
+ * @brief Schedules (or reschedules) a device's next event at the given
+ *        guest time. A deadline of DEVICE_NO_EVENT cancels the event.
+ */
+void device_schedule(device_mapping_t* device_mapping, uint64_t deadline)
+{
+    word_t slot;
+
+    if(device_mapping->event_slot < 0)
+    {
+        if(deadline == DEVICE_NO_EVENT)
+            return;
+
+        slot = machine->device_num_events++;
+        machine->device_events[slot] = device_mapping;
+        device_mapping->event_slot = slot;
+    }
+    else
+        slot = device_mapping->event_slot;
+
+    device_mapping->event_deadline = deadline;
+
+    if(deadline == DEVICE_NO_EVENT)
+    {
+        /*
+         * Remove the device by moving the last entry into its slot.
+         */
+        device_mapping->event_slot = -1;
+
+        if(slot != --machine->device_num_events)
+        {
+            machine->device_events[slot] =
+                    machine->device_events[machine->device_num_events];
+            machine->device_events[slot]->event_slot = slot;
+            device_events_fix(slot);
+            return;
+        }
+
+        device_events_update();
+        return;
+    }
+
+    device_events_fix(slot);
+}
+
+/**
+ * @brief Does the logged actions that are due again, in place of the devices
+ *        while instructions are being re-executed: takes the interrupts, and
+ *        has the devices redo what they did to guest memory.
+ */
+static void device_log_replay_actions(uint64_t now)
+{
+    device_log_t* log = machine->device_log;
+    device_log_action_t* action;
+
+    while(device_log_next_action() <= now)
+    {
+        action = &log->actions[log->replay.action++ - log->action_first];
+
+        if(action->device == NULL)
+            machine->device_interrupt_entry(action->args[0]);
+        else
+            action->device->replay(action->device, action->args);
+    }
+
+    device_events_update();
+}
+
+/**
+ * @brief Updates the devices that were accessed since the last call, then
+ *        those whose events have come due. A device's event is cleared before
+ *        its update is called; the device reschedules itself if it needs to.
+ *        Returns false once the machine has reached its instruction limit.
+ */
+bool device_service(uint64_t now)
+{
+    device_mapping_t* device_mapping;
+
+    machine->device_mmio_touched = false;
+
+    /*
+     * This servicing sees whatever the kick was for.
+     */
+    if(atomic_load_explicit(&machine->device_kicked, memory_order_relaxed))
+        atomic_store(&machine->device_kicked, false);
+
+    /*
+     * The devices are already past anything that is being re-executed; only
+     * their logged actions are done again.
+     */
+    if(device_replaying())
+    {
+        device_log_replay_actions(now);
+        return now < machine->instret_limit;
+    }
+
+    /*
+     * The replay may just have ended.
+     */
+    device_events_update();
+
+    while(machine->device_num_touched > 0)
+    {
+        device_mapping = machine->device_touched[--machine->device_num_touched];
+        device_mapping->touched = false;
+        device_mapping->update(device_mapping, now);
+        stats_count(device_updates);
+    }
+
+    while((machine->device_num_events > 0) &&
+          (machine->device_events[0]->event_deadline <= now))
+    {
+        device_mapping = machine->device_events[0];
+        device_schedule(device_mapping, DEVICE_NO_EVENT);
+        device_mapping->update(device_mapping, now);
+        stats_count(device_updates);
+    }
+
+    if(machine->device_interrupt_poll != NULL)
+        machine->device_interrupt_poll();
+
+    return now < machine->instret_limit;
+}
+
+/**
+ * @brief Has the devices of a machine serviced the next time its engine
+ *        checks for events, instead of at its next event or access. Unlike
+ *        everything else here, may be called from any thread: devices with
+ *        host input call it when input arrives, so that the guest sees it
+ *        (and its interrupt) without waiting. Where in guest time that
+ *        happens depends on the host, but whatever the guest sees of it is
+ *        logged as usual.
+ */
+void device_kick(struct machine* target)
+{
+    atomic_store(&target->device_kicked, true);
+
+    __atomic_store_n(&target->device_next_event, 0, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Logs that a device has just acted on guest memory by itself, so
+ *        that its replay callback is called with the same arguments at the
+ *        same guest time when the instructions are re-executed. A NULL device
+ *        logs an interrupt.
+ */
+void device_log_action(device_mapping_t* device_mapping, const word_t* args)
+{
+    device_log_t* log = machine->device_log;
+    device_log_action_t* actions;
+
+    if(log == NULL)
+        return;
+
+    if(log->action_count == log->action_capacity)
+    {
+        actions = (device_log_action_t*)realloc(
+                log->actions,
+                sizeof(device_log_action_t) * log->action_capacity * 2);
+
+        /*
+         * Out of memory: the action cannot be replayed.
+         */
+        if(actions == NULL)
+            return;
+
+        log->actions = actions;
+        log->action_capacity *= 2;
+    }
+
+    log->actions[log->action_count].instret = machine->instret;
+    log->actions[log->action_count].device = device_mapping;
+    memcpy(log->actions[log->action_count].args, args,
+           sizeof(log->actions[log->action_count].args));
+    log->action_count++;
+}
+
+/**
+ * @brief Has the processor take an interrupt now, entering the given
+ *        handler. The interrupt is logged, so that it is taken again at the
+ *        same guest time when the instructions are re-executed.
+ */
+void device_interrupt(word_t handler)
+{
+    word_t args[DEVICE_ACTION_ARGS] = { handler };
+
+    machine->device_interrupt_entry(handler);
+
+    device_log_action(NULL, args);
+}
+
+/**
+ * @brief Starts logging the values of device reads, so that the instructions
+ *        executed from now on can be replayed.
+ */
+bool device_log_init()
+{
+    device_log_t* log = (device_log_t*)calloc(1, sizeof(device_log_t));
+
+    if(log == NULL)
+        return false;
+
+    log->capacity = 1024;
+    log->entries = (device_log_entry_t*)malloc(sizeof(device_log_entry_t) *
+                                               log->capacity);
+
+    log->action_capacity = 64;
+    log->actions = (device_log_action_t*)malloc(
+            sizeof(device_log_action_t) * log->action_capacity);
+
+    if((log->entries == NULL) || (log->actions == NULL))
+    {
+        free(log->entries);
+        free(log->actions);
+        free(log);
+        return false;
+    }
+
+    machine->device_log = log;
+
+    return true;
+}
+
+/**
+ * @brief Records count device reads that all returned value, made by
+ *        instructions that were skipped rather than executed (see
+ *        processor_idle.c).
+ */
+void device_log_record_repeat(word_t value, uint64_t count)
+{
+    device_log_t* log = machine->device_log;
+    device_log_entry_t* entry;
+    word_t room;
+
+    while((log != NULL) && (count > 0))
+    {
+        /*
+         * Start a run (unless memory has run out), then fill it up.
+         */
+        device_log_record(value);
+        count--;
+
+        entry = &log->entries[log->count - 1];
+        room = (word_t)-1 - entry->repeat;
+
+        if((entry->value != value) || (room == 0))
+            break;
+
+        if(count < room)
+            room = count;
+
+        entry->repeat += room;
+        count -= room;
+    }
+}
+
+/**
+ * @brief Logs an input that the guest receives other than through a device
+ *        read, and returns it; while instructions are being re-executed,
+ *        returns the logged input instead.
+ */
+word_t device_log_input(word_t value)
+{
+    if(device_replaying())
+        return device_log_replay_read();
+
+    return device_log_record(value);
+}
+
+/**
+ * @brief Gets the position in the input log of the next device read and the
+ *        next action: the next ones to replay, or the end of the log.
+ */
+void device_log_tell(device_log_pos_t* pos)
+{
+    device_log_t* log = machine->device_log;
+
+    if(device_replaying())
+    {
+        (*pos) = log->replay;
+        return;
+    }
+
+    pos->entry = log->first + log->count;
+    pos->repeat = 0;
+    pos->action = log->action_first + log->action_count;
+
+    /*
+     * The next read may yet extend the last run.
+     */
+    if(log->count > 0)
+    {
+        pos->entry--;
+        pos->repeat = log->entries[log->count - 1].repeat;
+    }
+}
+
+/**
+ * @brief Replays device reads from the given position in the input log until
+ *        the machine reaches the guest time end, after which the devices are
+ *        accessed again (and logged) as normal.
+ */
+void device_log_replay(const device_log_pos_t* pos, uint64_t end)
+{
+    machine->device_log->replay = (*pos);
+    machine->device_replay_end = end;
+
+    device_events_update();
+}
+
+/**
+ * @brief Drops the entries of the input log before the given position.
+ */
+void device_log_trim(const device_log_pos_t* pos)
+{
+    device_log_t* log = machine->device_log;
+    word_t drop = pos->action - log->action_first;
+
+    if((drop != 0) && (drop <= log->action_count))
+    {
+        log->action_count -= drop;
+        log->action_first += drop;
+
+        memmove(log->actions, log->actions + drop,
+                sizeof(device_log_action_t) * log->action_count);
+    }
+
+    drop = pos->entry - log->first;
+
+    if((drop == 0) || (drop > log->count))
+        return;
+
+    log->count -= drop;
+    log->first += drop;
+
+    memmove(log->entries, log->entries + drop,
+            sizeof(device_log_entry_t) * log->count);
 }
@@ -4,23 +4,204 @@
 #include "architecture.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 
+/*
+ * Deadline of a device with no scheduled event.
+ */
+#define DEVICE_NO_EVENT             (UINT64_MAX)
+
+/*
+ * The number of arguments logged with a device action (see
+ * device_log_action()).
+ */
+#define DEVICE_ACTION_ARGS          (4)
+
+typedef struct device_mapping device_mapping_t;
+
+struct machine;
+
+struct device_mapping
+{
+    /*
+     * The range of guest addresses [base, base + size) decoded by the device.
+     * The range may be any size; pages it covers entirely are also entered
+     * into the page table. A device of size 0 decodes no addresses, and is
+     * only updated for its scheduled events.
+     */
+    word_t base;
+    word_t size;
+
+    /*
+     * Access handlers, one per access width. Each receives the device and the
+     * full guest address. A NULL handler makes accesses of that width fault.
+     */
+    byte_t (*read_byte)(device_mapping_t* device, word_t addr);
+    hword_t (*read_hword)(device_mapping_t* device, word_t addr);
+    word_t (*read_word)(device_mapping_t* device, word_t addr);
+
+    void (*write_byte)(device_mapping_t* device, word_t addr, byte_t value);
+    void (*write_hword)(device_mapping_t* device, word_t addr, hword_t value);
+    void (*write_word)(device_mapping_t* device, word_t addr, word_t value);
+
+    /*
+     * Called with the current guest time (in retired instructions) after the
+     * device's registers have been accessed, or once its scheduled event
+     * has come due. May be NULL for devices that do all their work in their
+     * access handlers.
+     */
+    void (*update)(device_mapping_t* device, uint64_t now);
+
+    /*
+     * Checks whether word reads of the register at the given address are
+     * stable: until the device's next scheduled event, they keep returning
+     * the same value, and neither they nor the updates they cause change
+     * anything. If so, stores that value without making a read. Loops polling
+     * a stable register are skipped up to the event (see processor_idle.c).
+     * May be NULL if no register is stable.
+     */
+    bool (*poll_stable)(device_mapping_t* device, word_t addr, word_t* value);
+
+    /*
+     * Blocks the host thread until the device has input for the guest, when
+     * the processor is waiting for an interrupt or spinning in an idle loop
+     * and no event is scheduled (see processor_idle.c). Returns false at once
+     * if no input can arrive. May be NULL.
+     */
+    bool (*wait)(device_mapping_t* device);
+
+    /*
+     * Called while instructions are being re-executed, at the guest time at
+     * which the device logged an action with device_log_action(), with the
+     * logged arguments. Redoes what the device did to guest memory then,
+     * without changing the device's state. May be NULL for devices that log
+     * no actions.
+     */
+    void (*replay)(device_mapping_t* device, const word_t* args);
+
+    /*
+     * Called to push out any output the device is buffering on the host.
+     * May be NULL.
+     */
+    void (*flush)(device_mapping_t* device);
+
+    /*
+     * Called when the machine is destroyed, to release the device's state.
+     * May be NULL.
+     */
+    void (*destroy)(device_mapping_t* device);
+
+    /*
+     * The device's own state.
+     */
+    void* context;
+
+    /*
+     * Scheduler bookkeeping, owned by devices.c.
+     */
+    uint64_t event_deadline;
+    int event_slot;
+    bool touched;
+};
+
+/*
+ * A position in the device input log (see devices.c): an entry, how many of
+ * its repeats have already been read, and the next logged action.
+ */
 typedef struct
 {
-    byte_t* (*get_byte)(word_t);
-    hword_t* (*get_hword)(word_t);
-    word_t* (*get_word)(word_t);
+    uint64_t entry;
+    word_t repeat;
+    uint64_t action;
+} device_log_pos_t;
+
+/**
+ * @brief Checks whether an address lies in a device's mapped range.
+ */
+#define device_contains_addr(__device__, __addr__) \
+        ((word_t)((__addr__) - (__device__)->base) < (__device__)->size)
+
+/*
+ * The machine's device state (see machine.h) includes:
+ *
+ * device_mmio_touched: set whenever a device register is accessed. Engines
+ * that defer device updates use this to know when they must run them.
+ *
+ * device_next_event: the earliest scheduled device event, in guest time, or
+ * the machine's instruction limit if that comes first. 0 while the machine
+ * has been kicked.
+ *
+ * device_kicked: set by device_kick() from any thread, and cleared when the
+ * devices are serviced.
+ *
+ * device_bus_fault_handler: called for accesses that no device decodes.
+ * Reads of such addresses return 0 and writes are dropped.
+ *
+ * device_interrupt_poll: called at the end of every servicing of the
+ * devices, so that the interrupt controller can deliver an interrupt (see
+ * device_intc.c). May be NULL.
+ *
+ * device_interrupt_entry: enters an interrupt handler. Interrupts are
+ * delivered through device_interrupt(), which logs them.
+ *
+ * device_log: the device input log, or NULL while device reads are not being
+ * logged.
+ *
+ * device_replay_end: the guest time up to which device reads are replayed
+ * from the log instead of reaching the devices (see device_replaying()).
+ */
+
+/**
+ * @brief Evaluates to true while the machine is re-executing instructions
+ *        that it has already executed once. Device reads then return the
+ *        values they returned the first time, and device writes are dropped.
+ */
+#define device_replaying() \
+        (machine->instret < machine->device_replay_end)
+
+/**
+ * @brief Services the devices if any of them were accessed or have an event
+ *        due. Cheap enough to call after every instruction. Evaluates to
+ *        false once the machine has reached its instruction limit.
+ */
+#define device_poll(__now__) \
+        ((machine->device_mmio_touched || \
+          ((__now__) >= machine->device_next_event)) ? \
+         device_service(__now__) : true)
+
+void device_init();
+void device_destroy();
+
+device_mapping_t* device_register(const device_mapping_t* device_mapping);
+bool device_get_mapping_for_addr(word_t addr,
+                                 device_mapping_t** device_mapping_ptr);
+
+byte_t device_read_byte(word_t addr);
+hword_t device_read_hword(word_t addr);
+word_t device_read_word(word_t addr);
+
+void device_write_byte(word_t addr, byte_t value);
+void device_write_hword(word_t addr, hword_t value);
+void device_write_word(word_t addr, word_t value);
 
-    bool (*get_addr_in_device_map)(word_t);
-    void (*update)();
-} device_mapping_t;
+bool device_poll_stable(word_t addr, word_t* value);
+bool device_wait();
 
+void device_flush();
 
-void device_register(device_mapping_t* device_mapping);
+void device_schedule(device_mapping_t* device_mapping, uint64_t deadline);
+void device_set_instret_limit(uint64_t limit);
+bool device_service(uint64_t now);
+void device_kick(struct machine* target);
+uint64_t device_next_deadline();
+void device_interrupt(word_t handler);
 
-byte_t* device_get_byte(word_t);
-hword_t* device_get_hword(word_t);
-word_t* device_get_word(word_t);
-void device_update();
+bool device_log_init();
+void device_log_tell(device_log_pos_t* pos);
+void device_log_replay(const device_log_pos_t* pos, uint64_t end);
+void device_log_trim(const device_log_pos_t* pos);
+void device_log_record_repeat(word_t value, uint64_t count);
+word_t device_log_input(word_t value);
+void device_log_action(device_mapping_t* device_mapping, const word_t* args);
 
 #endif // DEVICES_H
@@ -1,14 +0,0 @@
-/**
- * @brief The global configuration flags for the emulator.
- *
- * @author Kevin Balke
- */
-
-#ifndef GLOBAL_CONFIG_H
-#define GLOBAL_CONFIG_H
-
-#include <stdint.h>
-
-extern uint32_t global_verbosity;
-
-#endif // GLOBAL_CONFIG_H
@@ -0,0 +1,69 @@
+#include "machine.h"
+#include "device_counter.h"
+#include "device_dma.h"
+#include "device_intc.h"
+#include "device_timer.h"
+#include "devices.h"
+#include "processor.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "stats.h"
+
+#include <stdlib.h>
+
+__thread machine_t* machine = NULL;
+
+/**
+ * @brief Creates a machine with its memory mapped and only its built-in
+ *        devices (the interrupt controller, the counters, the timer and the
+ *        DMA engine), and binds it to the calling thread.
+ */
+machine_t* machine_create()
+{
+    machine_t* m = (machine_t*)calloc(1, sizeof(machine_t));
+
+    if(m == NULL)
+        return NULL;
+
+    m->console = stdout;
+
+    machine_bind(m);
+
+    device_init();
+
+    if(!proc_init() || !intc_init() || !counter_init() || !timer_init() ||
+       !dma_init() || !stats_init())
+    {
+        machine_destroy(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+/**
+ * @brief Makes the given machine the one that the calling thread operates on.
+ */
+void machine_bind(machine_t* m)
+{
+    machine = m;
+}
+
+/**
+ * @brief Shuts down a machine's devices and frees everything it owns.
+ */
+void machine_destroy(machine_t* m)
+{
+    machine_bind(m);
+
+    profile_destroy();
+    snapshot_destroy();
+    trace_destroy();
+    device_destroy();
+    proc_destroy();
+    stats_destroy();
+
+    free(m);
+
+    machine_bind(NULL);
+}
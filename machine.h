@@ -0,0 +1,182 @@
+/**
+ * @brief The machine context.
+ *
+ * Everything that makes up one emulated DankBox (processor state, memory, the
+ * page table, the devices and the execution engines' caches) lives in a
+ * machine_t. Any number of machines can exist in one process. Each thread
+ * operates on the machine bound to it with machine_bind(); machines share no
+ * mutable state, so different machines can run on different threads.
+ */
+
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include "architecture.h"
+#include "cycles.h"
+#include "devices.h"
+#include "trace.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct proc_decoded_instr;
+struct proc_jit;
+struct trace;
+struct device_log;
+struct intc;
+struct snapshot_history;
+struct profile;
+struct stats;
+
+typedef struct machine
+{
+    /*
+     * Processor state. The instruction count doubles as the guest time.
+     */
+    register_map_t regs;
+    uint64_t instret;
+
+    /*
+     * The ALU flags in regs.SR are only kept up to date outside proc_run().
+     * Inside it, the last flag-producing instruction records its overflow
+     * term (bit 31) and its result here, along with the guest time at which
+     * it retired; the flags are built from these only when something reads
+     * SR (see proc_flags_sync()). These stay next to the registers so that
+     * translated code can reach them.
+     */
+    uint64_t flags_at;
+    word_t flags_o;
+    word_t flags_result;
+
+    /*
+     * The estimated hardware cycles so far, under the cycle model (see
+     * cycles.h). Also kept where translated code can reach it.
+     */
+    uint64_t cycles;
+    cycle_model_t cycle_model;
+
+    /*
+     * The guest time at which proc_run() stops, even if the processor has not
+     * halted.
+     */
+    uint64_t instret_limit;
+
+    /*
+     * Whether idle polling loops are skipped, and how many instructions have
+     * been skipped or slept so far (see processor_idle.c).
+     */
+    bool idle_skip;
+    uint64_t idle_skipped;
+
+    /*
+     * Host memory backing the ROM (first) and the RAM.
+     */
+    byte_t* memory;
+
+    /*
+     * The predecoded ROM image, one record per ROM word, and the threaded
+     * engine's handler table once it has been linked to it.
+     */
+    struct proc_decoded_instr* predecoded;
+    const void* const* instr_handlers;
+
+    /*
+     * The page table (see memmap.h).
+     */
+    uintptr_t* page_table;
+    device_mapping_t** page_devices;
+
+    /*
+     * The registered devices, sorted by base address, and the device that
+     * satisfied the last lookup.
+     */
+    device_mapping_t** device_index;
+    word_t device_count;
+    device_mapping_t* device_last_hit;
+
+    /*
+     * Device scheduling (see devices.h).
+     */
+    bool device_mmio_touched;
+    uint64_t device_next_event;
+    atomic_bool device_kicked;
+    device_mapping_t** device_touched;
+    word_t device_num_touched;
+    device_mapping_t** device_events;
+    word_t device_num_events;
+
+    void (*device_bus_fault_handler)(word_t addr, bool write);
+    void (*device_interrupt_poll)();
+    void (*device_interrupt_entry)(word_t handler);
+
+    struct device_log* device_log;
+    uint64_t device_replay_end;
+
+    /*
+     * The interrupt controller, and whether it has an enabled interrupt
+     * pending (see device_intc.c).
+     */
+    struct intc* intc;
+    bool irq_pending;
+
+    /*
+     * Execution engine caches.
+     */
+    uint8_t* block_lengths;
+    bool block_flushed;
+
+    /*
+     * The idiom fused at each ROM word, if any, and how often each idiom
+     * executed fused and unfused (see processor_fusion.c).
+     */
+    uint8_t* block_fusions;
+    uint64_t* fusion_hits;
+    uint64_t* fusion_misses;
+    struct proc_jit* jit;
+
+    /*
+     * Nonzero to trace execution to stdout.
+     */
+    uint32_t verbosity;
+
+    /*
+     * The binary trace being written, or NULL, and the flight recorder (see
+     * trace.h).
+     */
+    struct trace* trace;
+    trace_flight_entry_t flight[TRACE_FLIGHT_ENTRIES];
+
+    /*
+     * Snapshots for reverse execution, or NULL (see snapshot.h).
+     */
+    struct snapshot_history* snapshots;
+
+    /*
+     * The guest profiler, or NULL (see profile.h).
+     */
+    struct profile* profile;
+
+    /*
+     * The performance counters, or NULL if they are not compiled in (see
+     * stats.h).
+     */
+    struct stats* stats;
+
+    /*
+     * Where DUMP prints the registers (stdout by default).
+     */
+    FILE* console;
+} machine_t;
+
+/*
+ * The machine bound to the calling thread.
+ */
+extern __thread machine_t* machine;
+
+machine_t* machine_create();
+void machine_bind(machine_t* m);
+void machine_destroy(machine_t* m);
+
+#endif // MACHINE_H
@@ -4,14 +4,23 @@
  * @author Kevin Balke
  */
 
-#include "global_config.h"
+#include "batch.h"
+#include "cosim.h"
+#include "cycles.h"
+#include "debug.h"
 #include "device_uart.h"
 #include "devices.h"
+#include "machine.h"
 #include "processor.h"
+#include "profile.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <stdio.h>
-
-uint32_t global_verbosity;
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 int main(int argc, char** argv)
 {
@@ -20,14 +29,45 @@ int main(int argc, char** argv)
      */
     if(argc < 2)
     {
-        printf("USAGE:\n\t%s:\t[-v]\t[BINFILE]\n", argv[0]);
+        printf("USAGE:\n\t%s:\t[-v]\t[-p]\t[-e ENGINE]\t[-u SINK]\t[-i SOURCE]"
+               "\t[-n COUNT]\t[-t TRACE]\t[-r INTERVAL]"
+               "\n\t\t[-P PROFILE]\t[-S SYMBOLS]\t[-F PERIOD]\t[-c STATS]"
+               "\t[-m SHARED]\t[-y CYCLES]\t[-W]\t[BINFILE]\n"
+               "\t%s:\t-b\t[-e ENGINE]\t[-j THREADS]\t[-n COUNT]\t[MANIFEST]\n"
+               "\t%s:\t-C\t[-e ENGINE]\t[-k INTERVAL]\t[-H]\t[-n COUNT]"
+               "\t[-y CYCLES]\t[BINFILE]\n"
+               "\t%s:\t-D\t[TRACE]\n"
+               "\t%s:\t-M\t[SHARED]\n"
+               "\nENGINES:\n\tswitch (default), threaded, block, jit\n"
+               "\nSINKS (UART output):\n\t- (stdout, default), FILE, |COMMAND\n"
+               "\nSOURCES (UART input):\n\t- (stdin), pty, unix:PATH\n"
+               "\nMANIFEST lines (see batch.c):\n\tBINFILE [GOLDEN [BUDGET]]\n",
+               argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 1;
     }
 
-    /*
-     * Initialize the global flags.
-     */
-    global_verbosity = 0;
+    uint32_t verbosity = 0;
+    proc_engine_t engine = PROC_ENGINE_SWITCH;
+    bool print_perf = false;
+    const char* uart_sink = NULL;
+    const char* uart_source = NULL;
+    uint64_t instret_limit = DEVICE_NO_EVENT;
+    bool batch = false;
+    int threads = 0;
+    const char* trace_file = NULL;
+    bool decode = false;
+    uint64_t snapshot_interval = 0;
+    const char* profile_file = NULL;
+    const char* symbols_file = NULL;
+    uint64_t profile_period = PROFILE_DEFAULT_PERIOD;
+    const char* stats_file = NULL;
+    const char* shared_file = NULL;
+    bool monitor = false;
+    bool cosim = false;
+    uint64_t cosim_interval = 1;
+    bool cosim_memory = false;
+    const char* cycle_model = NULL;
+    bool idle_skip = true;
 
     /*
      * We don't care about the program invocation name at this point.
@@ -39,7 +79,140 @@ int main(int argc, char** argv)
     {
         if(strcmp(argv[0], "-v") == 0)
         {
-            global_verbosity = 1;
+            verbosity = 1;
+        }
+        else if(strcmp(argv[0], "-p") == 0)
+        {
+            print_perf = true;
+        }
+        else if((strcmp(argv[0], "-e") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            if(!proc_engine_from_name(argv[0], &engine))
+            {
+                printf("Unknown engine: %s\n", argv[0]);
+                return 1;
+            }
+        }
+        else if((strcmp(argv[0], "-u") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            uart_sink = argv[0];
+        }
+        else if((strcmp(argv[0], "-i") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            uart_source = argv[0];
+        }
+        else if((strcmp(argv[0], "-n") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            instret_limit = strtoull(argv[0], NULL, 0);
+        }
+        else if(strcmp(argv[0], "-b") == 0)
+        {
+            batch = true;
+        }
+        else if((strcmp(argv[0], "-j") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            threads = atoi(argv[0]);
+        }
+        else if((strcmp(argv[0], "-t") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            trace_file = argv[0];
+        }
+        else if(strcmp(argv[0], "-D") == 0)
+        {
+            decode = true;
+        }
+        else if((strcmp(argv[0], "-P") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            profile_file = argv[0];
+        }
+        else if((strcmp(argv[0], "-S") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            symbols_file = argv[0];
+        }
+        else if((strcmp(argv[0], "-F") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            profile_period = strtoull(argv[0], NULL, 0);
+        }
+        else if((strcmp(argv[0], "-c") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            stats_file = argv[0];
+        }
+        else if((strcmp(argv[0], "-m") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            shared_file = argv[0];
+        }
+        else if(strcmp(argv[0], "-M") == 0)
+        {
+            monitor = true;
+        }
+        else if(strcmp(argv[0], "-C") == 0)
+        {
+            cosim = true;
+        }
+        else if((strcmp(argv[0], "-k") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            cosim_interval = strtoull(argv[0], NULL, 0);
+        }
+        else if(strcmp(argv[0], "-H") == 0)
+        {
+            cosim_memory = true;
+        }
+        else if((strcmp(argv[0], "-y") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            cycle_model = argv[0];
+        }
+        else if(strcmp(argv[0], "-W") == 0)
+        {
+            idle_skip = false;
+        }
+        else if((strcmp(argv[0], "-r") == 0) && (argc > 2))
+        {
+            argc--;
+            argv++;
+
+            snapshot_interval = strtoull(argv[0], NULL, 0);
+
+            if(snapshot_interval == 0)
+                snapshot_interval = SNAPSHOT_DEFAULT_INTERVAL;
         }
 
         argc--;
@@ -47,27 +220,188 @@ int main(int argc, char** argv)
     }
 
     /*
-     * Initialize the processor.
+     * In decode mode, the last argument is a trace to print.
+     */
+    if(decode)
+        return trace_decode(argv[0], stdout) ? 0 : 1;
+
+    /*
+     * In monitor mode, the last argument is the counters shared by another
+     * emulator.
+     */
+    if(monitor)
+        return stats_monitor(argv[0]) ? 0 : 1;
+
+    if(((stats_file != NULL) || (shared_file != NULL)) && !stats_enabled())
+    {
+        printf("Counters are not compiled in; build emu-stats\n");
+        return 1;
+    }
+
+    /*
+     * Dump the flight recorder if anything goes badly wrong.
+     */
+    trace_install_crash_handler();
+
+    /*
+     * In batch mode, the last argument is the manifest of images to run, and
+     * -n sets the budget of the images the manifest gives none.
      */
-    proc_init();
+    if(batch)
+        return batch_run(argv[0], engine, threads,
+                         (instret_limit != DEVICE_NO_EVENT) ? instret_limit :
+                         BATCH_DEFAULT_BUDGET) ? 0 : 1;
+
+    /*
+     * In co-simulation mode, run the image on the engine and on the reference
+     * interpreter in lockstep.
+     */
+    if(cosim)
+        return cosim_run(argv[0], engine, cosim_interval, cosim_memory,
+                         instret_limit, cycle_model) ? 0 : 1;
+
+    /*
+     * Create the machine, which initializes the processor.
+     */
+    machine_t* m = machine_create();
+
+    if(m == NULL)
+        return 1;
+
+    m->verbosity = verbosity;
+    m->idle_skip = idle_skip;
 
     /*
      * Initialize the UART device.
      */
-    uart_init();
+    if(!uart_init(uart_sink, uart_source))
+    {
+        machine_destroy(m);
+        return 1;
+    }
+
+    /*
+     * Load the cycle model, if one was given, before the program is
+     * predecoded with it.
+     */
+    if((cycle_model != NULL) && !cycles_load(cycle_model))
+    {
+        machine_destroy(m);
+        return 1;
+    }
 
     /*
      * Load the program binary from the provided binary file. The filename
      * should be the last argument after parsing the flags.
      */
-    proc_load_program(argv[0]);
+    if(!proc_load_program(argv[0]))
+    {
+        machine_destroy(m);
+        return 1;
+    }
+
+    /*
+     * Start the binary trace, if one was asked for.
+     */
+    if((trace_file != NULL) && !trace_init(trace_file))
+    {
+        machine_destroy(m);
+        return 1;
+    }
+
+    /*
+     * Share the counters, if asked to.
+     */
+    if((shared_file != NULL) && !stats_share(shared_file))
+    {
+        machine_destroy(m);
+        return 1;
+    }
+
+    /*
+     * Start the profiler, if it was asked for.
+     */
+    if((profile_file != NULL) &&
+       !profile_init(profile_file, symbols_file, profile_period))
+    {
+        machine_destroy(m);
+        return 1;
+    }
+
+    /*
+     * With -r, hand the program to the reverse-debugging monitor instead of
+     * running it straight through.
+     */
+    if(snapshot_interval != 0)
+    {
+        bool ok = debug_run(engine, snapshot_interval);
+
+        machine_destroy(m);
+
+        return ok ? 0 : 1;
+    }
+
+    /*
+     * Execute the program until it halts or reaches the instruction limit.
+     */
+    struct timespec start_time, end_time;
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    bool halted = proc_run(engine, instret_limit);
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+    stats_finish();
+
+    /*
+     * Wait for the UART to finish writing its output.
+     */
+    fflush(stdout);
+    device_flush();
+
+    /*
+     * Report the guest instruction throughput.
+     */
+    if(print_perf)
+    {
+        double seconds = (end_time.tv_sec - start_time.tv_sec) +
+                         (end_time.tv_nsec - start_time.tv_nsec) * 1e-9;
+
+        /*
+         * Skipped instructions cost no host time, so they are left out of the
+         * throughput.
+         */
+        fprintf(stderr, "%llu instructions in %.6f s (%.2f MIPS executed)\n",
+                (unsigned long long)m->instret, seconds,
+                (m->instret - m->idle_skipped) / seconds / 1e6);
+
+        fprintf(stderr, "%llu cycles (%.2f per instruction)\n",
+                (unsigned long long)m->cycles,
+                m->instret ? (double)m->cycles / m->instret : 0.0);
+
+        fprintf(stderr, "%llu instructions skipped while idle\n",
+                (unsigned long long)m->idle_skipped);
+
+        proc_fusion_report(stderr);
+    }
+
+    /*
+     * Write out the counters.
+     */
+    if((stats_file != NULL) && !stats_write_json(stats_file))
+        return 1;
 
     /*
-     * Execute the program in a loop.
+     * Write out the profile.
      */
-    while(proc_instr_execute(get_mem_word(proc_regs.PC)))
+    if((profile_file != NULL) && !profile_report(stderr))
+        return 1;
+
+    if(!halted)
     {
-        device_update();
+        fprintf(stderr, "Instruction limit reached\n");
+        return 2;
     }
 
     return 0;
@@ -0,0 +1,103 @@
+#include "memmap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/**
+ * @brief Allocates an empty page table. Untouched entries are never faulted
+ *        in, so the host only pays for pages that are actually mapped.
+ *        Returns false if it cannot be allocated.
+ *
+ * The tables are mapped directly rather than calloc()ed: once a large block
+ * has been freed, malloc serves the next one from its heap and zeroes it in
+ * full, which made creating a machine cost milliseconds.
+ */
+bool mem_init()
+{
+    machine->page_table = (uintptr_t*)mmap(
+            NULL, MEM_NUM_PAGES * sizeof(uintptr_t), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    machine->page_devices = (device_mapping_t**)mmap(
+            NULL, MEM_NUM_PAGES * sizeof(device_mapping_t*),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(machine->page_table == MAP_FAILED)
+        machine->page_table = NULL;
+
+    if(machine->page_devices == MAP_FAILED)
+        machine->page_devices = NULL;
+
+    return (machine->page_table != NULL) && (machine->page_devices != NULL);
+}
+
+/**
+ * @brief Frees the page table.
+ */
+void mem_destroy()
+{
+    if(machine->page_table != NULL)
+        munmap(machine->page_table, MEM_NUM_PAGES * sizeof(uintptr_t));
+
+    if(machine->page_devices != NULL)
+        munmap(machine->page_devices,
+               MEM_NUM_PAGES * sizeof(device_mapping_t*));
+
+    machine->page_table = NULL;
+    machine->page_devices = NULL;
+}
+
+/**
+ * @brief Maps a page-aligned region of guest addresses onto host memory.
+ */
+void mem_map_region(word_t base, word_t size, byte_t* host)
+{
+    word_t page;
+    uintptr_t bias = (uintptr_t)host - base;
+
+    if((base & MEM_PAGE_MASK) || (size & MEM_PAGE_MASK))
+    {
+        fprintf(stderr, "Memory region @0x%08x (0x%x bytes) is not page "
+                "aligned\n", base, size);
+        exit(1);
+    }
+
+    /*
+     * A bias of 0 marks a page that is not backed by memory.
+     */
+    if(bias == 0)
+    {
+        fprintf(stderr, "Memory region @0x%08x cannot be mapped at the same "
+                "host address\n", base);
+        exit(1);
+    }
+
+    for(page = mem_page_index(base); page < mem_page_index(base) +
+        (size >> MEM_PAGE_BITS); page++)
+    {
+        machine->page_table[page] = bias;
+        machine->page_devices[page] = NULL;
+    }
+}
+
+/**
+ * @brief Maps a page-aligned range of guest addresses to a device.
+ */
+void mem_map_device(word_t base, word_t size, device_mapping_t* device)
+{
+    word_t page;
+
+    if((base & MEM_PAGE_MASK) || (size & MEM_PAGE_MASK))
+    {
+        fprintf(stderr, "Device region @0x%08x (0x%x bytes) is not page "
+                "aligned\n", base, size);
+        exit(1);
+    }
+
+    for(page = mem_page_index(base); page < mem_page_index(base) +
+        (size >> MEM_PAGE_BITS); page++)
+    {
+        machine->page_table[page] = 0;
+        machine->page_devices[page] = device;
+    }
+}
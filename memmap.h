@@ -0,0 +1,53 @@
+#ifndef MEMMAP_H
+#define MEMMAP_H
+
+#include "architecture.h"
+#include "devices.h"
+#include "machine.h"
+
+#include <stdint.h>
+
+/*
+ * The guest address space is divided into 4 KiB pages.
+ */
+#define MEM_PAGE_BITS               (12)
+#define MEM_PAGE_SIZE               (1ul << MEM_PAGE_BITS)
+#define MEM_PAGE_MASK               (MEM_PAGE_SIZE - 1)
+#define MEM_NUM_PAGES \
+        (1ul << (ARCH_WORD_WIDTH_BITS - MEM_PAGE_BITS))
+
+/*
+ * Each machine has a page table (machine->page_table). For each page backed
+ * by host memory, it holds the host address of guest address 0 as seen
+ * through that page, so that a guest address translates to a host address
+ * with one shift, one load and one add. It holds 0 for pages that are not
+ * backed by host memory. Alongside it, machine->page_devices holds the device
+ * mapped to each page, or NULL.
+ */
+
+#define mem_page_index(__addr__) \
+        ((__addr__) >> MEM_PAGE_BITS)
+
+#define mem_page_bias(__addr__) \
+        (machine->page_table[mem_page_index(__addr__)])
+
+/**
+ * @brief Returns the device mapped to the page containing the given address,
+ *        or NULL.
+ */
+#define mem_page_device(__addr__) \
+        (machine->page_devices[mem_page_index(__addr__)])
+
+/**
+ * @brief Computes the host address for a guest address on a page backed by
+ *        host memory.
+ */
+#define mem_host_addr(__addr__) \
+        (mem_page_bias(__addr__) + (__addr__))
+
+bool mem_init();
+void mem_destroy();
+void mem_map_region(word_t base, word_t size, byte_t* host);
+void mem_map_device(word_t base, word_t size, device_mapping_t* device);
+
+#endif // MEMMAP_H
@@ -1,61 +1,333 @@
-#include "global_config.h"
 #include "processor.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-register_map_t proc_regs;
-byte_t* real_memory;
+#define PROC_OPCODE_NAME(__opc__) [PROC_OPCODE_##__opc__] = #__opc__
+
+static const char* const proc_opcode_names[256] =
+{
+    PROC_OPCODE_NAME(ADD),
+    PROC_OPCODE_NAME(ADDI),
+    PROC_OPCODE_NAME(ADDUI),
+    PROC_OPCODE_NAME(LUH),
+    PROC_OPCODE_NAME(MUL),
+    PROC_OPCODE_NAME(MULI),
+    PROC_OPCODE_NAME(PUSH),
+    PROC_OPCODE_NAME(PUSHI),
+    PROC_OPCODE_NAME(POP),
+    PROC_OPCODE_NAME(JUMP),
+    PROC_OPCODE_NAME(JUMPI),
+    PROC_OPCODE_NAME(BR),
+    PROC_OPCODE_NAME(BI),
+    PROC_OPCODE_NAME(CALL),
+    PROC_OPCODE_NAME(MOV),
+    PROC_OPCODE_NAME(HALT),
+    PROC_OPCODE_NAME(DUMP),
+    PROC_OPCODE_NAME(LOAD),
+    PROC_OPCODE_NAME(STOR),
+    PROC_OPCODE_NAME(RET),
+    PROC_OPCODE_NAME(JZ),
+    PROC_OPCODE_NAME(JZI),
+    PROC_OPCODE_NAME(BZ),
+    PROC_OPCODE_NAME(BZI),
+    PROC_OPCODE_NAME(JLT),
+    PROC_OPCODE_NAME(JLTI),
+    PROC_OPCODE_NAME(BLT),
+    PROC_OPCODE_NAME(BLTI),
+    PROC_OPCODE_NAME(MOVZ),
+    PROC_OPCODE_NAME(MOVLT),
+    PROC_OPCODE_NAME(AND),
+    PROC_OPCODE_NAME(ANDI),
+    PROC_OPCODE_NAME(OR),
+    PROC_OPCODE_NAME(ORI),
+    PROC_OPCODE_NAME(INV),
+    PROC_OPCODE_NAME(XOR),
+    PROC_OPCODE_NAME(XORI),
+    PROC_OPCODE_NAME(LOADH),
+    PROC_OPCODE_NAME(LOADB),
+    PROC_OPCODE_NAME(STORH),
+    PROC_OPCODE_NAME(STORB),
+    PROC_OPCODE_NAME(SAR),
+    PROC_OPCODE_NAME(SLL),
+    PROC_OPCODE_NAME(SLR),
+    PROC_OPCODE_NAME(SARI),
+    PROC_OPCODE_NAME(SLRI),
+    PROC_OPCODE_NAME(DIV),
+    PROC_OPCODE_NAME(DIVI),
+    PROC_OPCODE_NAME(DIVUI),
+    PROC_OPCODE_NAME(MOVW),
+    PROC_OPCODE_NAME(BALI),
+    PROC_OPCODE_NAME(JAL),
+    PROC_OPCODE_NAME(WFI),
+    PROC_OPCODE_NAME(RETI)
+};
+
+#undef PROC_OPCODE_NAME
+
+/**
+ * @brief Returns the mnemonic of an opcode, or NULL if it is undefined.
+ */
+const char* proc_opcode_name(opcode_t opcode)
+{
+    return proc_opcode_names[opcode];
+}
+
+/**
+ * @brief Raises a bus fault for an access to an address that nothing decodes.
+ */
+static void proc_bus_fault(word_t addr, bool write)
+{
+    if(machine->verbosity)
+        printf("Bus fault @PC=0x%08x: %s of unmapped address 0x%08x\n",
+               machine->regs.PC, write ? "write" : "read", addr);
+
+    machine->regs.SR |= SR_FAULT_FLAG | SR_FAULT_BUS_FLAG;
+}
+
+/**
+ * @brief Enters an interrupt handler between two instructions: pushes the PC
+ *        and then the SR as PUSH would, disables interrupts and jumps to the
+ *        handler. Entry is not an instruction; it costs a taken branch.
+ */
+static void proc_interrupt_enter(word_t handler)
+{
+    proc_flags_sync();
+
+    if(machine->verbosity)
+        printf("Interrupt @PC=0x%08x --> 0x%08x\n", machine->regs.PC,
+               handler);
+
+    set_mem_word(machine->regs.SP, machine->regs.PC);
+    proc_access_cycles(machine->regs.SP, sizeof(word_t));
+    proc_predecode_check(machine->regs.SP, sizeof(word_t));
+    machine->regs.SP -= 4;
+
+    set_mem_word(machine->regs.SP, machine->regs.SR);
+    proc_access_cycles(machine->regs.SP, sizeof(word_t));
+    proc_predecode_check(machine->regs.SP, sizeof(word_t));
+    machine->regs.SP -= 4;
+
+    if(machine->profile != NULL)
+        profile_call(handler, machine->regs.PC);
+
+    machine->regs.SR &= ~SR_INT_ENABLE_FLAG;
+    machine->regs.PC = handler;
+    machine->cycles += machine->cycle_model.branch;
+}
 
 /**
- * @brief Initializes the processor.
+ * @brief Returns from an interrupt handler (the RETI instruction): pops the
+ *        SR and the PC that proc_interrupt_enter() pushed. The ALU flags come
+ *        back with the SR.
  */
-void proc_init()
+void proc_interrupt_return()
+{
+    word_t sr;
+
+    machine->regs.SP += 4;
+    sr = proc_load_word(machine->regs.SP);
+    machine->regs.SP += 4;
+    machine->regs.PC = proc_load_word(machine->regs.SP);
+
+    machine->regs.SR = sr;
+    proc_set_alu_flags((sr & SR_ALU_O_FLAG) ? 0x80000000 : 0,
+                       (sr & SR_ALU_Z_FLAG) ? 0 :
+                       (sr & SR_ALU_N_FLAG) ? 0x80000000 : 1);
+
+    if(machine->profile != NULL)
+        profile_return(machine->regs.PC);
+}
+
+/**
+ * @brief Initializes the processor of the current machine. Returns false if
+ *        its memory cannot be allocated; proc_destroy() then frees whatever
+ *        was.
+ */
+bool proc_init()
 {
     /*
      * Initialize the registers to 0.
      */
-    memset(&proc_regs, 0, sizeof(proc_regs));
+    memset(&machine->regs, 0, sizeof(machine->regs));
+
+    machine->instret = 0;
+    machine->cycles = 0;
+
+    machine->idle_skip = true;
+    machine->idle_skipped = 0;
+
+    /*
+     * Start with the default cycle model, until one is loaded.
+     */
+    cycles_init();
 
     /*
      * Allocate memory for the processor. This includes the RAM and the ROM.
+     * It is mapped rather than malloc()ed so that proc_load_program() can map
+     * the program image over the ROM.
      */
-    real_memory = (byte_t*)malloc(sizeof(byte_t) *
-                                  (ARCH_RAM_SIZE + ARCH_ROM_SIZE));
+    machine->memory = (byte_t*)mmap(NULL, ARCH_RAM_SIZE + ARCH_ROM_SIZE,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(machine->memory == MAP_FAILED)
+    {
+        machine->memory = NULL;
+        return false;
+    }
+
+    /*
+     * Allocate the predecoded instruction cache, one record per ROM word.
+     */
+    machine->predecoded = (proc_decoded_instr_t*)malloc(
+            sizeof(proc_decoded_instr_t) * PROC_PREDECODE_ENTRIES);
+
+    if(machine->predecoded == NULL)
+        return false;
+
+    /*
+     * Map the ROM and the RAM into the guest address space.
+     */
+    if(!mem_init())
+        return false;
+
+    mem_map_region(ARCH_ROM_OFFSET, ARCH_ROM_SIZE, machine->memory);
+    mem_map_region(ARCH_RAM_OFFSET, ARCH_RAM_SIZE,
+                   machine->memory + ARCH_ROM_SIZE);
+
+    machine->device_bus_fault_handler = proc_bus_fault;
+    machine->device_interrupt_entry = proc_interrupt_enter;
+
+    machine->instr_handlers = NULL;
 
     /*
      * Set the PC to the program entry point (beginning of ROM).
      */
-    proc_regs.PC = ARCH_ROM_OFFSET;
+    machine->regs.PC = ARCH_ROM_OFFSET;
+
+    /*
+     * Mark the flight recorder's entries as not current, so that the dump
+     * skips instructions that were never recorded.
+     */
+    memset(machine->flight, 0xff, sizeof(machine->flight));
 
     /*
      * Set the SP to the top of RAM.
      */
-    proc_regs.SP = ARCH_RAM_OFFSET + ARCH_RAM_SIZE - sizeof(word_t);
+    machine->regs.SP = ARCH_RAM_OFFSET + ARCH_RAM_SIZE - sizeof(word_t);
+
+    return true;
 }
 
 /**
- * @brief Loads a program into ROM from a file.
+ * @brief Frees the memory and execution engine caches of the current machine.
  */
-void proc_load_program(const char* fname)
+void proc_destroy()
 {
-    FILE* fp = fopen(fname, "r");
+    proc_jit_destroy();
+    proc_block_destroy();
+    mem_destroy();
+
+    free(machine->predecoded);
+
+    if(machine->memory != NULL)
+        munmap(machine->memory, ARCH_RAM_SIZE + ARCH_ROM_SIZE);
+
+    machine->predecoded = NULL;
+    machine->memory = NULL;
+}
+
+/**
+ * @brief Loads a program into ROM from a file. Returns false (after printing
+ *        why) if the file cannot be opened or does not fit in ROM.
+ *
+ * The image is mapped privately over the start of the ROM rather than copied.
+ * Every machine and process that loads the same file then shares its pages
+ * through the page cache; a guest store to ROM copies only the page that it
+ * touches. The rest of the ROM reads as zeroes.
+ *
+ * The pages the guest has not written stay backed by the file, so the file
+ * must not be rewritten in place while it runs: the guest would see the new
+ * contents (out of step with the predecoded instructions), and the emulator
+ * dies with SIGBUS if the file shrinks. Replace the file instead, by renaming
+ * a new one over it, as asm.py does; the running emulators keep the old one.
+ */
+bool proc_load_program(const char* fname)
+{
+    struct stat st;
+    size_t length;
+    void* rom;
+    int fd;
+
+    fd = open(fname, O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0)
+    {
+        fprintf(stderr, "Could not open program %s: %s\n", fname,
+                strerror(errno));
+        return false;
+    }
+
+    if(fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "Could not stat program %s: %s\n", fname,
+                strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    if(!S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "Program %s is not a regular file\n", fname);
+        close(fd);
+        return false;
+    }
+
+    if((st.st_size == 0) || ((uint64_t)st.st_size > ARCH_ROM_SIZE))
+    {
+        fprintf(stderr, "Program %s is %llu bytes; the ROM holds 1 to %lu "
+                "bytes\n", fname, (unsigned long long)st.st_size,
+                ARCH_ROM_SIZE);
+        close(fd);
+        return false;
+    }
+
+    /*
+     * Clear the ROM of any previous image, then map the file over it. The
+     * zeroed tail of the last page comes from the kernel.
+     */
+    length = st.st_size;
+
+    rom = mmap(machine->memory, ARCH_ROM_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
 
-    int readval;
+    if(rom != MAP_FAILED)
+        rom = mmap(machine->memory, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_FIXED, fd, 0);
 
-    int i = 0;
+    close(fd);
 
-    while((readval = fgetc(fp)) != EOF)
+    if(rom == MAP_FAILED)
     {
-        if(global_verbosity)
-            printf("Read byte from file: %02x\n", readval);
-        //get_mem_byte((ARCH_ROM_OFFSET + i++)) = (byte_t)readval;
-        real_memory[i++] = (byte_t)readval;
+        fprintf(stderr, "Could not map program %s: %s\n", fname,
+                strerror(errno));
+        return false;
     }
 
-    fclose(fp);
+    if(machine->verbosity)
+        printf("Mapped %zu bytes from %s into ROM\n", length, fname);
+
+    proc_predecode_rom(length);
+
+    return true;
 }
 
 /**
@@ -87,602 +359,383 @@ void proc_dump_regs()
 {
     int i;
 
-    printf("Contents of registers at PC=0x%08x:\n", proc_regs.PC);
+    /*
+     * Keep the dump in order with output the devices are still writing.
+     */
+    device_flush();
+
+    proc_flags_sync();
+
+    fprintf(machine->console, "Contents of registers at PC=0x%08x:\n",
+            machine->regs.PC);
 
     for(i = 0; i < 12; i++)
     {
-        printf("R%d:\t0x%08x\n", i, proc_reg(i));
+        fprintf(machine->console, "R%d:\t0x%08x\n", i, proc_reg(i));
     }
 
-    printf("PC:\t0x%08x\nLR:\t0x%08x\nSP:\t0x%08x\nSR:\t0x%08x\n\n",
-           proc_regs.PC, proc_regs.LR, proc_regs.SP, proc_regs.SR);
+    fprintf(machine->console,
+            "PC:\t0x%08x\nLR:\t0x%08x\nSP:\t0x%08x\nSR:\t0x%08x\n\n",
+            machine->regs.PC, machine->regs.LR, machine->regs.SP,
+            machine->regs.SR);
+
+    fflush(machine->console);
 }
 
 /**
- * @brief Executes an instruction.
+ * @brief Returns a mask of the registers (1 << index) that an instruction
+ *        names. Only the fields that the instruction actually uses count; the
+ *        RC field, for instance, overlaps the immediate.
  */
-bool proc_instr_execute(word_t instr)
+static uint16_t proc_instr_reg_mask(const proc_decoded_instr_t* decoded)
 {
-    regidx_t ra, rb, rc;
-    word_t imm;
-    opcode_t opcode;
-
-    proc_instr_decode(instr, &ra, &rb, &rc, &imm, &opcode);
-
-    if(global_verbosity)
-        printf("@0x%08x: Decoded 0x%08x"
-               " --> (RA: %d, RB: %d, RC: %d, IMM: %d, OPC: 0x%02x)\n",
-               proc_regs.PC, instr, ra, rb, rc, imm, opcode);
+    uint16_t ra = 1 << decoded->ra;
+    uint16_t rb = 1 << decoded->rb;
+    uint16_t rc = 1 << decoded->rc;
 
-    /*
-     * This will be used to store any new SR flags generated during this cycle.
-     */
-    word_t new_sr = 0;
-
-    bool increment_pc = true;
-
-    switch(opcode)
+    switch(decoded->opcode)
     {
-        /*
-         * ADD instruction.
-         *
-         * RA + RB --> RC
-         *
-         * Sets overflow, zero, and negative flags as appropriate.
-         *
-         * TODO: Check that the flags are set correctly.
-         */
         case PROC_OPCODE_ADD:
-            proc_reg(rc) = proc_reg(ra) + proc_reg(rb);
-
-            /*
-             * Check for overflow.
-             */
-            if(proc_reg(ra) & proc_reg(rb) & ~proc_reg(rc) & 0x80000000)
-                new_sr |= SR_ALU_O_FLAG;
-
-            /*
-             * Check for negative.
-             */
-            if(proc_reg(rc) & 0x80000000)
-                new_sr |= SR_ALU_N_FLAG;
-
-            /*
-             * Check for zero.
-             */
-            if(proc_reg(rc) == 0)
-                new_sr |= SR_ALU_Z_FLAG;
-
-            break;
+        case PROC_OPCODE_MOVZ:
+        case PROC_OPCODE_MOVLT:
+        case PROC_OPCODE_AND:
+        case PROC_OPCODE_OR:
+        case PROC_OPCODE_XOR:
+        case PROC_OPCODE_SAR:
+        case PROC_OPCODE_SLL:
+        case PROC_OPCODE_SLR:
+        case PROC_OPCODE_SARI:
+            return ra | rb | rc;
 
-        /*
-         * ADDI instruction (signed immediate add).
-         *
-         * RA + SignExtend(imm) --> RB
-         *
-         * Sets overflow, zero, and negative flags as appropriate.
-         *
-         * TODO: Check that the flags are set correctly.
-         */
         case PROC_OPCODE_ADDI:
-            proc_reg(rb) = proc_reg(ra) + proc_sign_extend_imm(imm);
-
-            /*
-             * Check for overflow.
-             */
-            if((proc_reg(ra) | proc_sign_extend_imm(imm)) & ~proc_reg(rb) &
-               0x80000000)
-                new_sr |= SR_ALU_O_FLAG;
-
-            /*
-             * Check for negative.
-             */
-            if(proc_reg(rb) & 0x80000000)
-                new_sr |= SR_ALU_N_FLAG;
-
-            /*
-             * Check for zero.
-             */
-            if(proc_reg(rb) == 0)
-                new_sr |= SR_ALU_Z_FLAG;
-
-
-            break;
-
-        /*
-         * ADDUI instruction (unsigned immediate add).
-         *
-         * RA + imm --> RB
-         *
-         * Sets overflow, zero, and negative flags as appropriate.
-         *
-         * TODO: Check that the flags are set correctly.
-         */
         case PROC_OPCODE_ADDUI:
-            proc_reg(rb) = proc_reg(ra) + imm;
-
-            /*
-             * Check for overflow.
-             */
-            if(proc_reg(ra) & ~proc_reg(rb) & 0x80000000)
-                new_sr |= SR_ALU_O_FLAG;
-
-            /*
-             * Check for negative.
-             */
-            if(proc_reg(rb) & 0x80000000)
-                new_sr |= SR_ALU_N_FLAG;
-
-            /*
-             * Check for zero.
-             */
-            if(proc_reg(rb) == 0)
-                new_sr |= SR_ALU_Z_FLAG;
-
-
-            break;
-
-        /*
-         * HALT instruction.
-         *
-         * Stops the processor (terminates the emulator).
-         */
-        case PROC_OPCODE_HALT:
-            return false;
+        case PROC_OPCODE_MOV:
+        case PROC_OPCODE_LOAD:
+        case PROC_OPCODE_STOR:
+        case PROC_OPCODE_JZ:
+        case PROC_OPCODE_JZI:
+        case PROC_OPCODE_BZ:
+        case PROC_OPCODE_JLT:
+        case PROC_OPCODE_JLTI:
+        case PROC_OPCODE_BLT:
+        case PROC_OPCODE_INV:
+        case PROC_OPCODE_XORI:
+        case PROC_OPCODE_LOADH:
+        case PROC_OPCODE_STORH:
+        case PROC_OPCODE_LOADB:
+        case PROC_OPCODE_STORB:
+            return ra | rb;
 
-        /*
-         * DUMP meta-instruction.
-         *
-         * Dumps the contents of the registers (to stdout).
-         */
-        case PROC_OPCODE_DUMP:
-            proc_dump_regs();
-            break;
+        case PROC_OPCODE_ANDI:
+        case PROC_OPCODE_ORI:
+            return ra | rc;
 
-        /*
-         * LUH instruction (load upper halfword).
-         *
-         * {imm[31:16], 16'b0} --> RA
-         */
         case PROC_OPCODE_LUH:
-            proc_reg(ra) = imm << 16;
-            break;
-
-        /*
-         * JUMP instruction.
-         *
-         * RA --> PC
-         */
         case PROC_OPCODE_JUMP:
-            proc_regs.PC = proc_reg(ra);
-
-            increment_pc = false;
-            break;
-
-        /*
-         * JUMPI instruction (jump immediate).
-         *
-         * RA + SignExtend(imm) --> PC
-         */
         case PROC_OPCODE_JUMPI:
-            proc_regs.PC = proc_reg(ra) + proc_sign_extend_imm(imm);
-
-            increment_pc = false;
-            break;
+        case PROC_OPCODE_BR:
+        case PROC_OPCODE_BZI:
+        case PROC_OPCODE_BLTI:
+            return ra;
 
         /*
-         * BR instruction (branch).
-         *
-         * PC + RA --> PC
+         * PUSH and POP name the SP implicitly.
          */
-        case PROC_OPCODE_BR:
-            proc_regs.PC = proc_regs.PC + proc_reg(ra);
+        case PROC_OPCODE_PUSH:
+        case PROC_OPCODE_POP:
+            return ra | (1 << 14);
 
         /*
-         * BI instruction (branch immediate).
-         *
-         * PC + SignExtend(imm) --> PC
+         * RETI pops the SR and the PC.
          */
-        case PROC_OPCODE_BI:
-            proc_regs.PC = proc_regs.PC + proc_sign_extend_imm(imm);
+        case PROC_OPCODE_RETI:
+            return PROC_REG_MASK_PC | (1 << 14) | PROC_REG_MASK_SR;
+    }
 
-            increment_pc = false;
-            break;
+    return 0;
+}
 
-        /*
-         * MOV instruction (move).
-         *
-         * RA --> RB
-         */
-        case PROC_OPCODE_MOV:
-            proc_reg(rb) = proc_reg(ra);
+/**
+ * @brief Returns the cycles that an instruction always costs under the
+ *        current machine's cycle model: its opcode's cost, plus the narrow
+ *        access penalty for halfword and byte loads and stores. The costs that
+ *        depend on the operands are charged as the instruction executes.
+ */
+static uint16_t proc_instr_cycles(const proc_decoded_instr_t* decoded)
+{
+    const cycle_model_t* model = &machine->cycle_model;
+    word_t cycles = model->opcodes[decoded->opcode];
 
-            if(rb == 12)
-                increment_pc = false;
+    switch(decoded->opcode)
+    {
+        case PROC_OPCODE_LOADH:
+        case PROC_OPCODE_LOADB:
+        case PROC_OPCODE_STORH:
+        case PROC_OPCODE_STORB:
+            cycles += model->narrow;
             break;
+    }
 
-        /*
-         * LOAD instruction.
-         *
-         * MEM[RB] --> RA
-         */
-        case PROC_OPCODE_LOAD:
-            proc_reg(ra) = get_mem_word(proc_reg(rb));
+    return (cycles > UINT16_MAX) ? UINT16_MAX : cycles;
+}
 
-            if(ra == 12)
-                increment_pc = false;
-            break;
+/**
+ * @brief Decodes an instruction word into a predecoded instruction record.
+ */
+void proc_instr_predecode(word_t instr, proc_decoded_instr_t* decoded)
+{
+    proc_instr_decode(instr, &decoded->ra, &decoded->rb, &decoded->rc,
+                      &decoded->imm, &decoded->opcode);
 
-        /*
-         * STOR instruction.
-         *
-         * RA --> MEM[RB]
-         */
-        case PROC_OPCODE_STOR:
-            get_mem_word(proc_reg(rb)) = proc_reg(ra);
-            break;
+    decoded->instr = instr;
 
-        /*
-         * JZ instruction (jump zero).
-         *
-         * if(RA == 0): RB --> PC
-         */
-        case PROC_OPCODE_JZ:
-            if(proc_reg(ra) == 0)
-            {
-                proc_regs.PC = proc_reg(rb);
-                increment_pc = false;
-            }
-            break;
+    /*
+     * Sign-extend the immediate once here so that the execute stage does not
+     * have to redo it for every branch and signed-immediate instruction.
+     */
+    decoded->simm = proc_sign_extend_imm(decoded->imm);
 
-        /*
-         * JZI instruction (jump zero immediate).
-         *
-         * if(RA == 0): RB + SignExtend(imm) --> PC
-         */
-        case PROC_OPCODE_JZI:
-            if(proc_reg(ra) == 0)
-            {
-                proc_regs.PC = proc_reg(rb) + proc_sign_extend_imm(imm);
-                increment_pc = false;
-            }
-            break;
+    decoded->reg_mask = proc_instr_reg_mask(decoded);
 
-        /*
-         * BZ instruction (branch zero).
-         *
-         * if(RA == 0): PC + RB --> PC
-         */
-        case PROC_OPCODE_BZ:
-            if(proc_reg(ra) == 0)
-            {
-                proc_regs.PC += proc_reg(rb);
-                increment_pc = false;
-            }
-            break;
+    decoded->cycles = proc_instr_cycles(decoded);
 
-        /*
-         * BZI instruction (branch zero immediate).
-         *
-         * if(RA == 0): PC + SignExtend(imm) --> PC
-         */
-        case PROC_OPCODE_BZI:
-            if(proc_reg(ra) == 0)
-            {
-                proc_regs.PC += proc_sign_extend_imm(imm);
-                increment_pc = false;
-            }
-            break;
+    /*
+     * Link the record to its handler if a threaded engine has published its
+     * handler table.
+     */
+    if(machine->instr_handlers != NULL)
+        decoded->handler = machine->instr_handlers[decoded->opcode];
+}
 
-        /*
-         * JLT instruction (jump zero).
-         *
-         * if(RA < 0): RB --> PC
-         */
-        case PROC_OPCODE_JLT:
-            if(proc_reg(ra) < 0)
-            {
-                proc_regs.PC = proc_reg(rb);
-                increment_pc = false;
-            }
-            break;
+/**
+ * @brief Re-decodes the ROM word containing the provided address, keeping the
+ *        predecoded instruction cache coherent with the contents of ROM.
+ */
+void proc_predecode_word(word_t addr)
+{
+    addr &= ~(sizeof(word_t) - 1);
 
-        /*
-         * JLTI instruction (jump zero immediate).
-         *
-         * if(RA < 0): RB + SignExtend(imm) --> PC
-         */
-        case PROC_OPCODE_JLTI:
-            if(proc_reg(ra) < 0)
-            {
-                proc_regs.PC = proc_reg(rb) + proc_sign_extend_imm(imm);
-                increment_pc = false;
-            }
-            break;
+    if(!get_addr_in_rom(addr))
+        return;
 
-        /*
-         * BLT instruction (branch zero).
-         *
-         * if(RA < 0): PC + RB --> PC
-         */
-        case PROC_OPCODE_BLT:
-            if(proc_reg(ra) < 0)
-            {
-                proc_regs.PC += proc_reg(rb);
-                increment_pc = false;
-            }
-            break;
+    proc_instr_predecode(get_mem_word(addr),
+                         &machine->predecoded[proc_predecode_index(addr)]);
+}
 
-        /*
-         * BLTI instruction (branch zero immediate).
-         *
-         * if(RA < 0): PC + SignExtend(imm) --> PC
-         */
-        case PROC_OPCODE_BLTI:
-            if(proc_reg(ra) < 0)
-            {
-                proc_regs.PC += proc_sign_extend_imm(imm);
-                increment_pc = false;
-            }
-            break;
+/**
+ * @brief Invalidates the predecoded instructions overlapping a store of
+ *        the given width, which may span any number of words (for the DMA
+ *        engine).
+ */
+void proc_predecode_invalidate(word_t addr, word_t width)
+{
+    word_t last = addr + width - 1;
 
-        /*
-         * MOVZ instruction (move zero).
-         *
-         * if(RA == 0): RB --> RC
-         */
-        case PROC_OPCODE_MOVZ:
-            if(proc_reg(ra) == 0)
-            {
-                proc_reg(rc) = proc_reg(rb);
+    for(addr &= ~(sizeof(word_t) - 1); addr <= last; addr += sizeof(word_t))
+        proc_predecode_word(addr);
 
-                if(rc == 12)
-                    increment_pc = false;
-            }
-            break;
+    proc_block_invalidate();
+    proc_jit_invalidate();
+}
 
-        /*
-         * MOVLT instruction (move less than).
-         *
-         * if(RA == 0): RB --> RC
-         */
-        case PROC_OPCODE_MOVLT:
-            if(proc_reg(ra) < 0)
-            {
-                proc_reg(rc) = proc_reg(rb);
+/**
+ * @brief Predecodes the entire ROM image. Must be called after the program
+ *        has been loaded. The ROM past the first length bytes is known to be
+ *        zero, so its record is decoded once and copied.
+ */
+void proc_predecode_rom(word_t length)
+{
+    word_t addr;
+    word_t index;
+    word_t end = ARCH_ROM_OFFSET + length;
 
-                if(rc == 12)
-                    increment_pc = false;
-            }
-            break;
+    for(addr = ARCH_ROM_OFFSET; (addr < end) &&
+        (addr < ARCH_ROM_OFFSET + ARCH_ROM_SIZE); addr += sizeof(word_t))
+        proc_predecode_word(addr);
 
-        /*
-         * PUSH instruction (push to stack).
-         *
-         * RA --> MEM[SP]; SP -= 4
-         */
-        case PROC_OPCODE_PUSH:
-            get_mem_word(proc_regs.SP) = proc_reg(ra);
-            proc_regs.SP -= 4;
-            break;
+    if(addr >= ARCH_ROM_OFFSET + ARCH_ROM_SIZE)
+        return;
 
-        /*
-         * POP instruction (pop from stack).
-         *
-         * SP += 4; MEM[SP] --> RA
-         */
-        case PROC_OPCODE_POP:
-            proc_regs.SP += 4;
-            proc_reg(ra) = get_mem_word(proc_regs.SP);
+    index = proc_predecode_index(addr);
+    proc_instr_predecode(0, &machine->predecoded[index]);
 
-            if(ra == 12)
-                increment_pc = false;
-            break;
+    for(index++; index < PROC_PREDECODE_ENTRIES; index++)
+        machine->predecoded[index] = machine->predecoded[index - 1];
+}
 
-        /*
-         * AND instruction (bitwise).
-         *
-         * RC = RA & RB
-         */
-        case PROC_OPCODE_AND:
-            proc_reg(rc) = proc_reg(ra) & proc_reg(rb);
+/**
+ * @brief Executes an instruction.
+ */
+bool proc_instr_execute(word_t instr)
+{
+    proc_decoded_instr_t decoded;
 
-            if(rc == 12)
-                increment_pc = false;
-            break;
+    proc_instr_predecode(instr, &decoded);
 
-        /*
-         * ANDI instruction (bitwise).
-         *
-         * RC = RA & {16'b0,imm}
-         */
-        case PROC_OPCODE_ANDI:
-            proc_reg(rc) = proc_reg(ra) & ((word_t)imm);
+    return proc_instr_execute_decoded(&decoded);
+}
 
-            if(rc == 12)
-                increment_pc = false;
-            break;
+/**
+ * @brief Fetches and executes the instruction at the current PC. Instructions
+ *        in ROM are taken from the predecoded instruction cache.
+ */
+bool proc_step()
+{
+    proc_decoded_instr_t scratch;
 
-        /*
-         * OR instruction (bitwise).
-         *
-         * RC = RA | RB
-         */
-        case PROC_OPCODE_OR:
-            proc_reg(rc) = proc_reg(ra) | proc_reg(rb);
+    return proc_instr_execute_decoded(proc_fetch(&scratch));
+}
 
-            if(rc == 12)
-                increment_pc = false;
-            break;
+/**
+ * @brief Prints a decoded instruction (used for verbose tracing).
+ */
+void proc_print_decoded(const proc_decoded_instr_t* decoded)
+{
+    printf("@0x%08x: Decoded 0x%08x"
+           " --> (RA: %d, RB: %d, RC: %d, IMM: %d, OPC: 0x%02x)\n",
+           machine->regs.PC, decoded->instr, decoded->ra, decoded->rb,
+           decoded->rc, decoded->imm, decoded->opcode);
+}
 
-        /*
-         * ORI instruction (bitwise).
-         *
-         * RC = RA | {16'b0,imm}
-         */
-        case PROC_OPCODE_ORI:
-            proc_reg(rc) = proc_reg(ra) | ((word_t)imm);
+/**
+ * @brief Executes a predecoded instruction.
+ */
+bool proc_instr_execute_decoded(const proc_decoded_instr_t* decoded)
+{
+    regidx_t ra = decoded->ra;
+    regidx_t rb = decoded->rb;
+    regidx_t rc = decoded->rc;
+    word_t imm = decoded->imm;
+    word_t simm = decoded->simm;
+    opcode_t opcode = decoded->opcode;
+    word_t pc = machine->regs.PC;
 
-            if(rc == 12)
-                increment_pc = false;
-            break;
+    trace_flight_record(pc);
 
-        /*
-         * INV instruction (bitwise).
-         *
-         * RB = ~RA
-         */
-        case PROC_OPCODE_INV:
-            proc_reg(rb) = ~proc_reg(ra);
+    if(machine->verbosity)
+        proc_print_decoded(decoded);
 
-            if(rb == 12)
-                increment_pc = false;
-            break;
+    if(decoded->reg_mask & PROC_REG_MASK_SR)
+        proc_flags_sync();
 
-        /*
-         * XOR instruction (bitwise).
-         *
-         * RC = RA ^ RB
-         */
-        case PROC_OPCODE_XOR:
-            proc_reg(rc) = proc_reg(ra) ^ proc_reg(rb);
+    bool increment_pc = true;
 
-            if(rc == 12)
-                increment_pc = false;
-            break;
+#define PROC_OP(__opc__)    case PROC_OPCODE_##__opc__:
+#define PROC_OP_DEFAULT     default:
+#define PROC_OP_END         break;
+#define PROC_OP_HALT        return false;
 
-        /*
-         * XORI instruction (bitwise).
-         *
-         * RB = RA ^ IMM
-         */
-        case PROC_OPCODE_XORI:
-            proc_reg(rb) = proc_reg(ra) ^ ((word_t)imm);
+    switch(opcode)
+    {
+#include "processor_ops.h"
+    }
 
-            if(rb == 12)
-                increment_pc = false;
-            break;
+#undef PROC_OP
+#undef PROC_OP_DEFAULT
+#undef PROC_OP_END
+#undef PROC_OP_HALT
 
-        /*
-         * LOADH instruction (load halfword).
-         *
-         * RA = MEM[RB]
-         */
-        case PROC_OPCODE_LOADH:
-            proc_reg(ra) = ((word_t)get_mem_hword(proc_reg(rb)));
+    if(increment_pc)
+        machine->regs.PC += 4;
+    else
+        machine->cycles += machine->cycle_model.branch;
 
-            if(ra == 12)
-                increment_pc = false;
-            break;
+    machine->instret++;
+    machine->cycles += decoded->cycles;
 
-        /*
-         * STORH instruction (store halfword).
-         *
-         * MEM[RB] = RA
-         */
-        case PROC_OPCODE_STORH:
-            get_mem_hword(proc_reg(rb)) = ((hword_t)(proc_reg(ra) & 0xFFFF));
-            break;
+    stats_retire(opcode);
 
-        /*
-         * LOADB instruction (load byte).
-         *
-         * RA = {24'b0, MEM[RB]}
-         */
-        case PROC_OPCODE_LOADB:
-            proc_reg(ra) = ((word_t)get_mem_byte(proc_reg(rb)));
+    if(machine->trace != NULL)
+        trace_retire(pc);
 
-            if(ra == 12)
-                increment_pc = false;
-            break;
+    return true;
+}
 
-        /*
-         * STORB instruction (store byte).
-         *
-         * MEM[RB] = RA[7:0]
-         */
-        case PROC_OPCODE_STORB:
-            get_mem_byte(proc_reg(ra)) = ((byte_t)(proc_reg(rb) & 0xFF));
-            break;
+/**
+ * @brief Looks up an execution engine by name.
+ */
+bool proc_engine_from_name(const char* name, proc_engine_t* engine)
+{
+    if(strcmp(name, "switch") == 0)
+        (*engine) = PROC_ENGINE_SWITCH;
+    else if(strcmp(name, "threaded") == 0)
+        (*engine) = PROC_ENGINE_THREADED;
+    else if(strcmp(name, "block") == 0)
+        (*engine) = PROC_ENGINE_BLOCK;
+    else if(strcmp(name, "jit") == 0)
+        (*engine) = PROC_ENGINE_JIT;
+    else
+        return false;
 
-        /*
-         * SAR instruction (shift arithmetic right).
-         *
-         * RC = sign_extend(RA >> RB)
-         */
-        case PROC_OPCODE_SAR:
-            proc_reg(rc) = proc_reg(ra) >> proc_reg(rb);
-            if(proc_reg(ra) & 0x80000000)
-                proc_reg(rc) |= proc_high_ones_mask(proc_reg(rb));
+    return true;
+}
 
-            if(rc == 12)
-                increment_pc = false;
-            break;
+/**
+ * @brief Returns the name of an execution engine.
+ */
+const char* proc_engine_name(proc_engine_t engine)
+{
+    static const char* const names[] = {"switch", "threaded", "block", "jit"};
 
+    return names[engine];
+}
+
+/**
+ * @brief Runs the selected execution engine until the processor halts or
+ *        reaches its instruction limit. Returns true if it halted.
+ */
+static bool proc_run_engine(proc_engine_t engine)
+{
+    switch(engine)
+    {
         /*
-         * SLL instruction (shift logical left).
-         *
-         * RC = RA << RB
+         * The reference interpreter: one switch dispatch per instruction,
+         * returning to this loop to service the devices in between.
          */
-        case PROC_OPCODE_SLL:
-            proc_reg(rc) = proc_reg(ra) << proc_reg(rb);
+        case PROC_ENGINE_SWITCH:
+            while(proc_step())
+                if(!device_poll(machine->instret))
+                    return false;
+            return true;
 
-            if(rc == 12)
-                increment_pc = false;
-            break;
+        case PROC_ENGINE_THREADED:
+            return proc_run_threaded();
 
-        /*
-         * SLR instruction (shift logical right).
-         *
-         * RC = RA >> RB
-         */
-        case PROC_OPCODE_SLR:
-            proc_reg(rc) = proc_reg(ra) >> proc_reg(rb);
+        case PROC_ENGINE_BLOCK:
+            return proc_run_block();
 
-            if(rc == 12)
-                increment_pc = false;
-            break;
+        case PROC_ENGINE_JIT:
+            return proc_run_jit();
+    }
 
-        /*
-         * SARI instruction (shift arithmetic right immediate).
-         *
-         * RC = sign_extend(RA >> sign_extend(IMM))
-         */
-        case PROC_OPCODE_SARI:
-            proc_reg(rc) = proc_reg(ra) >> proc_sign_extend_imm(imm);
+    return false;
+}
 
-            if((proc_sign_extend_imm(imm) > 0) & (proc_reg(ra) & 0x80000000))
-                proc_reg(rc) |= proc_high_ones_mask(proc_reg(rb));
+/**
+ * @brief Runs the processor with the selected execution engine until it
+ *        halts (returning true) or until it has retired instructions up to
+ *        the given limit (returning false). A WFI may sleep past the limit,
+ *        up to the device event that ends its sleep.
+ */
+bool proc_run(proc_engine_t engine, uint64_t instret_limit)
+{
+    bool halted;
 
-            if(rc == 12)
-                increment_pc = false;
-            break;
+    device_set_instret_limit(instret_limit);
 
-        /*
-         * BALI instruction (branch and link immediate).
-         *
-         * LR = PC + 4; PC += sign_extend(IMM)
-         */
-        case PROC_OPCODE_BALI:
-            proc_regs.LR = proc_regs.PC + 4;
-            proc_regs.PC += proc_sign_extend_imm(imm);
-            increment_pc = false;
-            break;
+    proc_flags_load();
 
-        default:
-            if(global_verbosity)
-                printf("Unknown instruction @PC=0x%08x: {opc: 0x%02x, ra: 0x%x\
-, rb: 0x%x, rc: 0x%x, imm: 0x%04x}\n", proc_regs.PC, opcode, proc_reg(ra),
-                       proc_reg(rb), proc_reg(rc), imm);
-            proc_regs.SR |= SR_FAULT_DECODE_FLAG;
-    }
+    halted = proc_run_engine(engine);
 
-    if(increment_pc)
-        proc_regs.PC += 4;
+    proc_flags_sync();
 
-    proc_clear_alu_flags();
+    if(machine->trace != NULL)
+    {
+        if(halted)
+            trace_halt();
 
-    proc_regs.SR |= new_sr;
+        trace_flush();
+    }
 
-    return true;
+    return halted;
 }
@@ -2,8 +2,16 @@
 #define PROCESSOR_H
 
 #include "architecture.h"
+#include "devices.h"
+#include "machine.h"
+#include "memmap.h"
+#include "profile.h"
+#include "stats.h"
+#include "trace.h"
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 /*
  * Opcode definitions.
@@ -70,8 +78,61 @@
 #define PROC_OPCODE_BALI (0x42)
 #define PROC_OPCODE_JAL (0x43)
 
-extern register_map_t proc_regs;
-extern byte_t* real_memory;
+#define PROC_OPCODE_WFI (0x44)
+#define PROC_OPCODE_RETI (0x45)
+
+/**
+ * @brief A predecoded instruction. The ROM image is translated into an array
+ *        of these at load time so that the execute stage does not have to
+ *        re-extract the instruction fields on every fetch.
+ */
+typedef struct proc_decoded_instr
+{
+    /*
+     * The handler for this instruction in the threaded engine. Only valid
+     * once the threaded engine has published its handler table.
+     */
+    const void* handler;
+
+    word_t instr;
+    word_t imm;
+    word_t simm;
+
+    /*
+     * The registers named by the instruction (1 << index).
+     */
+    uint16_t reg_mask;
+
+    /*
+     * The cycles that the instruction always costs (see cycles.h).
+     */
+    uint16_t cycles;
+
+    opcode_t opcode;
+    regidx_t ra;
+    regidx_t rb;
+    regidx_t rc;
+} proc_decoded_instr_t;
+
+#define PROC_PREDECODE_ENTRIES (ARCH_ROM_SIZE / sizeof(word_t))
+
+/*
+ * The maximum number of instructions in a basic block. This bounds the
+ * latency of device updates for long runs of straight-line code (such as
+ * zeroed ROM).
+ */
+#define PROC_BLOCK_MAX_INSTRS (64)
+
+/**
+ * @brief The available execution engines.
+ */
+typedef enum
+{
+    PROC_ENGINE_SWITCH,
+    PROC_ENGINE_THREADED,
+    PROC_ENGINE_BLOCK,
+    PROC_ENGINE_JIT
+} proc_engine_t;
 
 #define get_addr_in_ram(__addr__) \
         ((__addr__) >= ARCH_RAM_OFFSET && \
@@ -81,40 +142,177 @@ extern byte_t* real_memory;
         ((__addr__) >= ARCH_ROM_OFFSET && \
          (__addr__) < (ARCH_ROM_OFFSET + ARCH_ROM_SIZE))
 
-#define get_addr_in_real_mem(__addr__) \
-        (get_addr_in_ram(__addr__) || get_addr_in_rom(__addr__))
-
-/**
- * @brief Computes the real address within real_memory for the given emulated
- *        address.
+/*
+ * Guest memory accesses are translated through the page table: pages backed
+ * by host memory are accessed directly, everything else goes to the devices.
  */
-#define get_real_addr(__addr__) \
-        (get_addr_in_ram(__addr__) ? \
-         ((__addr__) - ARCH_RAM_OFFSET + ARCH_ROM_SIZE) : \
-         get_addr_in_rom(__addr__) ? \
-         ((__addr__) - ARCH_ROM_OFFSET) : \
-         0)
-
 #define get_mem_word(__addr__) \
-        (*(get_addr_in_real_mem(__addr__) ? \
-        ((word_t*)(intptr_t)(real_memory + get_real_addr(__addr__))) : \
-        ((word_t*)(intptr_t)device_get_word(__addr__))))
+        (mem_page_bias(__addr__) ? \
+         (*(word_t*)mem_host_addr(__addr__)) : \
+         device_read_word(__addr__))
 
 #define get_mem_hword(__addr__) \
-        (*(get_addr_in_real_mem(__addr__) ? \
-        ((hword_t*)(intptr_t)(real_memory + get_real_addr(__addr__))) : \
-        ((hword_t*)(intptr_t)device_get_hword(__addr__))))
+        (mem_page_bias(__addr__) ? \
+         (*(hword_t*)mem_host_addr(__addr__)) : \
+         device_read_hword(__addr__))
 
 #define get_mem_byte(__addr__) \
-        (*(get_addr_in_real_mem(__addr__) ? \
-        ((byte_t*)(intptr_t)(real_memory + get_real_addr(__addr__))) : \
-        ((byte_t*)(intptr_t)device_get_byte(__addr__))))
+        (mem_page_bias(__addr__) ? \
+         (*(byte_t*)mem_host_addr(__addr__)) : \
+         device_read_byte(__addr__))
+
+#define set_mem_word(__addr__, __value__) \
+        do { \
+            if(mem_page_bias(__addr__)) \
+                *(word_t*)mem_host_addr(__addr__) = (__value__); \
+            else \
+                device_write_word((__addr__), (__value__)); \
+        } while(0)
+
+#define set_mem_hword(__addr__, __value__) \
+        do { \
+            if(mem_page_bias(__addr__)) \
+                *(hword_t*)mem_host_addr(__addr__) = (__value__); \
+            else \
+                device_write_hword((__addr__), (__value__)); \
+        } while(0)
+
+#define set_mem_byte(__addr__, __value__) \
+        do { \
+            if(mem_page_bias(__addr__)) \
+                *(byte_t*)mem_host_addr(__addr__) = (__value__); \
+            else \
+                device_write_byte((__addr__), (__value__)); \
+        } while(0)
+
+/**
+ * @brief Charges the cycles that an access of __width__ bytes costs beyond
+ *        its instruction's own: the unaligned penalty if the address is not a
+ *        multiple of the width, and the MMIO penalty if it is not backed by
+ *        host memory.
+ */
+#define proc_access_cycles(__addr__, __width__) \
+        do { \
+            if((__addr__) & ((__width__) - 1)) \
+                machine->cycles += machine->cycle_model.unaligned; \
+            if(!mem_page_bias(__addr__)) \
+                machine->cycles += machine->cycle_model.mmio; \
+        } while(0)
+
+/*
+ * Loads and stores made by instructions go through these, so that they can be
+ * traced and their cycles charged.
+ */
+#define PROC_DEFINE_ACCESS(__name__, __type__) \
+        static inline word_t proc_load_##__name__(word_t addr) \
+        { \
+            word_t value = get_mem_##__name__(addr); \
+            proc_access_cycles(addr, sizeof(__type__)); \
+            stats_access(addr, false); \
+            if(machine->trace != NULL) \
+                trace_access(addr, sizeof(__type__), value, false); \
+            return value; \
+        } \
+        static inline void proc_store_##__name__(word_t addr, __type__ value) \
+        { \
+            set_mem_##__name__(addr, value); \
+            proc_access_cycles(addr, sizeof(__type__)); \
+            stats_access(addr, true); \
+            if(machine->trace != NULL) \
+                trace_access(addr, sizeof(__type__), value, true); \
+        }
+
+PROC_DEFINE_ACCESS(word, word_t)
+PROC_DEFINE_ACCESS(hword, hword_t)
+PROC_DEFINE_ACCESS(byte, byte_t)
+
+#undef PROC_DEFINE_ACCESS
+
+/**
+ * @brief Computes the index into the predecoded instruction cache for a ROM
+ *        address.
+ */
+#define proc_predecode_index(__addr__) \
+        (((__addr__) - ARCH_ROM_OFFSET) / sizeof(word_t))
+
+/**
+ * @brief Keeps the predecoded instruction cache coherent after a store of
+ *        __width__ bytes to __addr__.
+ */
+#define proc_predecode_check(__addr__, __width__) \
+        do { \
+            if(get_addr_in_rom(__addr__)) \
+                proc_predecode_invalidate((__addr__), (__width__)); \
+        } while(0)
+
+#define PROC_REG_MASK_PC (1 << 12)
+#define PROC_REG_MASK_SR (1 << 15)
 
 #define proc_reg(__regidx__) \
-        (*(((word_t*)(&proc_regs) + (__regidx__))))
+        (*(((word_t*)(&machine->regs) + (__regidx__))))
 
 #define proc_clear_alu_flags() \
-        proc_regs.SR &= ~SR_ALU_FLAG_MASK
+        machine->regs.SR &= ~SR_ALU_FLAG_MASK
+
+/**
+ * @brief Records the ALU flags produced by the instruction being executed:
+ *        overflow if bit 31 of __o__ is set, and negative and zero from
+ *        __result__. Every other instruction clears the flags simply by
+ *        retiring.
+ */
+#define proc_set_alu_flags(__o__, __result__) \
+        do { \
+            machine->flags_o = (__o__); \
+            machine->flags_result = (__result__); \
+            machine->flags_at = machine->instret + 1; \
+        } while(0)
+
+/**
+ * @brief Returns the ALU flags as of the last retired instruction.
+ */
+static inline word_t proc_alu_flags()
+{
+    if(machine->flags_at != machine->instret)
+        return 0;
+
+    return ((machine->flags_o & 0x80000000) ? SR_ALU_O_FLAG : 0) |
+           ((machine->flags_result & 0x80000000) ? SR_ALU_N_FLAG : 0) |
+           ((machine->flags_result == 0) ? SR_ALU_Z_FLAG : 0);
+}
+
+/**
+ * @brief Builds the ALU flags in SR. Called before anything reads SR while
+ *        the processor runs, and when proc_run() returns.
+ */
+static inline void proc_flags_sync()
+{
+    proc_clear_alu_flags();
+
+    machine->regs.SR |= proc_alu_flags();
+
+    /*
+     * The instruction may enable interrupts: have the devices serviced after
+     * it, so that one already pending is taken (see device_intc.c).
+     */
+    if(machine->irq_pending)
+        machine->device_mmio_touched = true;
+}
+
+/**
+ * @brief Takes the ALU flags from SR, which may have been changed (by a
+ *        snapshot being restored, say) since the processor last ran. Called
+ *        when proc_run() starts. Flags that one result cannot produce
+ *        together (negative and zero) are not kept.
+ */
+static inline void proc_flags_load()
+{
+    word_t sr = machine->regs.SR;
+
+    machine->flags_o = (sr & SR_ALU_O_FLAG) ? 0x80000000 : 0;
+    machine->flags_result = (sr & SR_ALU_Z_FLAG) ? 0 :
+                            (sr & SR_ALU_N_FLAG) ? 0x80000000 : 1;
+    machine->flags_at = machine->instret;
+}
 
 #define proc_sign_extend_imm(__imm__) \
         ((word_t)(((__imm__) & 0x00008000ul) ? \
@@ -126,4 +324,68 @@ extern byte_t* real_memory;
 #define proc_low_ones_mask(__num__) \
         (0xFFFFFFFF >> (32 - (__num__)))
 
+bool proc_init();
+void proc_destroy();
+bool proc_load_program(const char* fname);
+void proc_dump_regs();
+
+void proc_instr_decode(word_t instr, regidx_t* ra, regidx_t* rb, regidx_t* rc,
+                       word_t* imm, opcode_t* opcode);
+void proc_instr_predecode(word_t instr, proc_decoded_instr_t* decoded);
+
+void proc_predecode_word(word_t addr);
+void proc_predecode_invalidate(word_t addr, word_t width);
+void proc_predecode_rom(word_t length);
+
+void proc_print_decoded(const proc_decoded_instr_t* decoded);
+const char* proc_opcode_name(opcode_t opcode);
+
+bool proc_instr_execute(word_t instr);
+bool proc_instr_execute_decoded(const proc_decoded_instr_t* decoded);
+bool proc_step();
+
+bool proc_engine_from_name(const char* name, proc_engine_t* engine);
+const char* proc_engine_name(proc_engine_t engine);
+bool proc_run(proc_engine_t engine, uint64_t instret_limit);
+bool proc_run_threaded();
+bool proc_run_block();
+
+bool proc_block_is_terminator(const proc_decoded_instr_t* decoded);
+void proc_block_invalidate();
+void proc_block_destroy();
+
+bool proc_fusion_init();
+void proc_fusion_destroy();
+uint8_t proc_fusion_match(const proc_decoded_instr_t* instrs, word_t count);
+word_t proc_fusion_execute(uint8_t mark, const proc_decoded_instr_t* instrs,
+                           word_t count);
+void proc_fusion_report(FILE* file);
+
+void proc_idle_skip(word_t pc, word_t simm);
+bool proc_idle_wait();
+
+void proc_interrupt_return();
+
+bool proc_run_jit();
+void proc_jit_invalidate();
+void proc_jit_destroy();
+
+/**
+ * @brief Returns the predecoded record for the instruction at the current
+ *        PC. Instructions outside of ROM are decoded into the provided
+ *        scratch record.
+ */
+static inline const proc_decoded_instr_t* proc_fetch(
+        proc_decoded_instr_t* scratch)
+{
+    word_t pc = machine->regs.PC;
+
+    if(get_addr_in_rom(pc) && !(pc & (sizeof(word_t) - 1)))
+        return &machine->predecoded[proc_predecode_index(pc)];
+
+    proc_instr_predecode(get_mem_word(pc), scratch);
+
+    return scratch;
+}
+
 #endif
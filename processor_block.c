@@ -0,0 +1,192 @@
+/**
+ * @brief Basic-block execution engine for the DankCore processor.
+ *
+ * Straight-line runs of predecoded ROM instructions are executed as a unit.
+ * A block ends at the first instruction that can change the PC (a jump,
+ * branch, HALT, or any instruction naming the PC as a register). Devices are
+ * only serviced between blocks, or as soon as an instruction touches a device
+ * register or a device event comes due. Common instruction idioms within a
+ * block are executed as fused operations (see processor_fusion.c).
+ */
+
+#include "processor.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The block cache (machine->block_lengths) holds, for each ROM word, the
+ * number of instructions in the block starting at that word, or 0 if the
+ * block has not been built. machine->block_flushed is set when the cache is
+ * flushed, so that a block which modified its own instructions stops
+ * executing stale records. The fusion marks (machine->block_fusions) are
+ * set for each block's words when it is built, and flushed with it.
+ */
+
+/**
+ * @brief Returns true if the instruction ends a basic block.
+ */
+bool proc_block_is_terminator(const proc_decoded_instr_t* decoded)
+{
+    switch(decoded->opcode)
+    {
+        case PROC_OPCODE_HALT:
+        case PROC_OPCODE_JUMP:
+        case PROC_OPCODE_JUMPI:
+        case PROC_OPCODE_BR:
+        case PROC_OPCODE_BI:
+        case PROC_OPCODE_JZ:
+        case PROC_OPCODE_JZI:
+        case PROC_OPCODE_BZ:
+        case PROC_OPCODE_BZI:
+        case PROC_OPCODE_JLT:
+        case PROC_OPCODE_JLTI:
+        case PROC_OPCODE_BLT:
+        case PROC_OPCODE_BLTI:
+        case PROC_OPCODE_BALI:
+            return true;
+    }
+
+    /*
+     * Conservatively end the block on any instruction that names the PC, which
+     * covers every write to the PC (MOV, LOAD, POP, ALU ops, ...).
+     */
+    return (decoded->reg_mask & PROC_REG_MASK_PC) != 0;
+}
+
+/**
+ * @brief Builds the block starting at the given predecode index, returning
+ *        its length.
+ */
+static uint8_t proc_block_build(word_t index)
+{
+    uint8_t length = 0;
+    word_t i;
+
+    while((index + length < PROC_PREDECODE_ENTRIES) &&
+          (length < PROC_BLOCK_MAX_INSTRS))
+    {
+        if(proc_block_is_terminator(&machine->predecoded[index + length++]))
+            break;
+    }
+
+    machine->block_lengths[index] = length;
+
+    for(i = 0; (machine->block_fusions != NULL) && (i < length); i++)
+        machine->block_fusions[index + i] =
+                proc_fusion_match(&machine->predecoded[index + i], length - i);
+
+    return length;
+}
+
+/**
+ * @brief Flushes the block cache. Called whenever the predecoded ROM image
+ *        changes.
+ */
+void proc_block_invalidate()
+{
+    if(machine->block_lengths == NULL)
+        return;
+
+    memset(machine->block_lengths, 0, PROC_PREDECODE_ENTRIES);
+
+    if(machine->block_fusions != NULL)
+        memset(machine->block_fusions, 0, PROC_PREDECODE_ENTRIES);
+
+    machine->block_flushed = true;
+}
+
+/**
+ * @brief Frees the block cache.
+ */
+void proc_block_destroy()
+{
+    free(machine->block_lengths);
+
+    machine->block_lengths = NULL;
+
+    proc_fusion_destroy();
+}
+
+/**
+ * @brief Runs the processor until it halts or reaches its instruction limit,
+ *        one basic block at a time. Returns true if it halted.
+ */
+bool proc_run_block()
+{
+    const proc_decoded_instr_t* block;
+    const uint8_t* fusions;
+    word_t pc, index, length, i, fused;
+
+    /*
+     * Fused idioms retire several instructions at once, so they are only used
+     * while nothing watches single instructions.
+     */
+    bool fuse = !stats_enabled() && !machine->verbosity &&
+                (machine->trace == NULL);
+
+    if(machine->block_lengths == NULL)
+        machine->block_lengths = (uint8_t*)calloc(PROC_PREDECODE_ENTRIES,
+                                                  sizeof(uint8_t));
+
+    /*
+     * Without a block cache, carry on in the threaded engine.
+     */
+    if(machine->block_lengths == NULL)
+        return proc_run_threaded();
+
+    if(!proc_fusion_init())
+        fuse = false;
+
+    for(;;)
+    {
+        pc = machine->regs.PC;
+
+        /*
+         * Code outside of ROM is not cached; step it one instruction at a
+         * time.
+         */
+        if(!get_addr_in_rom(pc) || (pc & (sizeof(word_t) - 1)))
+        {
+            if(!proc_step())
+                return true;
+
+            if(!device_poll(machine->instret))
+                return false;
+
+            continue;
+        }
+
+        index = proc_predecode_index(pc);
+        length = machine->block_lengths[index];
+
+        if(length == 0)
+            length = proc_block_build(index);
+
+        block = &machine->predecoded[index];
+        fusions = fuse ? &machine->block_fusions[index] : NULL;
+
+        machine->block_flushed = false;
+
+        for(i = 0; i < length; i += fused ? fused : 1)
+        {
+            fused = (fuse && (fusions[i] != 0)) ?
+                    proc_fusion_execute(fusions[i], &block[i], length - i) : 0;
+
+            if(!fused && !proc_instr_execute_decoded(&block[i]))
+                return true;
+
+            /*
+             * Leave the block early if a device needs to see an access or has
+             * an event due, or if the block rewrote its own code.
+             */
+            if(machine->device_mmio_touched || machine->block_flushed ||
+               (machine->instret >= machine->device_next_event))
+                break;
+        }
+
+        if(!device_poll(machine->instret))
+            return false;
+    }
+}
@@ -0,0 +1,386 @@
+/**
+ * @brief Macro-op fusion for the basic-block engine.
+ *
+ * Some short instruction sequences recur throughout DankCore code: the LUH and
+ * ADDUI pair that MOVW assembles to, runs of PUSH and POP that save and
+ * restore registers, and a LOADB tested by a BZI. When the block engine builds
+ * a block, it looks these idioms up in the table below and marks the first
+ * word of each. It then executes a marked idiom as one fused operation
+ * instead of dispatching each of its instructions.
+ *
+ * A fused operation leaves exactly the state that its instructions would have
+ * left one at a time, including the SR flags, the flight recorder, the
+ * instruction count and the cycles. It must not span a device event, and it
+ * only accesses host memory; when either would not hold, it declines and the
+ * instructions run one at a time. Fusion is off while anything observes
+ * single instructions (tracing, -v or the performance counters).
+ *
+ * To add an idiom, write a match function (for the constraints that the
+ * opcodes alone do not express) and an execute function, and add an entry to
+ * proc_fusions. Entries are tried in order, so put longer and more specific
+ * idioms first.
+ */
+
+#include "processor.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The longest idiom, in instructions.
+ */
+#define PROC_FUSION_MAX_LENGTH (4)
+
+#define PROC_REG_PC (12)
+#define PROC_REG_SP (14)
+
+typedef struct
+{
+    const char* name;
+    word_t length;
+    opcode_t opcodes[PROC_FUSION_MAX_LENGTH];
+
+    /*
+     * Checks the idiom's operands, once its opcodes have matched.
+     */
+    bool (*match)(const proc_decoded_instr_t* instrs, word_t length);
+
+    /*
+     * Executes the idiom, or returns false (having changed nothing) if it
+     * cannot be executed fused this time.
+     */
+    bool (*execute)(const proc_decoded_instr_t* instrs, word_t length);
+} proc_fusion_t;
+
+/**
+ * @brief Records the next instructions of a fused idiom in the flight
+ *        recorder and retires them, advancing the PC past them and charging
+ *        their cycles.
+ */
+static inline void proc_fusion_retire(const proc_decoded_instr_t* instrs,
+                                      word_t length)
+{
+    word_t i;
+
+    for(i = 0; i < length; i++, machine->regs.PC += 4, machine->instret++)
+    {
+        trace_flight_record(machine->regs.PC);
+        machine->cycles += instrs[i].cycles;
+    }
+}
+
+/*
+ * LUH RX HI; ADDUI RX RY LO
+ *
+ * The expansion of MOVW (with RY = RX), and constant loads in general. Both
+ * registers, and the flags set by the ADDUI, only depend on the immediates.
+ */
+static bool proc_fusion_match_luh_addui(const proc_decoded_instr_t* instrs,
+                                        word_t length)
+{
+    (void)length;
+
+    return (instrs[1].ra == instrs[0].ra) &&
+           (instrs[0].ra != PROC_REG_PC) && (instrs[1].rb != PROC_REG_PC);
+}
+
+static bool proc_fusion_match_const(const proc_decoded_instr_t* instrs,
+                                    word_t length)
+{
+    return proc_fusion_match_luh_addui(instrs, length) &&
+           (instrs[0].imm == 0) && (instrs[1].rb == instrs[0].ra);
+}
+
+static bool proc_fusion_luh_addui(const proc_decoded_instr_t* instrs,
+                                  word_t length)
+{
+    word_t upper = instrs[0].imm << 16;
+    word_t value = upper + instrs[1].imm;
+
+    proc_reg(instrs[0].ra) = upper;
+    proc_reg(instrs[1].rb) = value;
+
+    /*
+     * The flags are those of the ADDUI, the second instruction, which (as in
+     * processor_ops.h) reads its source register after writing its result.
+     */
+    proc_fusion_retire(instrs, length - 1);
+    proc_set_alu_flags(proc_reg(instrs[1].ra) & ~value, value);
+    proc_fusion_retire(&instrs[length - 1], 1);
+
+    return true;
+}
+
+/*
+ * PUSH RA; PUSH RB; ...
+ *
+ * The stack words are stored directly, which needs all of them in RAM, and
+ * aligned (so that no access would be charged the unaligned penalty).
+ */
+static bool proc_fusion_match_stack(const proc_decoded_instr_t* instrs,
+                                    word_t length)
+{
+    word_t i;
+
+    for(i = 0; i < length; i++)
+        if((instrs[i].ra == PROC_REG_PC) || (instrs[i].ra == PROC_REG_SP))
+            return false;
+
+    return true;
+}
+
+static bool proc_fusion_push(const proc_decoded_instr_t* instrs, word_t length)
+{
+    word_t sp = machine->regs.SP;
+    word_t i;
+
+    if((sp & (sizeof(word_t) - 1)) ||
+       !get_addr_in_ram(sp - 4 * (length - 1)) ||
+       !get_addr_in_ram(sp + sizeof(word_t) - 1))
+        return false;
+
+    for(i = 0; i < length; i++, sp -= 4)
+        *(word_t*)mem_host_addr(sp) = proc_reg(instrs[i].ra);
+
+    machine->regs.SP = sp;
+
+    proc_fusion_retire(instrs, length);
+
+    return true;
+}
+
+/*
+ * POP RA; POP RB; ...
+ *
+ * As for PUSH, the stack words must be in RAM and aligned.
+ */
+static bool proc_fusion_pop(const proc_decoded_instr_t* instrs, word_t length)
+{
+    word_t sp = machine->regs.SP;
+    word_t i;
+
+    if((sp & (sizeof(word_t) - 1)) || !get_addr_in_ram(sp + 4) ||
+       !get_addr_in_ram(sp + 4 * length + sizeof(word_t) - 1))
+        return false;
+
+    for(i = 0; i < length; i++)
+    {
+        sp += 4;
+        proc_reg(instrs[i].ra) = *(word_t*)mem_host_addr(sp);
+    }
+
+    machine->regs.SP = sp;
+
+    proc_fusion_retire(instrs, length);
+
+    return true;
+}
+
+/*
+ * LOADB RX RY; BZI RX OFFSET
+ *
+ * The test of a string's terminator. The byte must come from host memory.
+ * Branches back to the pair, or to the BZI itself, are left unfused for the
+ * idle loop detector (see processor_idle.c).
+ */
+static bool proc_fusion_match_loadb_bzi(const proc_decoded_instr_t* instrs,
+                                        word_t length)
+{
+    (void)length;
+
+    return (instrs[1].ra == instrs[0].ra) && (instrs[0].ra != PROC_REG_PC) &&
+           (instrs[1].simm != 0) && (instrs[1].simm != (word_t)-4);
+}
+
+static bool proc_fusion_loadb_bzi(const proc_decoded_instr_t* instrs,
+                                  word_t length)
+{
+    word_t addr = proc_reg(instrs[0].rb);
+    word_t value;
+
+    if(!mem_page_bias(addr))
+        return false;
+
+    value = *(byte_t*)mem_host_addr(addr);
+    proc_reg(instrs[0].ra) = value;
+
+    proc_fusion_retire(instrs, length);
+
+    if(value == 0)
+    {
+        machine->regs.PC += instrs[1].simm - 4;
+        machine->cycles += machine->cycle_model.branch;
+    }
+
+    return true;
+}
+
+#define PROC_FUSION_PUSH(__n__, ...) \
+        {"PUSH*" #__n__, __n__, {__VA_ARGS__}, proc_fusion_match_stack, \
+         proc_fusion_push}
+
+#define PROC_FUSION_POP(__n__, ...) \
+        {"POP*" #__n__, __n__, {__VA_ARGS__}, proc_fusion_match_stack, \
+         proc_fusion_pop}
+
+/*
+ * The idioms. Entry i is marked in the block cache as i + 1.
+ */
+static const proc_fusion_t proc_fusions[] =
+{
+    {"const", 2, {PROC_OPCODE_LUH, PROC_OPCODE_ADDUI},
+     proc_fusion_match_const, proc_fusion_luh_addui},
+    {"LUH+ADDUI", 2, {PROC_OPCODE_LUH, PROC_OPCODE_ADDUI},
+     proc_fusion_match_luh_addui, proc_fusion_luh_addui},
+    PROC_FUSION_PUSH(4, PROC_OPCODE_PUSH, PROC_OPCODE_PUSH, PROC_OPCODE_PUSH,
+                     PROC_OPCODE_PUSH),
+    PROC_FUSION_PUSH(3, PROC_OPCODE_PUSH, PROC_OPCODE_PUSH, PROC_OPCODE_PUSH),
+    PROC_FUSION_PUSH(2, PROC_OPCODE_PUSH, PROC_OPCODE_PUSH),
+    PROC_FUSION_POP(4, PROC_OPCODE_POP, PROC_OPCODE_POP, PROC_OPCODE_POP,
+                    PROC_OPCODE_POP),
+    PROC_FUSION_POP(3, PROC_OPCODE_POP, PROC_OPCODE_POP, PROC_OPCODE_POP),
+    PROC_FUSION_POP(2, PROC_OPCODE_POP, PROC_OPCODE_POP),
+    {"LOADB+BZI", 2, {PROC_OPCODE_LOADB, PROC_OPCODE_BZI},
+     proc_fusion_match_loadb_bzi, proc_fusion_loadb_bzi}
+};
+
+#undef PROC_FUSION_PUSH
+#undef PROC_FUSION_POP
+
+#define PROC_FUSION_COUNT (sizeof(proc_fusions) / sizeof(proc_fusions[0]))
+
+/**
+ * @brief Allocates the current machine's fusion marks and counters, if it
+ *        does not have them yet. Returns false, leaving neither, if memory
+ *        runs out; the block engine then runs without fusion.
+ */
+bool proc_fusion_init()
+{
+    if(machine->block_fusions != NULL)
+        return true;
+
+    machine->block_fusions = (uint8_t*)calloc(PROC_PREDECODE_ENTRIES,
+                                              sizeof(uint8_t));
+    machine->fusion_hits = (uint64_t*)calloc(PROC_FUSION_COUNT,
+                                             sizeof(uint64_t));
+    machine->fusion_misses = (uint64_t*)calloc(PROC_FUSION_COUNT,
+                                               sizeof(uint64_t));
+
+    if((machine->block_fusions == NULL) || (machine->fusion_hits == NULL) ||
+       (machine->fusion_misses == NULL))
+    {
+        proc_fusion_destroy();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Frees the current machine's fusion marks and counters.
+ */
+void proc_fusion_destroy()
+{
+    free(machine->block_fusions);
+    free(machine->fusion_hits);
+    free(machine->fusion_misses);
+
+    machine->block_fusions = NULL;
+    machine->fusion_hits = NULL;
+    machine->fusion_misses = NULL;
+}
+
+/**
+ * @brief Finds the idiom that starts at the given instruction and fits in the
+ *        given number of instructions. Returns its mark (0 if there is none).
+ */
+uint8_t proc_fusion_match(const proc_decoded_instr_t* instrs, word_t count)
+{
+    const proc_fusion_t* fusion;
+    word_t i, j;
+
+    for(i = 0; i < PROC_FUSION_COUNT; i++)
+    {
+        fusion = &proc_fusions[i];
+
+        if(fusion->length > count)
+            continue;
+
+        for(j = 0; j < fusion->length; j++)
+            if(instrs[j].opcode != fusion->opcodes[j])
+                break;
+
+        if((j == fusion->length) && fusion->match(instrs, fusion->length))
+            break;
+    }
+
+    if(i == PROC_FUSION_COUNT)
+        return 0;
+
+    /*
+     * Instructions naming SR need the flags built first.
+     */
+    for(j = 0; j < proc_fusions[i].length; j++)
+        if(instrs[j].reg_mask & PROC_REG_MASK_SR)
+            return 0;
+
+    return i + 1;
+}
+
+/**
+ * @brief Executes the marked idiom starting at the given instruction, if it
+ *        fits in the given number of instructions and ends before the next
+ *        device event. Returns the number of instructions it retired, or 0
+ *        if they must be executed one at a time.
+ */
+word_t proc_fusion_execute(uint8_t mark, const proc_decoded_instr_t* instrs,
+                           word_t count)
+{
+    const proc_fusion_t* fusion = &proc_fusions[mark - 1];
+
+    if((fusion->length > count) ||
+       (machine->instret + fusion->length > machine->device_next_event) ||
+       !fusion->execute(instrs, fusion->length))
+    {
+        machine->fusion_misses[mark - 1]++;
+        return 0;
+    }
+
+    machine->fusion_hits[mark - 1]++;
+
+    return fusion->length;
+}
+
+/**
+ * @brief Prints how often each idiom was executed fused, how many
+ *        instructions that covered, and how often it had to be executed
+ *        unfused. Prints nothing if the machine never fused anything.
+ */
+void proc_fusion_report(FILE* file)
+{
+    uint64_t instrs;
+    word_t i;
+
+    if(machine->fusion_hits == NULL)
+        return;
+
+    fprintf(file, "%-10s %12s %14s %10s %10s\n", "idiom", "fused",
+            "instructions", "retired", "unfused");
+
+    for(i = 0; i < PROC_FUSION_COUNT; i++)
+    {
+        if((machine->fusion_hits[i] == 0) && (machine->fusion_misses[i] == 0))
+            continue;
+
+        instrs = machine->fusion_hits[i] * proc_fusions[i].length;
+
+        fprintf(file, "%-10s %12llu %14llu %9.2f%% %10llu\n",
+                proc_fusions[i].name,
+                (unsigned long long)machine->fusion_hits[i],
+                (unsigned long long)instrs,
+                machine->instret ? instrs * 100.0 / machine->instret : 0.0,
+                (unsigned long long)machine->fusion_misses[i]);
+    }
+}
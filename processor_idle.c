@@ -0,0 +1,238 @@
+/**
+ * @brief Idle loop detection.
+ *
+ * DankOS waits for devices by polling: it loads a status word and branches
+ * back to the load while the word is zero. Nothing changes from one pass of
+ * such a loop to the next until a device is updated, and devices are only
+ * updated by their scheduled events (or by accesses, which the loop makes
+ * but which do not change a stable register; see devices.h). So once the
+ * loop has been entered, every pass up to the next device event is known in
+ * advance, and the passes are skipped: the guest time and the cycles are
+ * advanced by whole passes, as if they had been executed, and the engine
+ * carries on one pass before the event.
+ *
+ * The loops recognized are a branch to itself (BI or a taken BZI), and an
+ * aligned LOAD, LOADH or LOADB of RX followed by a BZI RX back to it, where
+ * the load does not also overwrite its own address and reads zero. The load
+ * must read ROM or RAM, or a word-wide device register whose reads are
+ * stable. Skipping is off while anything observes single instructions,
+ * while instructions are being re-executed from a snapshot, and with -W.
+ * With no device event scheduled, only host input can end the loop, so the
+ * emulator blocks until a device has some, as WFI does, and has the devices
+ * serviced before the loop goes on. Guest time does not move while it waits.
+ * If no device can ever have input, the passes are skipped up to the
+ * instruction limit, and without one, the loop runs as usual.
+ *
+ * Every engine executes the branch that closes a loop in the interpreter, so
+ * they all skip the same passes.
+ *
+ * Guests that use interrupts wait with WFI instead, which sleeps the same way
+ * whatever the options: up to the next device event, or, with none
+ * scheduled, until a device has input on the host.
+ */
+
+#include "processor.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/**
+ * @brief Reads what a load of __width__ bytes from __addr__ would return,
+ *        without making the access. Returns false if that cannot be known in
+ *        advance.
+ */
+static bool proc_idle_peek(word_t addr, word_t width, word_t* value)
+{
+    if(!mem_page_bias(addr))
+        return (width == sizeof(word_t)) && device_poll_stable(addr, value);
+
+    switch(width)
+    {
+        case sizeof(word_t):
+            *value = *(word_t*)mem_host_addr(addr);
+            break;
+
+        case sizeof(hword_t):
+            *value = *(hword_t*)mem_host_addr(addr);
+            break;
+
+        default:
+            *value = *(byte_t*)mem_host_addr(addr);
+            break;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Called when the BI or BZI at pc branches to itself (simm 0) or to
+ *        the instruction before it (simm -4), with the PC already set to the
+ *        target but before the branch retires. Skips the passes of the loop
+ *        that the branch closes up to the next device event, if it is an idle
+ *        loop.
+ */
+void proc_idle_skip(word_t pc, word_t simm)
+{
+    const proc_decoded_instr_t* branch;
+    const proc_decoded_instr_t* load;
+    word_t start = pc + simm;
+    word_t addr = 0, width, value, pass_cycles;
+    word_t length = (simm == 0) ? 1 : 2;
+    uint64_t base, passes;
+    bool mmio = false;
+
+    if(!machine->idle_skip || stats_enabled() || machine->verbosity ||
+       (machine->trace != NULL) || device_replaying() ||
+       machine->device_mmio_touched)
+        return;
+
+    if(!get_addr_in_rom(start) || !get_addr_in_rom(pc) ||
+       (start & (sizeof(word_t) - 1)))
+        return;
+
+    /*
+     * BR falls through into BI, so check what is really branching.
+     */
+    branch = &machine->predecoded[proc_predecode_index(pc)];
+
+    if(((branch->opcode != PROC_OPCODE_BI) &&
+        (branch->opcode != PROC_OPCODE_BZI)) || (branch->simm != simm))
+        return;
+
+    pass_cycles = branch->cycles + machine->cycle_model.branch;
+
+    if(length == 2)
+    {
+        load = &machine->predecoded[proc_predecode_index(start)];
+
+        switch(load->opcode)
+        {
+            case PROC_OPCODE_LOAD:
+                width = sizeof(word_t);
+                break;
+
+            case PROC_OPCODE_LOADH:
+                width = sizeof(hword_t);
+                break;
+
+            case PROC_OPCODE_LOADB:
+                width = sizeof(byte_t);
+                break;
+
+            default:
+                return;
+        }
+
+        if((branch->opcode != PROC_OPCODE_BZI) || (load->ra != branch->ra) ||
+           (load->ra == load->rb) ||
+           (load->reg_mask & (PROC_REG_MASK_PC | PROC_REG_MASK_SR)))
+            return;
+
+        /*
+         * The branch may have been reached without the load, so it is the
+         * value the load will read that decides whether the loop goes on.
+         */
+        addr = proc_reg(load->rb);
+        mmio = !mem_page_bias(addr);
+
+        if((addr & (width - 1)) || !proc_idle_peek(addr, width, &value) ||
+           (value != 0))
+            return;
+
+        pass_cycles += load->cycles;
+
+        if(mmio)
+            pass_cycles += machine->cycle_model.mmio;
+    }
+
+    /*
+     * With no event to skip to, wait for input instead. Servicing the devices
+     * afterwards lets an interrupt it raises be taken.
+     */
+    if((device_next_deadline() == DEVICE_NO_EVENT) && device_wait())
+    {
+        machine->device_mmio_touched = true;
+        return;
+    }
+
+    /*
+     * Stop on the last pass that starts no later than the next event, so that
+     * the event comes due exactly where it would have. The branch has not
+     * retired yet.
+     */
+    base = machine->instret + 1;
+
+    if((machine->device_next_event == DEVICE_NO_EVENT) ||
+       (machine->device_next_event <= base))
+        return;
+
+    passes = (machine->device_next_event - base) / length;
+
+    if(passes == 0)
+        return;
+
+    machine->instret += passes * length;
+    machine->cycles += passes * pass_cycles;
+    machine->idle_skipped += passes * length;
+
+    /*
+     * Each skipped pass read the device, and got the same value.
+     */
+    if(mmio)
+        device_log_record_repeat(0, passes);
+}
+
+/**
+ * @brief Called by WFI. Unless an enabled interrupt is already pending,
+ *        sleeps until the next device event, advancing the guest time and
+ *        the cycles as if the WFI had been executed again until then. With no
+ *        event scheduled, blocks until a device has input instead. Returns
+ *        false if nothing can ever wake the processor.
+ */
+bool proc_idle_wait()
+{
+    uint64_t deadline, sleep = 0;
+
+    /*
+     * Have the devices serviced after the WFI, so that an interrupt that
+     * comes due is taken before the next instruction.
+     */
+    machine->device_mmio_touched = true;
+
+    if(!device_replaying() && !machine->irq_pending)
+    {
+        deadline = device_next_deadline();
+
+        if(deadline == DEVICE_NO_EVENT)
+        {
+            if(!device_wait())
+            {
+                fprintf(stderr, "WFI @PC=0x%08x with nothing to wake the "
+                        "processor\n", machine->regs.PC);
+                return false;
+            }
+        }
+        else if(deadline > machine->instret + 1)
+        {
+            sleep = deadline - (machine->instret + 1);
+
+            /*
+             * Longer sleeps wake early, which WFI allows.
+             */
+            if(sleep > (word_t)-1)
+                sleep = (word_t)-1;
+        }
+    }
+
+    /*
+     * How long the WFI slept depends on the devices, so it is logged like a
+     * device read.
+     */
+    sleep = device_log_input((word_t)sleep);
+
+    machine->instret += sleep;
+    machine->cycles += sleep * machine->cycle_model.opcodes[PROC_OPCODE_WFI];
+    machine->idle_skipped += sleep;
+
+    return true;
+}
@@ -0,0 +1,1186 @@
+/**
+ * @brief x86-64 dynamic binary translator for the DankCore processor.
+ *
+ * Basic blocks of predecoded ROM instructions (delimited exactly as in the
+ * block engine) are translated into host machine code in an executable code
+ * cache. The guest registers stay in the machine context, addressed through
+ * RBX. Each machine has its own code cache.
+ *
+ * Simple ALU, move and branch instructions are emitted inline. So are loads
+ * and stores, which look their page up in the page table (see memmap.h) and
+ * access host memory directly when the access is aligned, the page is backed
+ * by host memory and, for a store, the address is not in ROM. Any other
+ * access (notably to a device register) and every other instruction
+ * (anything naming the PC or SR, for instance) is executed by calling back
+ * into the interpreter, so device semantics, access penalties and the
+ * coherence of the predecoded ROM are those of proc_instr_execute_decoded().
+ * Blocks with statically known
+ * successors are chained together by patching their exit jumps. Devices are
+ * serviced after an instruction touches a device register, and when a device
+ * event comes due: every block starts by checking whether it would run past
+ * the next event, and if so returns to the dispatcher, which steps the
+ * instructions up to the event one at a time. Events are therefore serviced
+ * at exactly the same guest time as in the interpreter.
+ *
+ * The code cache is never writable and executable at once: it is made
+ * writable to emit or patch code, and executable again before it is entered.
+ * Code is emitted in bursts (mostly as the guest warms up), so the cache only
+ * changes protection a few times per new block.
+ *
+ * Every translated block is listed in /tmp/perf-<pid>.map so that Linux
+ * `perf` can attribute host time to guest code.
+ */
+
+#include "processor.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define PROC_JIT_CACHE_SIZE (16 * 1024 * 1024ul)
+#define PROC_JIT_MAX_EXITS (64 * 1024)
+
+/*
+ * The worst-case size of a translated block. Used to flush the cache before
+ * it overflows.
+ */
+#define PROC_JIT_MAX_BLOCK_SIZE (PROC_BLOCK_MAX_INSTRS * 192 + 256)
+
+/*
+ * Return codes of translated code. PROC_JIT_RET_STEP means that the block
+ * would have run past the next device event. Codes of PROC_JIT_RET_EXIT and
+ * above identify a chainable block exit.
+ */
+#define PROC_JIT_RET_HALT (0)
+#define PROC_JIT_RET_CONTINUE (1)
+#define PROC_JIT_RET_STEP (3)
+#define PROC_JIT_RET_EXIT (4)
+
+/*
+ * Host registers (as encoded in ModRM).
+ */
+#define X86_EAX (0)
+#define X86_ECX (1)
+#define X86_EDX (2)
+#define X86_EBX (3)
+
+/*
+ * Offsets of guest registers from RBX.
+ */
+#define X86_REG_DISP(__regidx__) ((__regidx__) * sizeof(word_t))
+#define PROC_REG_SP (14)
+
+#define X86_PC_DISP X86_REG_DISP(12)
+#define X86_LR_DISP X86_REG_DISP(13)
+#define X86_SP_DISP X86_REG_DISP(PROC_REG_SP)
+
+/*
+ * Offsets of the instruction count, the lazy ALU flag state and the cycle
+ * count (see machine.h) from RBX, which points at the registers at the start
+ * of the machine context.
+ */
+#define X86_MACHINE_DISP(__field__) \
+        (offsetof(machine_t, __field__) - offsetof(machine_t, regs))
+#define X86_INSTRET_DISP X86_MACHINE_DISP(instret)
+#define X86_FLAGS_AT_DISP X86_MACHINE_DISP(flags_at)
+#define X86_FLAGS_O_DISP X86_MACHINE_DISP(flags_o)
+#define X86_FLAGS_RESULT_DISP X86_MACHINE_DISP(flags_result)
+#define X86_CYCLES_DISP X86_MACHINE_DISP(cycles)
+
+/*
+ * The emitters address these with an 8-bit displacement from RBX, so they
+ * must stay within its reach as machine_t grows.
+ */
+_Static_assert(X86_INSTRET_DISP < 128, "instret is beyond disp8 of RBX");
+_Static_assert(X86_FLAGS_AT_DISP < 128, "flags_at is beyond disp8 of RBX");
+_Static_assert(X86_FLAGS_O_DISP < 128, "flags_o is beyond disp8 of RBX");
+_Static_assert(X86_FLAGS_RESULT_DISP < 128,
+               "flags_result is beyond disp8 of RBX");
+_Static_assert(X86_CYCLES_DISP < 128, "cycles is beyond disp8 of RBX");
+
+typedef int (*proc_jit_enter_t)(const byte_t* code, register_map_t* regs);
+
+/*
+ * A chainable block exit: the location of the rel32 of its exit jump and the
+ * guest address it leads to.
+ */
+typedef struct
+{
+    byte_t* patch;
+    word_t target;
+} proc_jit_exit_t;
+
+/*
+ * A machine's translator state (machine->jit).
+ */
+typedef struct proc_jit
+{
+    byte_t* cache;
+    byte_t* ptr;
+    byte_t* blocks_start;
+
+    proc_jit_enter_t enter;
+    byte_t* exit_ret;
+    byte_t* exit_continue;
+    byte_t* exit_step;
+
+    /*
+     * Translated code entry points, one per ROM word.
+     */
+    byte_t** blocks;
+
+    proc_jit_exit_t exits[PROC_JIT_MAX_EXITS];
+    word_t num_exits;
+
+    /*
+     * Incremented on every flush, so that the dispatcher can tell whether an
+     * exit it is about to chain still exists.
+     */
+    word_t generation;
+
+    bool flushed;
+
+    /*
+     * Whether the code cache is currently writable rather than executable.
+     */
+    bool writable;
+
+    FILE* perf_map;
+} proc_jit_t;
+
+/*
+ * Emitters.
+ */
+static void x86_emit_byte(byte_t b)
+{
+    *machine->jit->ptr++ = b;
+}
+
+static void x86_emit_word(word_t w)
+{
+    memcpy(machine->jit->ptr, &w, sizeof(w));
+    machine->jit->ptr += sizeof(w);
+}
+
+static void x86_emit_ptr(const void* p)
+{
+    uint64_t v = (uint64_t)(uintptr_t)p;
+
+    memcpy(machine->jit->ptr, &v, sizeof(v));
+    machine->jit->ptr += sizeof(v);
+}
+
+/**
+ * @brief Emits <op> reg, [rbx + disp8] (or the reverse, depending on op).
+ */
+static void x86_emit_rm_rbx(byte_t op, byte_t reg, byte_t disp)
+{
+    x86_emit_byte(op);
+    x86_emit_byte(0x40 | (reg << 3) | X86_EBX);
+    x86_emit_byte(disp);
+}
+
+/**
+ * @brief Emits mov reg, guest register.
+ */
+static void x86_emit_load_reg(byte_t reg, regidx_t regidx)
+{
+    x86_emit_rm_rbx(0x8B, reg, X86_REG_DISP(regidx));
+}
+
+/**
+ * @brief Emits mov guest register, reg.
+ */
+static void x86_emit_store_reg(regidx_t regidx, byte_t reg)
+{
+    x86_emit_rm_rbx(0x89, reg, X86_REG_DISP(regidx));
+}
+
+/**
+ * @brief Emits mov dword [rbx + disp8], imm32.
+ */
+static void x86_emit_store_imm(byte_t disp, word_t imm)
+{
+    x86_emit_rm_rbx(0xC7, 0, disp);
+    x86_emit_word(imm);
+}
+
+/**
+ * @brief Emits add qword [rbx + disp8], imm32 (sign-extended, so a negative
+ *        imm subtracts).
+ */
+static void x86_emit_add_qword(byte_t disp, word_t imm)
+{
+    x86_emit_byte(0x48);
+    x86_emit_rm_rbx(0x81, 0, disp);
+    x86_emit_word(imm);
+}
+
+/**
+ * @brief Emits <group 1 op> reg, imm32 (/0 add, /1 or, /4 and, /6 xor).
+ */
+static void x86_emit_alu_imm(byte_t ext, byte_t reg, word_t imm)
+{
+    x86_emit_byte(0x81);
+    x86_emit_byte(0xC0 | (ext << 3) | reg);
+    x86_emit_word(imm);
+}
+
+/**
+ * @brief Emits mov <reg64>, imm64.
+ */
+static void x86_emit_mov_imm64(byte_t reg, const void* p)
+{
+    x86_emit_byte(0x48);
+    x86_emit_byte(0xB8 | reg);
+    x86_emit_ptr(p);
+}
+
+/**
+ * @brief Emits a rel32 jump (jmp, or jcc when cc is nonzero) to target.
+ *        Returns the location of the rel32.
+ */
+static byte_t* x86_emit_jump(byte_t cc, const byte_t* target)
+{
+    byte_t* patch;
+
+    if(cc)
+    {
+        x86_emit_byte(0x0F);
+        x86_emit_byte(cc);
+    }
+    else
+        x86_emit_byte(0xE9);
+
+    patch = machine->jit->ptr;
+    x86_emit_word((word_t)(target - (patch + sizeof(word_t))));
+
+    return patch;
+}
+
+static void x86_patch_jump(byte_t* patch, const byte_t* target)
+{
+    word_t rel = (word_t)(target - (patch + sizeof(word_t)));
+
+    memcpy(patch, &rel, sizeof(rel));
+}
+
+#define X86_JMP (0)
+#define X86_JNE (0x85)
+#define X86_JE (0x84)
+#define X86_JB (0x82)
+#define X86_JAE (0x83)
+#define X86_JA (0x87)
+
+/**
+ * @brief Flushes the entire code cache.
+ */
+static void proc_jit_flush()
+{
+    machine->jit->ptr = machine->jit->blocks_start;
+    machine->jit->num_exits = 0;
+    machine->jit->generation++;
+
+    memset(machine->jit->blocks, 0, sizeof(byte_t*) * PROC_PREDECODE_ENTRIES);
+}
+
+/**
+ * @brief Invalidates all translated code. Called whenever the predecoded ROM
+ *        image changes.
+ */
+void proc_jit_invalidate()
+{
+    if(machine->jit == NULL)
+        return;
+
+    proc_jit_flush();
+
+    machine->jit->flushed = true;
+}
+
+/**
+ * @brief Makes the code cache writable, to emit or patch code, or executable.
+ *        Returns false if its protection cannot be changed.
+ */
+static bool proc_jit_protect(bool writable)
+{
+    proc_jit_t* jit = machine->jit;
+
+    if(jit->writable == writable)
+        return true;
+
+    if(mprotect(jit->cache, PROC_JIT_CACHE_SIZE, writable ?
+                (PROT_READ | PROT_WRITE) : (PROT_READ | PROT_EXEC)) < 0)
+        return false;
+
+    jit->writable = writable;
+
+    return true;
+}
+
+/**
+ * @brief Executes an instruction on behalf of translated code. Returns
+ *        PROC_JIT_RET_CONTINUE if the block may carry on, PROC_JIT_RET_HALT if
+ *        the processor halted, and any other value if control must return to
+ *        the dispatcher.
+ */
+static int proc_jit_call(const proc_decoded_instr_t* decoded)
+{
+    if(!proc_instr_execute_decoded(decoded))
+        return PROC_JIT_RET_HALT;
+
+    if(machine->device_mmio_touched || machine->jit->flushed)
+        return PROC_JIT_RET_CONTINUE + 1;
+
+    return PROC_JIT_RET_CONTINUE;
+}
+
+/**
+ * @brief Allocates the code cache and emits the entry and exit trampolines.
+ */
+static bool proc_jit_init()
+{
+    proc_jit_t* jit = (proc_jit_t*)calloc(1, sizeof(proc_jit_t));
+
+    if(jit == NULL)
+        return false;
+
+    jit->cache = (byte_t*)mmap(NULL, PROC_JIT_CACHE_SIZE,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(jit->cache == MAP_FAILED)
+    {
+        free(jit);
+        return false;
+    }
+
+    jit->blocks = (byte_t**)calloc(PROC_PREDECODE_ENTRIES, sizeof(byte_t*));
+
+    if(jit->blocks == NULL)
+    {
+        munmap(jit->cache, PROC_JIT_CACHE_SIZE);
+        free(jit);
+        return false;
+    }
+
+    jit->writable = true;
+
+    machine->jit = jit;
+
+    jit->ptr = jit->cache;
+
+    /*
+     * int enter(code, regs): push rbx; mov rbx, rsi; jmp rdi
+     */
+    jit->enter = (proc_jit_enter_t)jit->ptr;
+    x86_emit_byte(0x53);
+    x86_emit_byte(0x48);
+    x86_emit_byte(0x89);
+    x86_emit_byte(0xF3);
+    x86_emit_byte(0xFF);
+    x86_emit_byte(0xE7);
+
+    /*
+     * exit: pop rbx; ret (the return code is already in eax)
+     */
+    jit->exit_ret = jit->ptr;
+    x86_emit_byte(0x5B);
+    x86_emit_byte(0xC3);
+
+    /*
+     * exit_continue: mov eax, PROC_JIT_RET_CONTINUE; pop rbx; ret
+     */
+    jit->exit_continue = jit->ptr;
+    x86_emit_byte(0xB8);
+    x86_emit_word(PROC_JIT_RET_CONTINUE);
+    x86_emit_byte(0x5B);
+    x86_emit_byte(0xC3);
+
+    /*
+     * exit_step: mov eax, PROC_JIT_RET_STEP; pop rbx; ret
+     */
+    jit->exit_step = jit->ptr;
+    x86_emit_byte(0xB8);
+    x86_emit_word(PROC_JIT_RET_STEP);
+    x86_emit_byte(0x5B);
+    x86_emit_byte(0xC3);
+
+    jit->blocks_start = jit->ptr;
+
+    char perf_map_name[64];
+
+    snprintf(perf_map_name, sizeof(perf_map_name), "/tmp/perf-%d.map",
+             (int)getpid());
+
+    /*
+     * Every machine in the process appends to the same map.
+     */
+    jit->perf_map = fopen(perf_map_name, "a");
+
+    return true;
+}
+
+/**
+ * @brief Frees the code cache.
+ */
+void proc_jit_destroy()
+{
+    proc_jit_t* jit = machine->jit;
+
+    if(jit == NULL)
+        return;
+
+    if(jit->perf_map != NULL)
+        fclose(jit->perf_map);
+
+    munmap(jit->cache, PROC_JIT_CACHE_SIZE);
+    free(jit->blocks);
+    free(jit);
+
+    machine->jit = NULL;
+}
+
+/*
+ * Translation state for the block being translated.
+ */
+typedef struct
+{
+    /*
+     * Instructions translated inline whose retirement has not yet been added
+     * to machine->instret.
+     */
+    word_t pending_instret;
+
+    /*
+     * Their cycles, likewise not yet added to machine->cycles.
+     */
+    word_t pending_cycles;
+} proc_jit_state_t;
+
+static void proc_jit_emit_instret(proc_jit_state_t* state)
+{
+    if(state->pending_cycles != 0)
+    {
+        x86_emit_add_qword(X86_CYCLES_DISP, state->pending_cycles);
+        state->pending_cycles = 0;
+    }
+
+    if(state->pending_instret != 0)
+    {
+        x86_emit_add_qword(X86_INSTRET_DISP, state->pending_instret);
+        state->pending_instret = 0;
+    }
+}
+
+/**
+ * @brief Emits the retirement of an inline instruction that produces no ALU
+ *        flags. Retiring it is enough to clear them.
+ */
+static void proc_jit_emit_retire(proc_jit_state_t* state,
+                                 const proc_decoded_instr_t* decoded)
+{
+    state->pending_instret++;
+    state->pending_cycles += decoded->cycles;
+}
+
+/**
+ * @brief Emits the retirement of an ADD, ADDI or ADDUI. The overflow term has
+ *        been computed into bit 31 of ECX; it is recorded with the destination
+ *        register, which (as in the interpreter) is re-read after the write,
+ *        and the guest time at which the instruction retires.
+ */
+static void proc_jit_emit_retire_flags(proc_jit_state_t* state,
+                                       const proc_decoded_instr_t* decoded,
+                                       regidx_t dest)
+{
+    /* mov [rbx + flags_o], ecx */
+    x86_emit_rm_rbx(0x89, X86_ECX, X86_FLAGS_O_DISP);
+
+    /* mov edx, dest; mov [rbx + flags_result], edx */
+    x86_emit_load_reg(X86_EDX, dest);
+    x86_emit_rm_rbx(0x89, X86_EDX, X86_FLAGS_RESULT_DISP);
+
+    /*
+     * mov rax, [rbx + instret]; add rax, pending + 1;
+     * mov [rbx + flags_at], rax
+     */
+    x86_emit_byte(0x48);
+    x86_emit_rm_rbx(0x8B, X86_EAX, X86_INSTRET_DISP);
+    x86_emit_byte(0x48);
+    x86_emit_byte(0x05);
+    x86_emit_word(state->pending_instret + 1);
+    x86_emit_byte(0x48);
+    x86_emit_rm_rbx(0x89, X86_EAX, X86_FLAGS_AT_DISP);
+
+    state->pending_instret++;
+    state->pending_cycles += decoded->cycles;
+}
+
+/**
+ * @brief Emits the check at the start of every block: if running the whole
+ *        block would take the machine past the next device event, return to
+ *        the dispatcher instead. Returns the location of the block length,
+ *        which is only known once the block has been translated.
+ */
+static byte_t* proc_jit_emit_entry_check()
+{
+    byte_t* length;
+
+    /* mov rax, [rbx + instret]; add rax, length */
+    x86_emit_byte(0x48);
+    x86_emit_rm_rbx(0x8B, X86_EAX, X86_INSTRET_DISP);
+    x86_emit_byte(0x48);
+    x86_emit_byte(0x05);
+    length = machine->jit->ptr;
+    x86_emit_word(0);
+
+    /* mov rcx, &machine->device_next_event; cmp rax, [rcx]; ja exit_step */
+    x86_emit_mov_imm64(X86_ECX, &machine->device_next_event);
+    x86_emit_byte(0x48);
+    x86_emit_byte(0x3B);
+    x86_emit_byte(0x01);
+    x86_emit_jump(X86_JA, machine->jit->exit_step);
+
+    return length;
+}
+
+/**
+ * @brief Emits a block exit to a statically known guest address. The exit
+ *        initially returns to the dispatcher, which chains it to the target
+ *        block once that has been translated.
+ */
+static void proc_jit_emit_exit(proc_jit_state_t* state, word_t target)
+{
+    byte_t* patch;
+
+    proc_jit_emit_instret(state);
+
+    x86_emit_store_imm(X86_PC_DISP, target);
+
+    if(machine->jit->num_exits >= PROC_JIT_MAX_EXITS)
+    {
+        x86_emit_jump(X86_JMP, machine->jit->exit_continue);
+        return;
+    }
+
+    patch = x86_emit_jump(X86_JMP, machine->jit->ptr + 5);
+
+    /* mov eax, PROC_JIT_RET_EXIT + exit index */
+    x86_emit_byte(0xB8);
+    x86_emit_word(PROC_JIT_RET_EXIT + machine->jit->num_exits);
+    x86_emit_jump(X86_JMP, machine->jit->exit_ret);
+
+    machine->jit->exits[machine->jit->num_exits].patch = patch;
+    machine->jit->exits[machine->jit->num_exits].target = target;
+    machine->jit->num_exits++;
+}
+
+/**
+ * @brief Emits a call to the interpreter for a single instruction.
+ */
+static void proc_jit_emit_call(proc_jit_state_t* state,
+                               const proc_decoded_instr_t* decoded,
+                               word_t pc, bool terminator)
+{
+    proc_jit_emit_instret(state);
+
+    x86_emit_store_imm(X86_PC_DISP, pc);
+
+    /* mov rdi, decoded; mov rax, proc_jit_call; call rax */
+    x86_emit_mov_imm64(7, decoded);
+    x86_emit_mov_imm64(X86_EAX, (const void*)proc_jit_call);
+    x86_emit_byte(0xFF);
+    x86_emit_byte(0xD0);
+
+    if(terminator)
+    {
+        x86_emit_jump(X86_JMP, machine->jit->exit_ret);
+        return;
+    }
+
+    /* cmp eax, PROC_JIT_RET_CONTINUE; jne exit */
+    x86_emit_byte(0x83);
+    x86_emit_byte(0xF8);
+    x86_emit_byte(PROC_JIT_RET_CONTINUE);
+    x86_emit_jump(X86_JNE, machine->jit->exit_ret);
+}
+
+/**
+ * @brief Emits a load or store (including PUSH and POP). The access is made
+ *        inline if it is aligned, its page is backed by host memory and, for
+ *        a store, it is not to ROM; otherwise the instruction is executed by
+ *        the interpreter.
+ */
+static void proc_jit_emit_access(proc_jit_state_t* state,
+                                 const proc_decoded_instr_t* decoded,
+                                 word_t pc)
+{
+    regidx_t addr_reg = decoded->rb;
+    regidx_t data_reg = decoded->ra;
+    word_t width = sizeof(word_t);
+    bool store = false;
+    byte_t* slow[4];
+    byte_t* done;
+    word_t num_slow = 0, i;
+
+    switch(decoded->opcode)
+    {
+        case PROC_OPCODE_LOADH:
+            width = sizeof(hword_t);
+            break;
+
+        case PROC_OPCODE_LOADB:
+            width = sizeof(byte_t);
+            break;
+
+        case PROC_OPCODE_STOR:
+            store = true;
+            break;
+
+        case PROC_OPCODE_STORH:
+            width = sizeof(hword_t);
+            store = true;
+            break;
+
+        case PROC_OPCODE_STORB:
+            width = sizeof(byte_t);
+            store = true;
+            addr_reg = decoded->ra;
+            data_reg = decoded->rb;
+            break;
+
+        case PROC_OPCODE_PUSH:
+            addr_reg = PROC_REG_SP;
+            store = true;
+            break;
+
+        case PROC_OPCODE_POP:
+            addr_reg = PROC_REG_SP;
+            break;
+    }
+
+    /* mov eax, address (POP: add eax, 4) */
+    x86_emit_load_reg(X86_EAX, addr_reg);
+
+    if(decoded->opcode == PROC_OPCODE_POP)
+        x86_emit_alu_imm(0, X86_EAX, sizeof(word_t));
+
+    /* test al, width - 1; jne slow */
+    if(width > 1)
+    {
+        x86_emit_byte(0xA8);
+        x86_emit_byte(width - 1);
+        slow[num_slow++] = x86_emit_jump(X86_JNE, machine->jit->ptr);
+    }
+
+    /*
+     * mov ecx, eax; shr ecx, MEM_PAGE_BITS; mov rdx, page_table;
+     * mov rdx, [rdx + rcx * 8]; test rdx, rdx; je slow
+     */
+    x86_emit_byte(0x89);
+    x86_emit_byte(0xC1);
+    x86_emit_byte(0xC1);
+    x86_emit_byte(0xE9);
+    x86_emit_byte(MEM_PAGE_BITS);
+    x86_emit_mov_imm64(X86_EDX, machine->page_table);
+    x86_emit_byte(0x48);
+    x86_emit_byte(0x8B);
+    x86_emit_byte(0x14);
+    x86_emit_byte(0xCA);
+    x86_emit_byte(0x48);
+    x86_emit_byte(0x85);
+    x86_emit_byte(0xD2);
+    slow[num_slow++] = x86_emit_jump(X86_JE, machine->jit->ptr);
+
+    if(store)
+    {
+        /* lea ecx, [rax - ROM]; cmp ecx, ROM size; jb slow */
+        x86_emit_byte(0x8D);
+        x86_emit_byte(0x88);
+        x86_emit_word(-ARCH_ROM_OFFSET);
+        x86_emit_byte(0x81);
+        x86_emit_byte(0xF9);
+        x86_emit_word(ARCH_ROM_SIZE);
+        slow[num_slow++] = x86_emit_jump(X86_JB, machine->jit->ptr);
+
+        /* mov ecx, data; mov [rdx + rax], ecx (or cx, or cl) */
+        x86_emit_load_reg(X86_ECX, data_reg);
+
+        if(width == sizeof(hword_t))
+            x86_emit_byte(0x66);
+
+        x86_emit_byte((width == sizeof(byte_t)) ? 0x88 : 0x89);
+        x86_emit_byte(0x0C);
+        x86_emit_byte(0x02);
+
+        /* PUSH: sub dword SP, 4 */
+        if(decoded->opcode == PROC_OPCODE_PUSH)
+        {
+            x86_emit_rm_rbx(0x83, 5, X86_SP_DISP);
+            x86_emit_byte(sizeof(word_t));
+        }
+    }
+    else
+    {
+        /* mov ecx, [rdx + rax] (or movzx ecx, word or byte) */
+        if(width == sizeof(word_t))
+            x86_emit_byte(0x8B);
+        else
+        {
+            x86_emit_byte(0x0F);
+            x86_emit_byte((width == sizeof(hword_t)) ? 0xB7 : 0xB6);
+        }
+
+        x86_emit_byte(0x0C);
+        x86_emit_byte(0x02);
+
+        /* POP: mov SP, eax (before the data, in case it is popped to SP) */
+        if(decoded->opcode == PROC_OPCODE_POP)
+            x86_emit_store_reg(PROC_REG_SP, X86_EAX);
+
+        x86_emit_store_reg(data_reg, X86_ECX);
+    }
+
+    done = x86_emit_jump(X86_JMP, machine->jit->ptr);
+
+    /*
+     * The slow path retires the instruction in the interpreter, which must
+     * see the counts of the instructions before it. Once it is back, the
+     * counts are wound back so that both paths leave them pending alike.
+     */
+    for(i = 0; i < num_slow; i++)
+        x86_patch_jump(slow[i], machine->jit->ptr);
+
+    if(state->pending_cycles != 0)
+        x86_emit_add_qword(X86_CYCLES_DISP, state->pending_cycles);
+
+    if(state->pending_instret != 0)
+        x86_emit_add_qword(X86_INSTRET_DISP, state->pending_instret);
+
+    x86_emit_store_imm(X86_PC_DISP, pc);
+
+    /* mov rdi, decoded; mov rax, proc_jit_call; call rax */
+    x86_emit_mov_imm64(7, decoded);
+    x86_emit_mov_imm64(X86_EAX, (const void*)proc_jit_call);
+    x86_emit_byte(0xFF);
+    x86_emit_byte(0xD0);
+
+    /* cmp eax, PROC_JIT_RET_CONTINUE; jne exit */
+    x86_emit_byte(0x83);
+    x86_emit_byte(0xF8);
+    x86_emit_byte(PROC_JIT_RET_CONTINUE);
+    x86_emit_jump(X86_JNE, machine->jit->exit_ret);
+
+    x86_emit_add_qword(X86_CYCLES_DISP,
+                       -(state->pending_cycles + decoded->cycles));
+    x86_emit_add_qword(X86_INSTRET_DISP, -(state->pending_instret + 1));
+
+    x86_patch_jump(done, machine->jit->ptr);
+
+    proc_jit_emit_retire(state, decoded);
+}
+
+/**
+ * @brief Returns true if the instruction can be translated inline.
+ */
+static bool proc_jit_can_inline(const proc_decoded_instr_t* decoded)
+{
+    /*
+     * Instructions naming the PC or SR observe per-instruction state that
+     * translated code does not maintain; leave those to the interpreter.
+     */
+    if(decoded->reg_mask & (PROC_REG_MASK_PC | PROC_REG_MASK_SR))
+        return false;
+
+    /*
+     * Neither are branches that may close idle loops, so that every engine
+     * skips them alike (see processor_idle.c).
+     */
+    if(((decoded->opcode == PROC_OPCODE_BI) ||
+        (decoded->opcode == PROC_OPCODE_BZI)) &&
+       ((decoded->simm == 0) || (decoded->simm == (word_t)-4)))
+        return false;
+
+    switch(decoded->opcode)
+    {
+        case PROC_OPCODE_ADD:
+        case PROC_OPCODE_ADDI:
+        case PROC_OPCODE_ADDUI:
+        case PROC_OPCODE_LUH:
+        case PROC_OPCODE_MOV:
+        case PROC_OPCODE_AND:
+        case PROC_OPCODE_ANDI:
+        case PROC_OPCODE_OR:
+        case PROC_OPCODE_ORI:
+        case PROC_OPCODE_XOR:
+        case PROC_OPCODE_XORI:
+        case PROC_OPCODE_INV:
+        case PROC_OPCODE_BI:
+        case PROC_OPCODE_BZI:
+        case PROC_OPCODE_BALI:
+        case PROC_OPCODE_LOAD:
+        case PROC_OPCODE_LOADH:
+        case PROC_OPCODE_LOADB:
+        case PROC_OPCODE_STOR:
+        case PROC_OPCODE_STORH:
+        case PROC_OPCODE_STORB:
+        case PROC_OPCODE_PUSH:
+        case PROC_OPCODE_POP:
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Emits a single inline instruction. Returns true if it ended the
+ *        block.
+ */
+static bool proc_jit_emit_inline(proc_jit_state_t* state,
+                                 const proc_decoded_instr_t* decoded,
+                                 word_t pc)
+{
+    regidx_t ra = decoded->ra;
+    regidx_t rb = decoded->rb;
+    regidx_t rc = decoded->rc;
+    byte_t* skip;
+
+    switch(decoded->opcode)
+    {
+        case PROC_OPCODE_ADD:
+            x86_emit_load_reg(X86_EAX, ra);
+            x86_emit_rm_rbx(0x03, X86_EAX, X86_REG_DISP(rb));
+            x86_emit_store_reg(rc, X86_EAX);
+
+            /* O: RA & RB & ~RC */
+            x86_emit_load_reg(X86_ECX, ra);
+            x86_emit_rm_rbx(0x23, X86_ECX, X86_REG_DISP(rb));
+            x86_emit_load_reg(X86_EDX, rc);
+            x86_emit_byte(0xF7);
+            x86_emit_byte(0xD0 | X86_EDX);
+            x86_emit_byte(0x21);
+            x86_emit_byte(0xC0 | (X86_EDX << 3) | X86_ECX);
+
+            proc_jit_emit_retire_flags(state, decoded, rc);
+            return false;
+
+        case PROC_OPCODE_ADDI:
+        case PROC_OPCODE_ADDUI:
+            x86_emit_load_reg(X86_EAX, ra);
+            x86_emit_alu_imm(0, X86_EAX,
+                             (decoded->opcode == PROC_OPCODE_ADDI) ?
+                             decoded->simm : decoded->imm);
+            x86_emit_store_reg(rb, X86_EAX);
+
+            /* O: (RA | simm) & ~RB for ADDI, RA & ~RB for ADDUI */
+            x86_emit_load_reg(X86_ECX, ra);
+            if(decoded->opcode == PROC_OPCODE_ADDI)
+                x86_emit_alu_imm(1, X86_ECX, decoded->simm);
+            x86_emit_load_reg(X86_EDX, rb);
+            x86_emit_byte(0xF7);
+            x86_emit_byte(0xD0 | X86_EDX);
+            x86_emit_byte(0x21);
+            x86_emit_byte(0xC0 | (X86_EDX << 3) | X86_ECX);
+
+            proc_jit_emit_retire_flags(state, decoded, rb);
+            return false;
+
+        case PROC_OPCODE_LUH:
+            x86_emit_store_imm(X86_REG_DISP(ra), decoded->imm << 16);
+            proc_jit_emit_retire(state, decoded);
+            return false;
+
+        case PROC_OPCODE_MOV:
+            x86_emit_load_reg(X86_EAX, ra);
+            x86_emit_store_reg(rb, X86_EAX);
+            proc_jit_emit_retire(state, decoded);
+            return false;
+
+        case PROC_OPCODE_AND:
+        case PROC_OPCODE_OR:
+        case PROC_OPCODE_XOR:
+            x86_emit_load_reg(X86_EAX, ra);
+            x86_emit_rm_rbx((decoded->opcode == PROC_OPCODE_AND) ? 0x23 :
+                            (decoded->opcode == PROC_OPCODE_OR) ? 0x0B : 0x33,
+                            X86_EAX, X86_REG_DISP(rb));
+            x86_emit_store_reg(rc, X86_EAX);
+            proc_jit_emit_retire(state, decoded);
+            return false;
+
+        case PROC_OPCODE_ANDI:
+        case PROC_OPCODE_ORI:
+            x86_emit_load_reg(X86_EAX, ra);
+            x86_emit_alu_imm((decoded->opcode == PROC_OPCODE_ANDI) ? 4 : 1,
+                             X86_EAX, decoded->imm);
+            x86_emit_store_reg(rc, X86_EAX);
+            proc_jit_emit_retire(state, decoded);
+            return false;
+
+        case PROC_OPCODE_XORI:
+            x86_emit_load_reg(X86_EAX, ra);
+            x86_emit_alu_imm(6, X86_EAX, decoded->imm);
+            x86_emit_store_reg(rb, X86_EAX);
+            proc_jit_emit_retire(state, decoded);
+            return false;
+
+        case PROC_OPCODE_INV:
+            x86_emit_load_reg(X86_EAX, ra);
+            x86_emit_byte(0xF7);
+            x86_emit_byte(0xD0 | X86_EAX);
+            x86_emit_store_reg(rb, X86_EAX);
+            proc_jit_emit_retire(state, decoded);
+            return false;
+
+        case PROC_OPCODE_LOAD:
+        case PROC_OPCODE_LOADH:
+        case PROC_OPCODE_LOADB:
+        case PROC_OPCODE_STOR:
+        case PROC_OPCODE_STORH:
+        case PROC_OPCODE_STORB:
+        case PROC_OPCODE_PUSH:
+        case PROC_OPCODE_POP:
+            proc_jit_emit_access(state, decoded, pc);
+            return false;
+
+        case PROC_OPCODE_BI:
+            proc_jit_emit_retire(state, decoded);
+            state->pending_cycles += machine->cycle_model.branch;
+            proc_jit_emit_exit(state, pc + decoded->simm);
+            return true;
+
+        case PROC_OPCODE_BALI:
+            x86_emit_store_imm(X86_LR_DISP, pc + 4);
+            proc_jit_emit_retire(state, decoded);
+            state->pending_cycles += machine->cycle_model.branch;
+            proc_jit_emit_exit(state, pc + decoded->simm);
+            return true;
+
+        case PROC_OPCODE_BZI:
+            proc_jit_emit_retire(state, decoded);
+
+            /* cmp dword RA, 0; jne not_taken */
+            x86_emit_rm_rbx(0x83, 7, X86_REG_DISP(ra));
+            x86_emit_byte(0);
+            skip = x86_emit_jump(X86_JNE, machine->jit->ptr);
+
+            /*
+             * The exits flush the pending instruction count and cycles, so
+             * both paths must see the same counts (plus the branch penalty on
+             * the taken path).
+             */
+            word_t pending_instret = state->pending_instret;
+            word_t pending_cycles = state->pending_cycles;
+
+            state->pending_cycles += machine->cycle_model.branch;
+            proc_jit_emit_exit(state, pc + decoded->simm);
+            x86_patch_jump(skip, machine->jit->ptr);
+
+            state->pending_instret = pending_instret;
+            state->pending_cycles = pending_cycles;
+            proc_jit_emit_exit(state, pc + 4);
+            return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Translates the block starting at the given predecode index,
+ *        returning its entry point. The code cache must be writable.
+ */
+static byte_t* proc_jit_translate(word_t index)
+{
+    proc_jit_state_t state = { 0 };
+    const proc_decoded_instr_t* decoded;
+    byte_t* entry;
+    byte_t* check;
+    word_t pc, length = 0;
+    bool terminated = false;
+
+    if((machine->jit->ptr + PROC_JIT_MAX_BLOCK_SIZE) >
+       (machine->jit->cache + PROC_JIT_CACHE_SIZE))
+        proc_jit_flush();
+
+    entry = machine->jit->ptr;
+    check = proc_jit_emit_entry_check();
+
+    while(!terminated && (index + length < PROC_PREDECODE_ENTRIES) &&
+          (length < PROC_BLOCK_MAX_INSTRS))
+    {
+        decoded = &machine->predecoded[index + length];
+        pc = ARCH_ROM_OFFSET + (index + length) * sizeof(word_t);
+        length++;
+
+        if(proc_jit_can_inline(decoded))
+        {
+            terminated = proc_jit_emit_inline(&state, decoded, pc);
+            continue;
+        }
+
+        terminated = proc_block_is_terminator(decoded);
+        proc_jit_emit_call(&state, decoded, pc, terminated);
+    }
+
+    /*
+     * Blocks cut short by the length limit fall through to the next block.
+     */
+    if(!terminated)
+        proc_jit_emit_exit(&state, ARCH_ROM_OFFSET +
+                           (index + length) * sizeof(word_t));
+
+    memcpy(check, &length, sizeof(length));
+
+    machine->jit->blocks[index] = entry;
+
+    if(machine->jit->perf_map != NULL)
+    {
+        fprintf(machine->jit->perf_map, "%lx %lx dankcore_0x%08lx\n",
+                (unsigned long)(uintptr_t)entry,
+                (unsigned long)(machine->jit->ptr - entry),
+                (unsigned long)(ARCH_ROM_OFFSET + index * sizeof(word_t)));
+        fflush(machine->jit->perf_map);
+    }
+
+    return entry;
+}
+
+/**
+ * @brief Returns the translated code for the block at the given ROM address,
+ *        translating it if necessary.
+ */
+static byte_t* proc_jit_lookup(word_t pc)
+{
+    word_t index = proc_predecode_index(pc);
+
+    if(machine->jit->blocks[index] == NULL)
+    {
+        if(!proc_jit_protect(true))
+            return NULL;
+
+        return proc_jit_translate(index);
+    }
+
+    return machine->jit->blocks[index];
+}
+
+/**
+ * @brief Runs the processor until it halts or reaches its instruction limit,
+ *        executing translated code. Returns true if it halted.
+ */
+bool proc_run_jit()
+{
+    byte_t* code;
+    word_t pc, generation;
+    int ret;
+
+    /*
+     * Verbose and binary tracing and the counters are per instruction, and
+     * profiling follows calls, none of which translated code does.
+     */
+    if(stats_enabled() || machine->verbosity || (machine->trace != NULL) ||
+       (machine->profile != NULL) ||
+       ((machine->jit == NULL) && !proc_jit_init()))
+        return proc_run_block();
+
+    for(;;)
+    {
+        pc = machine->regs.PC;
+
+        if(!get_addr_in_rom(pc) || (pc & (sizeof(word_t) - 1)))
+        {
+            if(!proc_step())
+                return true;
+
+            if(!device_poll(machine->instret))
+                return false;
+
+            continue;
+        }
+
+        machine->jit->flushed = false;
+
+        code = proc_jit_lookup(pc);
+
+        /*
+         * Should the protection of the code cache be stuck, carry on in the
+         * block engine.
+         */
+        if((code == NULL) || !proc_jit_protect(false))
+            return proc_run_block();
+
+        ret = machine->jit->enter(code, &machine->regs);
+
+        if(ret == PROC_JIT_RET_HALT)
+            return true;
+
+        /*
+         * Step up to the next device event, which is then serviced below.
+         */
+        if(ret == PROC_JIT_RET_STEP)
+        {
+            while((machine->instret < machine->device_next_event) &&
+                  !machine->device_mmio_touched)
+                if(!proc_step())
+                    return true;
+        }
+
+        /*
+         * Chain the exit that was taken to its target block, unless the
+         * cache was flushed underneath it.
+         */
+        if((ret >= PROC_JIT_RET_EXIT) && !machine->jit->flushed &&
+           !machine->device_mmio_touched)
+        {
+            proc_jit_exit_t* exit =
+                    &machine->jit->exits[ret - PROC_JIT_RET_EXIT];
+
+            if(get_addr_in_rom(exit->target) &&
+               !(exit->target & (sizeof(word_t) - 1)))
+            {
+                generation = machine->jit->generation;
+                code = proc_jit_lookup(exit->target);
+
+                /*
+                 * Translating the target may have flushed the cache (and
+                 * with it the exit).
+                 */
+                if((code != NULL) &&
+                   (generation == machine->jit->generation) &&
+                   proc_jit_protect(true))
+                    x86_patch_jump(exit->patch, code);
+            }
+        }
+
+        if(!device_poll(machine->instret))
+            return false;
+    }
+}
+
+#else
+
+/**
+ * @brief Translated code is only supported on x86-64 hosts; elsewhere the JIT
+ *        engine runs the block engine instead.
+ */
+void proc_jit_invalidate()
+{
+}
+
+void proc_jit_destroy()
+{
+}
+
+bool proc_run_jit()
+{
+    return proc_run_block();
+}
+
+#endif
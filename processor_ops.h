@@ -0,0 +1,571 @@
+/**
+ * @brief The instruction semantics of the DankCore processor.
+ *
+ * This file is included by each execution engine, which must define the
+ * following macros before including it:
+ *
+ *  PROC_OP(opc)        Begins the handler for PROC_OPCODE_<opc>.
+ *  PROC_OP_DEFAULT     Begins the handler for undefined opcodes.
+ *  PROC_OP_END         Ends a handler (retires the instruction).
+ *  PROC_OP_HALT        Stops the processor.
+ *
+ * The handlers operate on the locals ra, rb, rc, imm, simm, opcode and
+ * increment_pc, which the engine must provide. Keeping the semantics in one
+ * place guarantees that every engine produces the same architectural results.
+ * The ALU flags are evaluated lazily (see proc_set_alu_flags()), so an engine
+ * must call proc_flags_sync() before an instruction naming SR.
+ *
+ * Note that this file intentionally has no include guard.
+ */
+
+/*
+ * ADD instruction.
+ *
+ * RA + RB --> RC
+ *
+ * Sets overflow, zero, and negative flags as appropriate.
+ *
+ * TODO: Check that the flags are set correctly.
+ */
+PROC_OP(ADD)
+    proc_reg(rc) = proc_reg(ra) + proc_reg(rb);
+
+    /*
+     * Record the overflow term and the result; the flags are built from them
+     * only if SR is read.
+     */
+    proc_set_alu_flags(proc_reg(ra) & proc_reg(rb) & ~proc_reg(rc),
+                       proc_reg(rc));
+
+    PROC_OP_END
+
+/*
+ * ADDI instruction (signed immediate add).
+ *
+ * RA + SignExtend(imm) --> RB
+ *
+ * Sets overflow, zero, and negative flags as appropriate.
+ *
+ * TODO: Check that the flags are set correctly.
+ */
+PROC_OP(ADDI)
+    proc_reg(rb) = proc_reg(ra) + simm;
+
+    proc_set_alu_flags((proc_reg(ra) | simm) & ~proc_reg(rb), proc_reg(rb));
+
+    PROC_OP_END
+
+/*
+ * ADDUI instruction (unsigned immediate add).
+ *
+ * RA + imm --> RB
+ *
+ * Sets overflow, zero, and negative flags as appropriate.
+ *
+ * TODO: Check that the flags are set correctly.
+ */
+PROC_OP(ADDUI)
+    proc_reg(rb) = proc_reg(ra) + imm;
+
+    proc_set_alu_flags(proc_reg(ra) & ~proc_reg(rb), proc_reg(rb));
+
+    PROC_OP_END
+
+/*
+ * HALT instruction.
+ *
+ * Stops the processor (terminates the emulator).
+ */
+PROC_OP(HALT)
+    PROC_OP_HALT
+
+/*
+ * DUMP meta-instruction.
+ *
+ * Dumps the contents of the registers (to stdout).
+ */
+PROC_OP(DUMP)
+    proc_dump_regs();
+    PROC_OP_END
+
+/*
+ * LUH instruction (load upper halfword).
+ *
+ * {imm[31:16], 16'b0} --> RA
+ */
+PROC_OP(LUH)
+    proc_reg(ra) = imm << 16;
+    PROC_OP_END
+
+/*
+ * JUMP instruction.
+ *
+ * RA --> PC
+ */
+PROC_OP(JUMP)
+    machine->regs.PC = proc_reg(ra);
+
+    if(machine->profile != NULL)
+        profile_return(machine->regs.PC);
+
+    increment_pc = false;
+    PROC_OP_END
+
+/*
+ * JUMPI instruction (jump immediate).
+ *
+ * RA + SignExtend(imm) --> PC
+ */
+PROC_OP(JUMPI)
+    machine->regs.PC = proc_reg(ra) + simm;
+
+    increment_pc = false;
+    PROC_OP_END
+
+/*
+ * BR instruction (branch).
+ *
+ * PC + RA --> PC
+ */
+PROC_OP(BR)
+    machine->regs.PC = machine->regs.PC + proc_reg(ra);
+
+/*
+ * BI instruction (branch immediate).
+ *
+ * PC + SignExtend(imm) --> PC
+ */
+PROC_OP(BI)
+    machine->regs.PC = machine->regs.PC + simm;
+
+    /*
+     * This may close an idle loop (see processor_idle.c).
+     */
+    if((simm == 0) || (simm == (word_t)-4))
+        proc_idle_skip(pc, simm);
+
+    increment_pc = false;
+    PROC_OP_END
+
+/*
+ * MOV instruction (move).
+ *
+ * RA --> RB
+ */
+PROC_OP(MOV)
+    proc_reg(rb) = proc_reg(ra);
+
+    if(rb == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * LOAD instruction.
+ *
+ * MEM[RB] --> RA
+ */
+PROC_OP(LOAD)
+    proc_reg(ra) = proc_load_word(proc_reg(rb));
+
+    if(ra == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * STOR instruction.
+ *
+ * RA --> MEM[RB]
+ */
+PROC_OP(STOR)
+    proc_store_word(proc_reg(rb), proc_reg(ra));
+    proc_predecode_check(proc_reg(rb), sizeof(word_t));
+    PROC_OP_END
+
+/*
+ * JZ instruction (jump zero).
+ *
+ * if(RA == 0): RB --> PC
+ */
+PROC_OP(JZ)
+    if(proc_reg(ra) == 0)
+    {
+        machine->regs.PC = proc_reg(rb);
+        increment_pc = false;
+    }
+    PROC_OP_END
+
+/*
+ * JZI instruction (jump zero immediate).
+ *
+ * if(RA == 0): RB + SignExtend(imm) --> PC
+ */
+PROC_OP(JZI)
+    if(proc_reg(ra) == 0)
+    {
+        machine->regs.PC = proc_reg(rb) + simm;
+        increment_pc = false;
+    }
+    PROC_OP_END
+
+/*
+ * BZ instruction (branch zero).
+ *
+ * if(RA == 0): PC + RB --> PC
+ */
+PROC_OP(BZ)
+    if(proc_reg(ra) == 0)
+    {
+        machine->regs.PC += proc_reg(rb);
+        increment_pc = false;
+    }
+    PROC_OP_END
+
+/*
+ * BZI instruction (branch zero immediate).
+ *
+ * if(RA == 0): PC + SignExtend(imm) --> PC
+ */
+PROC_OP(BZI)
+    if(proc_reg(ra) == 0)
+    {
+        machine->regs.PC += simm;
+        increment_pc = false;
+
+        if((simm == 0) || (simm == (word_t)-4))
+            proc_idle_skip(pc, simm);
+    }
+    PROC_OP_END
+
+/*
+ * JLT instruction (jump zero).
+ *
+ * if(RA < 0): RB --> PC
+ */
+PROC_OP(JLT)
+    if(proc_reg(ra) < 0)
+    {
+        machine->regs.PC = proc_reg(rb);
+        increment_pc = false;
+    }
+    PROC_OP_END
+
+/*
+ * JLTI instruction (jump zero immediate).
+ *
+ * if(RA < 0): RB + SignExtend(imm) --> PC
+ */
+PROC_OP(JLTI)
+    if(proc_reg(ra) < 0)
+    {
+        machine->regs.PC = proc_reg(rb) + simm;
+        increment_pc = false;
+    }
+    PROC_OP_END
+
+/*
+ * BLT instruction (branch zero).
+ *
+ * if(RA < 0): PC + RB --> PC
+ */
+PROC_OP(BLT)
+    if(proc_reg(ra) < 0)
+    {
+        machine->regs.PC += proc_reg(rb);
+        increment_pc = false;
+    }
+    PROC_OP_END
+
+/*
+ * BLTI instruction (branch zero immediate).
+ *
+ * if(RA < 0): PC + SignExtend(imm) --> PC
+ */
+PROC_OP(BLTI)
+    if(proc_reg(ra) < 0)
+    {
+        machine->regs.PC += simm;
+        increment_pc = false;
+    }
+    PROC_OP_END
+
+/*
+ * MOVZ instruction (move zero).
+ *
+ * if(RA == 0): RB --> RC
+ */
+PROC_OP(MOVZ)
+    if(proc_reg(ra) == 0)
+    {
+        proc_reg(rc) = proc_reg(rb);
+
+        if(rc == 12)
+            increment_pc = false;
+    }
+    PROC_OP_END
+
+/*
+ * MOVLT instruction (move less than).
+ *
+ * if(RA == 0): RB --> RC
+ */
+PROC_OP(MOVLT)
+    if(proc_reg(ra) < 0)
+    {
+        proc_reg(rc) = proc_reg(rb);
+
+        if(rc == 12)
+            increment_pc = false;
+    }
+    PROC_OP_END
+
+/*
+ * PUSH instruction (push to stack).
+ *
+ * RA --> MEM[SP]; SP -= 4
+ */
+PROC_OP(PUSH)
+    proc_store_word(machine->regs.SP, proc_reg(ra));
+    proc_predecode_check(machine->regs.SP, sizeof(word_t));
+    machine->regs.SP -= 4;
+    PROC_OP_END
+
+/*
+ * POP instruction (pop from stack).
+ *
+ * SP += 4; MEM[SP] --> RA
+ */
+PROC_OP(POP)
+    machine->regs.SP += 4;
+    proc_reg(ra) = proc_load_word(machine->regs.SP);
+
+    if(ra == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * AND instruction (bitwise).
+ *
+ * RC = RA & RB
+ */
+PROC_OP(AND)
+    proc_reg(rc) = proc_reg(ra) & proc_reg(rb);
+
+    if(rc == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * ANDI instruction (bitwise).
+ *
+ * RC = RA & {16'b0,imm}
+ */
+PROC_OP(ANDI)
+    proc_reg(rc) = proc_reg(ra) & ((word_t)imm);
+
+    if(rc == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * OR instruction (bitwise).
+ *
+ * RC = RA | RB
+ */
+PROC_OP(OR)
+    proc_reg(rc) = proc_reg(ra) | proc_reg(rb);
+
+    if(rc == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * ORI instruction (bitwise).
+ *
+ * RC = RA | {16'b0,imm}
+ */
+PROC_OP(ORI)
+    proc_reg(rc) = proc_reg(ra) | ((word_t)imm);
+
+    if(rc == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * INV instruction (bitwise).
+ *
+ * RB = ~RA
+ */
+PROC_OP(INV)
+    proc_reg(rb) = ~proc_reg(ra);
+
+    if(rb == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * XOR instruction (bitwise).
+ *
+ * RC = RA ^ RB
+ */
+PROC_OP(XOR)
+    proc_reg(rc) = proc_reg(ra) ^ proc_reg(rb);
+
+    if(rc == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * XORI instruction (bitwise).
+ *
+ * RB = RA ^ IMM
+ */
+PROC_OP(XORI)
+    proc_reg(rb) = proc_reg(ra) ^ ((word_t)imm);
+
+    if(rb == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * LOADH instruction (load halfword).
+ *
+ * RA = MEM[RB]
+ */
+PROC_OP(LOADH)
+    proc_reg(ra) = ((word_t)proc_load_hword(proc_reg(rb)));
+
+    if(ra == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * STORH instruction (store halfword).
+ *
+ * MEM[RB] = RA
+ */
+PROC_OP(STORH)
+    proc_store_hword(proc_reg(rb), ((hword_t)(proc_reg(ra) & 0xFFFF)));
+    proc_predecode_check(proc_reg(rb), sizeof(hword_t));
+    PROC_OP_END
+
+/*
+ * LOADB instruction (load byte).
+ *
+ * RA = {24'b0, MEM[RB]}
+ */
+PROC_OP(LOADB)
+    proc_reg(ra) = ((word_t)proc_load_byte(proc_reg(rb)));
+
+    if(ra == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * STORB instruction (store byte).
+ *
+ * MEM[RB] = RA[7:0]
+ */
+PROC_OP(STORB)
+    proc_store_byte(proc_reg(ra), ((byte_t)(proc_reg(rb) & 0xFF)));
+    proc_predecode_check(proc_reg(ra), sizeof(byte_t));
+    PROC_OP_END
+
+/*
+ * SAR instruction (shift arithmetic right).
+ *
+ * RC = sign_extend(RA >> RB)
+ */
+PROC_OP(SAR)
+    proc_reg(rc) = proc_reg(ra) >> proc_reg(rb);
+    if(proc_reg(ra) & 0x80000000)
+        proc_reg(rc) |= proc_high_ones_mask(proc_reg(rb));
+
+    if(rc == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * SLL instruction (shift logical left).
+ *
+ * RC = RA << RB
+ */
+PROC_OP(SLL)
+    proc_reg(rc) = proc_reg(ra) << proc_reg(rb);
+
+    if(rc == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * SLR instruction (shift logical right).
+ *
+ * RC = RA >> RB
+ */
+PROC_OP(SLR)
+    proc_reg(rc) = proc_reg(ra) >> proc_reg(rb);
+
+    if(rc == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * SARI instruction (shift arithmetic right immediate).
+ *
+ * RC = sign_extend(RA >> sign_extend(IMM))
+ */
+PROC_OP(SARI)
+    proc_reg(rc) = proc_reg(ra) >> simm;
+
+    if((simm > 0) & (proc_reg(ra) & 0x80000000))
+        proc_reg(rc) |= proc_high_ones_mask(proc_reg(rb));
+
+    if(rc == 12)
+        increment_pc = false;
+    PROC_OP_END
+
+/*
+ * BALI instruction (branch and link immediate).
+ *
+ * LR = PC + 4; PC += sign_extend(IMM)
+ */
+PROC_OP(BALI)
+    machine->regs.LR = machine->regs.PC + 4;
+    machine->regs.PC += simm;
+
+    if(machine->profile != NULL)
+        profile_call(machine->regs.PC, machine->regs.LR);
+
+    increment_pc = false;
+    PROC_OP_END
+
+/*
+ * WFI instruction (wait for interrupt).
+ *
+ * Sleeps until an enabled interrupt is pending (see processor_idle.c). Stops
+ * the processor if nothing can ever wake it.
+ */
+PROC_OP(WFI)
+    if(!proc_idle_wait())
+        PROC_OP_HALT
+    PROC_OP_END
+
+/*
+ * RETI instruction (return from interrupt).
+ *
+ * SP += 4; MEM[SP] --> SR; SP += 4; MEM[SP] --> PC
+ */
+PROC_OP(RETI)
+    proc_interrupt_return();
+    increment_pc = false;
+    PROC_OP_END
+
+PROC_OP_DEFAULT
+    if(machine->verbosity)
+        printf("Unknown instruction @PC=0x%08x: {opc: 0x%02x, ra: 0x%x\
+, rb: 0x%x, rc: 0x%x, imm: 0x%04x}\n", machine->regs.PC, opcode,
+               proc_reg(ra), proc_reg(rb), proc_reg(rc), imm);
+    stats_count(decode_faults);
+    if(!(machine->regs.SR & SR_FAULT_DECODE_FLAG))
+        trace_flight_dump("decode fault");
+    machine->regs.SR |= SR_FAULT_DECODE_FLAG;
+    PROC_OP_END
@@ -0,0 +1,170 @@
+/**
+ * @brief Direct-threaded execution engine for the DankCore processor.
+ *
+ * Every predecoded instruction carries the address of its handler, and every
+ * handler ends by fetching the next instruction and jumping straight to its
+ * handler (using the GCC computed goto extension). This gives the host branch
+ * predictor one indirect jump per handler to learn, instead of the single
+ * shared dispatch jump of the switch interpreter.
+ */
+
+#include "processor.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/**
+ * @brief Runs the processor until it halts or reaches its instruction limit,
+ *        using direct-threaded dispatch. Returns true if it halted.
+ */
+bool proc_run_threaded()
+{
+    static const void* handlers[256];
+    static bool handlers_ready = false;
+    static pthread_mutex_t handlers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    proc_decoded_instr_t scratch;
+    const proc_decoded_instr_t* decoded;
+
+    regidx_t ra, rb, rc;
+    word_t imm, simm;
+    opcode_t opcode;
+
+    bool increment_pc;
+    word_t pc;
+
+    word_t i;
+
+    /*
+     * Fill in the handler table, which is shared by all machines. It never
+     * changes once filled.
+     */
+    pthread_mutex_lock(&handlers_lock);
+
+    if(!handlers_ready)
+    {
+        for(i = 0; i < 256; i++)
+            handlers[i] = &&proc_op_DEFAULT;
+
+#define PROC_THREADED_HANDLER(__opc__) \
+        handlers[PROC_OPCODE_##__opc__] = &&proc_op_##__opc__
+
+        PROC_THREADED_HANDLER(ADD);
+        PROC_THREADED_HANDLER(ADDI);
+        PROC_THREADED_HANDLER(ADDUI);
+        PROC_THREADED_HANDLER(HALT);
+        PROC_THREADED_HANDLER(DUMP);
+        PROC_THREADED_HANDLER(LUH);
+        PROC_THREADED_HANDLER(JUMP);
+        PROC_THREADED_HANDLER(JUMPI);
+        PROC_THREADED_HANDLER(BR);
+        PROC_THREADED_HANDLER(BI);
+        PROC_THREADED_HANDLER(MOV);
+        PROC_THREADED_HANDLER(LOAD);
+        PROC_THREADED_HANDLER(STOR);
+        PROC_THREADED_HANDLER(JZ);
+        PROC_THREADED_HANDLER(JZI);
+        PROC_THREADED_HANDLER(BZ);
+        PROC_THREADED_HANDLER(BZI);
+        PROC_THREADED_HANDLER(JLT);
+        PROC_THREADED_HANDLER(JLTI);
+        PROC_THREADED_HANDLER(BLT);
+        PROC_THREADED_HANDLER(BLTI);
+        PROC_THREADED_HANDLER(MOVZ);
+        PROC_THREADED_HANDLER(MOVLT);
+        PROC_THREADED_HANDLER(PUSH);
+        PROC_THREADED_HANDLER(POP);
+        PROC_THREADED_HANDLER(AND);
+        PROC_THREADED_HANDLER(ANDI);
+        PROC_THREADED_HANDLER(OR);
+        PROC_THREADED_HANDLER(ORI);
+        PROC_THREADED_HANDLER(INV);
+        PROC_THREADED_HANDLER(XOR);
+        PROC_THREADED_HANDLER(XORI);
+        PROC_THREADED_HANDLER(LOADH);
+        PROC_THREADED_HANDLER(STORH);
+        PROC_THREADED_HANDLER(LOADB);
+        PROC_THREADED_HANDLER(STORB);
+        PROC_THREADED_HANDLER(SAR);
+        PROC_THREADED_HANDLER(SLL);
+        PROC_THREADED_HANDLER(SLR);
+        PROC_THREADED_HANDLER(SARI);
+        PROC_THREADED_HANDLER(BALI);
+        PROC_THREADED_HANDLER(WFI);
+        PROC_THREADED_HANDLER(RETI);
+
+#undef PROC_THREADED_HANDLER
+
+        handlers_ready = true;
+    }
+
+    pthread_mutex_unlock(&handlers_lock);
+
+    /*
+     * Publish the handler table to the machine and link its predecoded ROM
+     * image to it.
+     */
+    if(machine->instr_handlers == NULL)
+    {
+        machine->instr_handlers = handlers;
+
+        for(i = 0; i < PROC_PREDECODE_ENTRIES; i++)
+            machine->predecoded[i].handler =
+                    handlers[machine->predecoded[i].opcode];
+    }
+
+/*
+ * Fetches the next instruction and jumps directly to its handler.
+ */
+#define PROC_THREADED_DISPATCH() \
+        do { \
+            decoded = proc_fetch(&scratch); \
+            pc = machine->regs.PC; \
+            trace_flight_record(pc); \
+            ra = decoded->ra; \
+            rb = decoded->rb; \
+            rc = decoded->rc; \
+            imm = decoded->imm; \
+            simm = decoded->simm; \
+            opcode = decoded->opcode; \
+            increment_pc = true; \
+            if(machine->verbosity) \
+                proc_print_decoded(decoded); \
+            if(decoded->reg_mask & PROC_REG_MASK_SR) \
+                proc_flags_sync(); \
+            goto *decoded->handler; \
+        } while(0)
+
+#define PROC_OP(__opc__)    proc_op_##__opc__:
+#define PROC_OP_DEFAULT     proc_op_DEFAULT:
+#define PROC_OP_HALT        return true;
+
+/*
+ * Retires the instruction exactly as proc_instr_execute_decoded() does, then
+ * dispatches the next one.
+ */
+#define PROC_OP_END \
+        if(increment_pc) \
+            machine->regs.PC += 4; \
+        else \
+            machine->cycles += machine->cycle_model.branch; \
+        machine->instret++; \
+        machine->cycles += decoded->cycles; \
+        stats_retire(opcode); \
+        if(machine->trace != NULL) \
+            trace_retire(pc); \
+        if(!device_poll(machine->instret)) \
+            return false; \
+        PROC_THREADED_DISPATCH();
+
+    PROC_THREADED_DISPATCH();
+
+#include "processor_ops.h"
+
+#undef PROC_OP
+#undef PROC_OP_DEFAULT
+#undef PROC_OP_END
+#undef PROC_OP_HALT
+#undef PROC_THREADED_DISPATCH
+}
@@ -0,0 +1,721 @@
+#include "profile.h"
+#include "devices.h"
+#include "machine.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILE_NAME_SIZE (256)
+
+typedef struct
+{
+    word_t addr;
+    char* name;
+} profile_symbol_t;
+
+/*
+ * A distinct call stack and PC that were sampled, and how many times. Slots
+ * of the hash table with no targets are empty. Once the samples are folded
+ * for the report, the PC is dropped and the last target is the function
+ * that the PC was in.
+ */
+typedef struct
+{
+    uint64_t hash;
+    uint64_t count;
+    word_t pc;
+    word_t depth;
+    word_t* targets;
+} profile_stack_t;
+
+/*
+ * A function in the report: the samples taken in it (self), and with it
+ * anywhere on the stack (total).
+ */
+typedef struct
+{
+    word_t addr;
+    uint64_t self;
+    uint64_t total;
+    word_t last_stack;
+} profile_function_t;
+
+typedef struct profile
+{
+    char* fname;
+    uint64_t period;
+
+    /*
+     * The event source that takes the samples. It decodes no addresses.
+     */
+    device_mapping_t* device;
+
+    /*
+     * The shadow call stack: the address each frame called, and the address
+     * it returns to. Frame 0 is the root, which is never popped. Calls made
+     * while the stack was full are counted in lost.
+     */
+    word_t targets[PROFILE_MAX_DEPTH];
+    word_t rets[PROFILE_MAX_DEPTH];
+    word_t depth;
+    uint64_t lost;
+
+    /*
+     * The sampled stacks, an open-addressed hash table.
+     */
+    profile_stack_t* stacks;
+    word_t stack_capacity;
+    word_t num_stacks;
+    uint64_t samples;
+
+    /*
+     * The symbols, sorted by address.
+     */
+    profile_symbol_t* symbols;
+    word_t num_symbols;
+} profile_t;
+
+/**
+ * @brief Hashes a call stack and PC (FNV-1a).
+ */
+static uint64_t profile_hash(const word_t* targets, word_t depth, word_t pc)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    word_t i;
+
+    for(i = 0; i < depth; i++)
+        hash = (hash ^ targets[i]) * 0x100000001b3ull;
+
+    return (hash ^ pc) * 0x100000001b3ull;
+}
+
+/**
+ * @brief Finds the slot of the hash table holding a call stack and PC, or
+ *        the empty slot where they belong.
+ */
+static profile_stack_t* profile_find_stack(profile_stack_t* stacks,
+                                           word_t capacity,
+                                           const word_t* targets,
+                                           word_t depth, word_t pc,
+                                           uint64_t hash)
+{
+    profile_stack_t* stack;
+    word_t slot = hash & (capacity - 1);
+    word_t i;
+
+    for(;; slot = (slot + 1) & (capacity - 1))
+    {
+        stack = &stacks[slot];
+
+        if(stack->targets == NULL)
+            return stack;
+
+        if((stack->hash != hash) || (stack->depth != depth) ||
+           (stack->pc != pc))
+            continue;
+
+        for(i = 0; i < depth; i++)
+            if(stack->targets[i] != targets[i])
+                break;
+
+        if(i == depth)
+            return stack;
+    }
+}
+
+/**
+ * @brief Doubles the size of the hash table.
+ */
+static bool profile_grow(profile_t* profile)
+{
+    word_t capacity = profile->stack_capacity * 2;
+    profile_stack_t* stacks;
+    profile_stack_t* stack;
+    word_t i, slot;
+
+    stacks = (profile_stack_t*)calloc(capacity, sizeof(profile_stack_t));
+
+    if(stacks == NULL)
+        return false;
+
+    for(i = 0; i < profile->stack_capacity; i++)
+    {
+        stack = &profile->stacks[i];
+
+        if(stack->targets == NULL)
+            continue;
+
+        for(slot = stack->hash & (capacity - 1); stacks[slot].targets != NULL;
+            slot = (slot + 1) & (capacity - 1));
+
+        stacks[slot] = (*stack);
+    }
+
+    free(profile->stacks);
+
+    profile->stacks = stacks;
+    profile->stack_capacity = capacity;
+
+    return true;
+}
+
+/**
+ * @brief Adds count samples of a call stack and PC to the hash table.
+ *        Returns false when out of memory, in which case they are dropped.
+ */
+static bool profile_count(profile_t* profile, const word_t* targets,
+                          word_t depth, word_t pc, uint64_t count)
+{
+    uint64_t hash = profile_hash(targets, depth, pc);
+    profile_stack_t* stack;
+
+    stack = profile_find_stack(profile->stacks, profile->stack_capacity,
+                               targets, depth, pc, hash);
+
+    if(stack->targets != NULL)
+    {
+        stack->count += count;
+        return true;
+    }
+
+    if((profile->num_stacks + 1) * 2 > profile->stack_capacity)
+    {
+        if(!profile_grow(profile))
+            return false;
+
+        stack = profile_find_stack(profile->stacks, profile->stack_capacity,
+                                   targets, depth, pc, hash);
+    }
+
+    stack->targets = (word_t*)malloc(sizeof(word_t) * depth);
+
+    if(stack->targets == NULL)
+        return false;
+
+    memcpy(stack->targets, targets, sizeof(word_t) * depth);
+
+    stack->hash = hash;
+    stack->pc = pc;
+    stack->depth = depth;
+    stack->count = count;
+
+    profile->num_stacks++;
+
+    return true;
+}
+
+/**
+ * @brief Takes a sample of the shadow call stack and the PC, and schedules
+ *        the next one.
+ */
+static void profile_update(device_mapping_t* device, uint64_t now)
+{
+    profile_t* profile = (profile_t*)device->context;
+
+    profile->samples++;
+
+    profile_count(profile, profile->targets, profile->depth,
+                  machine->regs.PC, 1);
+
+    device_schedule(device, now + profile->period);
+}
+
+static const device_mapping_t profile_device_mapping =
+{
+    .base = 0,
+    .size = 0,
+    .update = profile_update
+};
+
+/**
+ * @brief Orders symbols by address.
+ */
+static int profile_compare_symbols(const void* a, const void* b)
+{
+    word_t addr_a = ((const profile_symbol_t*)a)->addr;
+    word_t addr_b = ((const profile_symbol_t*)b)->addr;
+
+    return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+/**
+ * @brief Loads a symbol file written by asm.py.
+ */
+static bool profile_load_symbols(profile_t* profile, const char* fname)
+{
+    char line[PROFILE_NAME_SIZE];
+    char name[PROFILE_NAME_SIZE];
+    profile_symbol_t* symbols;
+    word_t capacity = 0;
+    unsigned int addr;
+    FILE* file;
+
+    file = fopen(fname, "r");
+
+    if(file == NULL)
+    {
+        fprintf(stderr, "Could not open symbols %s: %s\n", fname,
+                strerror(errno));
+        return false;
+    }
+
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        if(sscanf(line, "%x %255s", &addr, name) != 2)
+            continue;
+
+        if(profile->num_symbols == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            symbols = (profile_symbol_t*)realloc(
+                    profile->symbols, sizeof(profile_symbol_t) * capacity);
+
+            if(symbols == NULL)
+                break;
+
+            profile->symbols = symbols;
+        }
+
+        profile->symbols[profile->num_symbols].addr = addr;
+        profile->symbols[profile->num_symbols].name = strdup(name);
+
+        if(profile->symbols[profile->num_symbols].name != NULL)
+            profile->num_symbols++;
+    }
+
+    fclose(file);
+
+    qsort(profile->symbols, profile->num_symbols, sizeof(profile_symbol_t),
+          profile_compare_symbols);
+
+    return true;
+}
+
+/**
+ * @brief Names a guest address after the closest symbol at or before it.
+ */
+static const char* profile_name(const profile_t* profile, word_t addr,
+                                char* buffer)
+{
+    word_t low = 0;
+    word_t high = profile->num_symbols;
+    word_t mid;
+    const profile_symbol_t* symbol;
+
+    while(low < high)
+    {
+        mid = (low + high) / 2;
+
+        if(profile->symbols[mid].addr <= addr)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if(low == 0)
+    {
+        snprintf(buffer, PROFILE_NAME_SIZE, "0x%08x", addr);
+        return buffer;
+    }
+
+    symbol = &profile->symbols[low - 1];
+
+    if(symbol->addr == addr)
+        return symbol->name;
+
+    snprintf(buffer, PROFILE_NAME_SIZE, "%s+0x%x", symbol->name,
+             addr - symbol->addr);
+
+    return buffer;
+}
+
+/**
+ * @brief Starts profiling the current machine from its current PC, taking a
+ *        sample every period instructions. The samples are written to the
+ *        file fname by profile_report(). symbols may be NULL, in which case
+ *        addresses are reported in hex.
+ */
+bool profile_init(const char* fname, const char* symbols, uint64_t period)
+{
+    device_mapping_t device_mapping = profile_device_mapping;
+    profile_t* profile = (profile_t*)calloc(1, sizeof(profile_t));
+
+    if(profile == NULL)
+        return false;
+
+    machine->profile = profile;
+
+    profile->period = period ? period : PROFILE_DEFAULT_PERIOD;
+    profile->fname = strdup(fname);
+    profile->stack_capacity = 64;
+    profile->stacks = (profile_stack_t*)calloc(profile->stack_capacity,
+                                               sizeof(profile_stack_t));
+
+    if((profile->fname == NULL) || (profile->stacks == NULL) ||
+       ((symbols != NULL) && !profile_load_symbols(profile, symbols)))
+    {
+        profile_destroy();
+        return false;
+    }
+
+    profile->targets[0] = machine->regs.PC;
+    profile->depth = 1;
+
+    device_mapping.context = profile;
+    profile->device = device_register(&device_mapping);
+
+    if(profile->device == NULL)
+    {
+        profile_destroy();
+        return false;
+    }
+
+    device_schedule(profile->device, machine->instret + profile->period);
+
+    return true;
+}
+
+/**
+ * @brief Stops profiling and frees the samples. The sampling device itself is
+ *        freed with the other devices.
+ */
+void profile_destroy()
+{
+    profile_t* profile = machine->profile;
+    word_t i;
+
+    if(profile == NULL)
+        return;
+
+    if(profile->device != NULL)
+        device_schedule(profile->device, DEVICE_NO_EVENT);
+
+    for(i = 0; i < profile->stack_capacity; i++)
+        free(profile->stacks[i].targets);
+
+    for(i = 0; i < profile->num_symbols; i++)
+        free(profile->symbols[i].name);
+
+    free(profile->stacks);
+    free(profile->symbols);
+    free(profile->fname);
+    free(profile);
+
+    machine->profile = NULL;
+}
+
+/**
+ * @brief Follows a call to target, which returns to ret.
+ */
+void profile_call(word_t target, word_t ret)
+{
+    profile_t* profile = machine->profile;
+
+    if(profile->depth == PROFILE_MAX_DEPTH)
+    {
+        profile->lost++;
+        return;
+    }
+
+    profile->targets[profile->depth] = target;
+    profile->rets[profile->depth] = ret;
+    profile->depth++;
+}
+
+/**
+ * @brief Follows a jump to target. If target is the return address of a frame
+ *        on the shadow call stack, that frame and any above it are popped.
+ */
+void profile_return(word_t target)
+{
+    profile_t* profile = machine->profile;
+    word_t i;
+
+    for(i = profile->depth - 1; i > 0; i--)
+    {
+        if(profile->rets[i] != target)
+            continue;
+
+        /*
+         * Returns from calls that were not recorded come first.
+         */
+        if(profile->lost > 0)
+            profile->lost--;
+        else
+            profile->depth = i;
+
+        return;
+    }
+}
+
+/**
+ * @brief Orders functions by address.
+ */
+static int profile_compare_functions(const void* a, const void* b)
+{
+    word_t addr_a = ((const profile_function_t*)a)->addr;
+    word_t addr_b = ((const profile_function_t*)b)->addr;
+
+    return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+/**
+ * @brief Orders functions by self samples, most first.
+ */
+static int profile_compare_self(const void* a, const void* b)
+{
+    uint64_t self_a = ((const profile_function_t*)a)->self;
+    uint64_t self_b = ((const profile_function_t*)b)->self;
+
+    return (self_a < self_b) - (self_a > self_b);
+}
+
+/**
+ * @brief Finds a function in a table sorted by address.
+ */
+static profile_function_t* profile_find_function(
+        profile_function_t* functions, word_t count, word_t addr)
+{
+    profile_function_t key;
+
+    key.addr = addr;
+
+    return (profile_function_t*)bsearch(&key, functions, count,
+                                        sizeof(profile_function_t),
+                                        profile_compare_functions);
+}
+
+/**
+ * @brief Lists the functions called in the sampled stacks, sorted by address,
+ *        and stores how many there are in count. Returns NULL when out of
+ *        memory.
+ */
+static profile_function_t* profile_functions(const profile_t* profile,
+                                             word_t* count)
+{
+    profile_function_t* functions;
+    word_t total = 0;
+    word_t unique = 0;
+    word_t i, j;
+
+    for(i = 0; i < profile->stack_capacity; i++)
+        total += profile->stacks[i].depth;
+
+    functions = (profile_function_t*)calloc(total ? total : 1,
+                                            sizeof(profile_function_t));
+
+    if(functions == NULL)
+        return NULL;
+
+    for(i = 0; i < profile->stack_capacity; i++)
+        for(j = 0; j < profile->stacks[i].depth; j++)
+            functions[unique++].addr = profile->stacks[i].targets[j];
+
+    qsort(functions, unique, sizeof(profile_function_t),
+          profile_compare_functions);
+
+    for(i = 0, total = 0; i < unique; i++)
+        if((total == 0) || (functions[total - 1].addr != functions[i].addr))
+            functions[total++] = functions[i];
+
+    (*count) = total;
+
+    return functions;
+}
+
+/**
+ * @brief Finds the function that contains addr: the closest function called
+ *        at or before it. Returns NULL if there is none.
+ */
+static const profile_function_t* profile_containing_function(
+        const profile_function_t* functions, word_t count, word_t addr)
+{
+    word_t low = 0;
+    word_t high = count;
+    word_t mid;
+
+    while(low < high)
+    {
+        mid = (low + high) / 2;
+
+        if(functions[mid].addr <= addr)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return (low == 0) ? NULL : &functions[low - 1];
+}
+
+/**
+ * @brief Folds the samples taken at each PC into samples of the function
+ *        that contains the PC. The shadow call stack only supplies the
+ *        callers: if the PC is not in the function on top of it, as after a
+ *        tail call, its function is added as a frame.
+ */
+static bool profile_fold(profile_t* profile)
+{
+    word_t targets[PROFILE_MAX_DEPTH + 1];
+    profile_stack_t* stacks = profile->stacks;
+    profile_function_t* functions;
+    const profile_function_t* function;
+    const profile_stack_t* stack;
+    word_t capacity = profile->stack_capacity;
+    word_t count, depth, i;
+    bool ok = true;
+
+    functions = profile_functions(profile, &count);
+
+    if(functions == NULL)
+        return false;
+
+    profile->stacks = (profile_stack_t*)calloc(capacity,
+                                               sizeof(profile_stack_t));
+
+    if(profile->stacks == NULL)
+    {
+        profile->stacks = stacks;
+        free(functions);
+        return false;
+    }
+
+    profile->num_stacks = 0;
+
+    for(i = 0; i < capacity; i++)
+    {
+        stack = &stacks[i];
+
+        if(stack->targets == NULL)
+            continue;
+
+        depth = stack->depth;
+        memcpy(targets, stack->targets, sizeof(word_t) * depth);
+
+        function = profile_containing_function(functions, count, stack->pc);
+
+        if((function != NULL) && (function->addr != targets[depth - 1]))
+            targets[depth++] = function->addr;
+
+        if(!profile_count(profile, targets, depth, 0, stack->count))
+            ok = false;
+
+        free(stack->targets);
+    }
+
+    free(stacks);
+    free(functions);
+
+    return ok;
+}
+
+/**
+ * @brief Prints the samples taken in and under each function.
+ */
+static bool profile_print_table(const profile_t* profile, FILE* table)
+{
+    char buffer[PROFILE_NAME_SIZE];
+    profile_function_t* functions;
+    profile_function_t* function;
+    const profile_stack_t* stack;
+    word_t count;
+    word_t i, j;
+
+    functions = profile_functions(profile, &count);
+
+    if(functions == NULL)
+        return false;
+
+    /*
+     * A function appearing more than once in a stack (recursion) counts once
+     * towards its total.
+     */
+    for(i = 0; i < profile->stack_capacity; i++)
+    {
+        stack = &profile->stacks[i];
+
+        for(j = 0; j < stack->depth; j++)
+        {
+            function = profile_find_function(functions, count,
+                                             stack->targets[j]);
+
+            if(function->last_stack != i + 1)
+            {
+                function->last_stack = i + 1;
+                function->total += stack->count;
+            }
+
+            if(j == stack->depth - 1)
+                function->self += stack->count;
+        }
+    }
+
+    qsort(functions, count, sizeof(profile_function_t), profile_compare_self);
+
+    fprintf(table, "%llu samples, one every %llu instructions\n",
+            (unsigned long long)profile->samples,
+            (unsigned long long)profile->period);
+    fprintf(table, "%10s %7s %10s %7s  %s\n", "Self", "", "Total", "",
+            "Function");
+
+    for(i = 0; i < count; i++)
+        fprintf(table, "%10llu %6.2f%% %10llu %6.2f%%  %s\n",
+                (unsigned long long)functions[i].self,
+                100.0 * functions[i].self / profile->samples,
+                (unsigned long long)functions[i].total,
+                100.0 * functions[i].total / profile->samples,
+                profile_name(profile, functions[i].addr, buffer));
+
+    free(functions);
+
+    return true;
+}
+
+/**
+ * @brief Writes the sampled stacks to the profile's file in collapsed stack
+ *        format, and prints the per-function table to table.
+ */
+bool profile_report(FILE* table)
+{
+    char buffer[PROFILE_NAME_SIZE];
+    profile_t* profile = machine->profile;
+    const profile_stack_t* stack;
+    FILE* file;
+    word_t i, j;
+
+    if(!profile_fold(profile))
+    {
+        fprintf(stderr, "Out of memory writing profile %s\n", profile->fname);
+        return false;
+    }
+
+    file = fopen(profile->fname, "w");
+
+    if(file == NULL)
+    {
+        fprintf(stderr, "Could not open profile %s: %s\n", profile->fname,
+                strerror(errno));
+        return false;
+    }
+
+    for(i = 0; i < profile->stack_capacity; i++)
+    {
+        stack = &profile->stacks[i];
+
+        if(stack->targets == NULL)
+            continue;
+
+        for(j = 0; j < stack->depth; j++)
+            fprintf(file, "%s%s", j ? ";" : "",
+                    profile_name(profile, stack->targets[j], buffer));
+
+        fprintf(file, " %llu\n", (unsigned long long)stack->count);
+    }
+
+    fclose(file);
+
+    if(profile->samples == 0)
+        return true;
+
+    return profile_print_table(profile, table);
+}
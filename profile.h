@@ -0,0 +1,54 @@
+/**
+ * @brief Sampling guest profiler.
+ *
+ * While profiling, the profiler follows the guest's calls and returns in a
+ * shadow call stack: BALI pushes a frame for its target, and a JUMP to the
+ * return address of a frame on the stack pops back to that frame's caller.
+ * Every period instructions, the stack and the PC are sampled from a device
+ * event (see devices.h), so the interpreters pay nothing per instruction
+ * beyond a check on each BALI and JUMP.
+ *
+ * Each frame is identified by the address that was called (the root frame by
+ * the address profiling started at). A sample's self time is charged to the
+ * function that contains its PC, the closest sampled call target at or
+ * before it, and the shadow stack supplies its callers. If that is not the
+ * function on top of the stack, as after a tail call, it is added as a
+ * frame. Addresses are named from a symbol file
+ * written by asm.py, which holds one "ADDRESS LABEL" line (in hex) per label.
+ * An address that is not a label is named after the closest label before it,
+ * plus an offset.
+ *
+ * When the machine is done, the samples are written out in the collapsed
+ * stack format read by flamegraph.pl ("_main;_puts;_putc 12"), and a table
+ * of the samples taken in each function (self) and under it (total) is
+ * printed.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "architecture.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * The default number of instructions between samples. It is prime, so that
+ * the samples do not alias with the period of a guest loop.
+ */
+#define PROFILE_DEFAULT_PERIOD (997)
+
+/*
+ * The deepest shadow call stack that is followed. Calls made deeper than
+ * this are not recorded.
+ */
+#define PROFILE_MAX_DEPTH (1024)
+
+bool profile_init(const char* fname, const char* symbols, uint64_t period);
+void profile_destroy();
+void profile_call(word_t target, word_t ret);
+void profile_return(word_t target);
+bool profile_report(FILE* table);
+
+#endif // PROFILE_H
@@ -0,0 +1,129 @@
+_main@0x1000000:
+# Benchmark: 100 rounds of a bitwise CRC-32 (the zlib polynomial) over a
+# 1 KiB buffer of pseudo-random words.
+MOVW R0 0x2000000
+MOVW R1 256
+MOVW R2 0x2545f491
+BALI _fill
+
+MOVW R10 100
+
+_main_loop:
+BZI R10 _main_done
+PUSH R10
+
+MOVW R0 0x2000000
+MOVW R1 1024
+BALI _crc32
+
+POP R10
+ADDI R10 R10 -1
+BI _main_loop
+
+_main_done:
+# R0 holds the CRC of the buffer
+DUMP
+HALT
+
+_fill@0x1000200:
+# Fills the R1 words starting at R0 with a xorshift sequence seeded with R2,
+# shifted right by one so that every word is below 2^31. Leaves the state of
+# the sequence in R2.
+MOVW R8 13
+MOVW R9 17
+MOVW R10 5
+MOVW R11 1
+
+_fill_loop:
+BZI R1 _fill_done
+SLL R2 R8 R3
+XOR R2 R3 R2
+SLR R2 R9 R3
+XOR R2 R3 R2
+SLL R2 R10 R3
+XOR R2 R3 R2
+SLR R2 R11 R3
+STOR R3 R0
+ADDUI R0 R0 4
+ADDI R1 R1 -1
+BI _fill_loop
+
+_fill_done:
+JUMP LR
+
+_crc32@0x1000300:
+# Returns in R0 the CRC-32 of the R1 bytes starting at R0
+MOVW R5 0xedb88320
+MOVW R6 1
+LUH R4 0
+INV R4 R4
+
+_crc32_loop:
+BZI R1 _crc32_done
+LOADB R3 R0
+XOR R4 R3 R4
+
+# Eight rounds of crc = (crc >> 1) ^ (poly & -(crc & 1))
+AND R4 R6 R7
+INV R7 R7
+ADDUI R7 R7 1
+AND R7 R5 R7
+SLR R4 R6 R4
+XOR R4 R7 R4
+
+AND R4 R6 R7
+INV R7 R7
+ADDUI R7 R7 1
+AND R7 R5 R7
+SLR R4 R6 R4
+XOR R4 R7 R4
+
+AND R4 R6 R7
+INV R7 R7
+ADDUI R7 R7 1
+AND R7 R5 R7
+SLR R4 R6 R4
+XOR R4 R7 R4
+
+AND R4 R6 R7
+INV R7 R7
+ADDUI R7 R7 1
+AND R7 R5 R7
+SLR R4 R6 R4
+XOR R4 R7 R4
+
+AND R4 R6 R7
+INV R7 R7
+ADDUI R7 R7 1
+AND R7 R5 R7
+SLR R4 R6 R4
+XOR R4 R7 R4
+
+AND R4 R6 R7
+INV R7 R7
+ADDUI R7 R7 1
+AND R7 R5 R7
+SLR R4 R6 R4
+XOR R4 R7 R4
+
+AND R4 R6 R7
+INV R7 R7
+ADDUI R7 R7 1
+AND R7 R5 R7
+SLR R4 R6 R4
+XOR R4 R7 R4
+
+AND R4 R6 R7
+INV R7 R7
+ADDUI R7 R7 1
+AND R7 R5 R7
+SLR R4 R6 R4
+XOR R4 R7 R4
+
+ADDUI R0 R0 1
+ADDI R1 R1 -1
+BI _crc32_loop
+
+_crc32_done:
+INV R4 R0
+JUMP LR
@@ -0,0 +1,55 @@
+_main@0x1000000:
+# Benchmark: 300 rounds of filling an 8 KiB buffer with memset and copying
+# it to a second buffer with memcpy, one word at a time.
+MOVW R10 300
+
+_main_loop:
+BZI R10 _main_done
+PUSH R10
+
+# memset(0x2000000, round, 2048 words)
+MOVW R0 0x2000000
+MOV R10 R1
+MOVW R2 2048
+BALI _memset
+
+# memcpy(0x2002000, 0x2000000, 2048 words)
+MOVW R0 0x2002000
+MOVW R1 0x2000000
+MOVW R2 2048
+BALI _memcpy
+
+POP R10
+ADDI R10 R10 -1
+BI _main_loop
+
+_main_done:
+# Dump the last word copied for comparison between engines
+MOVW R1 0x2003ffc
+LOAD R0 R1
+DUMP
+HALT
+
+_memset@0x1000200:
+# Stores R1 to the R2 words starting at R0
+BZI R2 _memset_done
+STOR R1 R0
+ADDUI R0 R0 4
+ADDI R2 R2 -1
+BI _memset
+
+_memset_done:
+JUMP LR
+
+_memcpy@0x1000300:
+# Copies R2 words from R1 to R0
+BZI R2 _memcpy_done
+LOAD R3 R1
+STOR R3 R0
+ADDUI R0 R0 4
+ADDUI R1 R1 4
+ADDI R2 R2 -1
+BI _memcpy
+
+_memcpy_done:
+JUMP LR
@@ -0,0 +1,124 @@
+_putc@0x1000100:
+# Caller context save
+PUSH R7
+PUSH R8
+
+# Store the print character (R0) to TXBUF
+LUH R7 0x5000
+STOR R0 R7
+
+# Set the transmit flag
+ADDUI R7 R7 8
+LUH R8 0
+ADDUI R8 R8 1
+STOR R8 R7
+
+# Caller context restore
+POP R8
+POP R7
+
+# Jump unconditionally to link register
+JUMP LR
+
+_puts@0x1000200:
+# Caller context save
+PUSH LR
+PUSH R0
+PUSH R1
+
+# Move the address to R1
+MOV R0 R1
+
+_puts_loop_head:
+# Load a byte from the address given in R1 to R0
+LOADB R0 R1
+
+BZI R0 _puts_done
+
+BALI _putc
+
+# Increment address
+ADDUI R1 R1 1
+
+BI _puts_loop_head
+
+_puts_done:
+POP R1
+POP R0
+POP LR
+
+JUMP LR
+
+_data@0x1000500:
+# "The quick brown fox jumps over the lazy dog 0123456789\n"
+$b:0x54
+$b:0x68
+$b:0x65
+$b:0x20
+$b:0x71
+$b:0x75
+$b:0x69
+$b:0x63
+$b:0x6b
+$b:0x20
+$b:0x62
+$b:0x72
+$b:0x6f
+$b:0x77
+$b:0x6e
+$b:0x20
+$b:0x66
+$b:0x6f
+$b:0x78
+$b:0x20
+$b:0x6a
+$b:0x75
+$b:0x6d
+$b:0x70
+$b:0x73
+$b:0x20
+$b:0x6f
+$b:0x76
+$b:0x65
+$b:0x72
+$b:0x20
+$b:0x74
+$b:0x68
+$b:0x65
+$b:0x20
+$b:0x6c
+$b:0x61
+$b:0x7a
+$b:0x79
+$b:0x20
+$b:0x64
+$b:0x6f
+$b:0x67
+$b:0x20
+$b:0x30
+$b:0x31
+$b:0x32
+$b:0x33
+$b:0x34
+$b:0x35
+$b:0x36
+$b:0x37
+$b:0x38
+$b:0x39
+$b:0x0a
+$b:0x00
+
+_main@0x1000000:
+# Benchmark: print a 55-character line through the UART 5000 times.
+MOVW R10 5000
+
+_main_loop:
+BZI R10 _main_done
+MOVW R0 _data
+BALI _puts
+ADDI R10 R10 -1
+BI _main_loop
+
+_main_done:
+DUMP
+HALT
@@ -0,0 +1,43 @@
+_main@0x1000000:
+# Benchmark: 6 rounds of computing fib(22) by naive recursion, which makes
+# 57,313 calls per round.
+MOVW R11 1
+MOVW R10 6
+
+_main_loop:
+BZI R10 _main_done
+PUSH R10
+
+MOVW R0 22
+BALI _fib
+
+POP R10
+ADDI R10 R10 -1
+BI _main_loop
+
+_main_done:
+# R0 holds fib(22) = 17711 (0x452f)
+DUMP
+HALT
+
+_fib@0x1000200:
+# Returns fib(R0) in R0. Expects R11 = 1.
+SLR R0 R11 R1
+BZI R1 _fib_base
+
+PUSH LR
+PUSH R0
+ADDI R0 R0 -1
+BALI _fib
+
+POP R1
+PUSH R0
+ADDI R1 R0 -2
+BALI _fib
+
+POP R1
+ADD R0 R1 R0
+POP LR
+
+_fib_base:
+JUMP LR
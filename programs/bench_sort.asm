@@ -0,0 +1,149 @@
+_main@0x1000000:
+# Benchmark: 30 rounds of bubble sorting one array of 128 pseudo-random words
+# and insertion sorting another.
+MOVW R7 0x2004000
+MOVW R2 0x2545f491
+STOR R2 R7
+
+MOVW R10 30
+
+_main_loop:
+BZI R10 _main_done
+PUSH R10
+
+# Bubble sort a fresh array at 0x2000000
+MOVW R7 0x2004000
+LOAD R2 R7
+MOVW R0 0x2000000
+MOVW R1 128
+BALI _fill
+MOVW R7 0x2004000
+STOR R2 R7
+MOVW R0 0x2000000
+MOVW R1 128
+BALI _bubble
+
+# Insertion sort a fresh array at 0x2001000
+MOVW R7 0x2004000
+LOAD R2 R7
+MOVW R0 0x2001000
+MOVW R1 128
+BALI _fill
+MOVW R7 0x2004000
+STOR R2 R7
+MOVW R0 0x2001000
+MOVW R1 128
+BALI _insertion
+
+POP R10
+ADDI R10 R10 -1
+BI _main_loop
+
+_main_done:
+# Dump the first and last word of each array for comparison between engines
+MOVW R7 0x2000000
+LOAD R0 R7
+MOVW R7 0x20001fc
+LOAD R1 R7
+MOVW R7 0x2001000
+LOAD R2 R7
+MOVW R7 0x20011fc
+LOAD R3 R7
+DUMP
+HALT
+
+_fill@0x1000200:
+# Fills the R1 words starting at R0 with a xorshift sequence seeded with R2,
+# shifted right by one so that every word is below 2^31. Leaves the state of
+# the sequence in R2.
+MOVW R8 13
+MOVW R9 17
+MOVW R10 5
+MOVW R11 1
+
+_fill_loop:
+BZI R1 _fill_done
+SLL R2 R8 R3
+XOR R2 R3 R2
+SLR R2 R9 R3
+XOR R2 R3 R2
+SLL R2 R10 R3
+XOR R2 R3 R2
+SLR R2 R11 R3
+STOR R3 R0
+ADDUI R0 R0 4
+ADDI R1 R1 -1
+BI _fill_loop
+
+_fill_done:
+JUMP LR
+
+_bubble@0x1000300:
+# Sorts the R1 words starting at R0 into ascending order. The words must be
+# below 2^31: b + ~a = b - a - 1 is then negative exactly when b < a.
+MOVW R11 31
+ADDI R1 R2 -1
+
+_bubble_pass:
+BZI R2 _bubble_done
+MOV R0 R3
+MOV R2 R4
+
+_bubble_inner:
+BZI R4 _bubble_next
+LOAD R5 R3
+ADDUI R3 R7 4
+LOAD R6 R7
+INV R5 R8
+ADD R6 R8 R8
+SLR R8 R11 R8
+BZI R8 _bubble_noswap
+STOR R6 R3
+STOR R5 R7
+
+_bubble_noswap:
+MOV R7 R3
+ADDI R4 R4 -1
+BI _bubble_inner
+
+_bubble_next:
+ADDI R2 R2 -1
+BI _bubble_pass
+
+_bubble_done:
+JUMP LR
+
+_insertion@0x1000400:
+# Sorts the R1 words starting at R0 into ascending order. The words must be
+# below 2^31, as for _bubble.
+MOVW R11 31
+ADDUI R0 R3 4
+ADDI R1 R4 -1
+
+_insertion_outer:
+BZI R4 _insertion_done
+LOAD R5 R3
+MOV R3 R6
+
+_insertion_inner:
+# Stop at the start of the array, or at the first word not above the key
+XOR R6 R0 R8
+BZI R8 _insertion_place
+ADDI R6 R7 -4
+LOAD R9 R7
+INV R9 R8
+ADD R5 R8 R8
+SLR R8 R11 R8
+BZI R8 _insertion_place
+STOR R9 R6
+MOV R7 R6
+BI _insertion_inner
+
+_insertion_place:
+STOR R5 R6
+ADDUI R3 R3 4
+ADDI R4 R4 -1
+BI _insertion_outer
+
+_insertion_done:
+JUMP LR
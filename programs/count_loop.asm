@@ -0,0 +1,14 @@
+_main@0x1000000:
+# Load the iteration count (16M) into R0
+LUH R0 0x0100
+
+_loop_head:
+# Decrement the counter and exit the loop when it reaches zero
+ADDI R0 R0 -1
+BZI R0 _loop_done
+BI _loop_head
+
+_loop_done:
+# Dump the registers for comparison between engines
+DUMP
+HALT
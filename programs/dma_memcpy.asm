@@ -0,0 +1,55 @@
+_main@0x1000000:
+# The bench_memcpy workload done by the DMA engine: 300 rounds of filling an
+# 8 KiB buffer and copying it to a second buffer, waiting for each transfer
+# by polling the DMA status register. Leaves the same R0 as bench_memcpy.
+MOVW R7 0x50004000
+ADDUI R7 R6 0xC
+ADDUI R7 R5 0x10
+MOVW R9 1
+MOVW R10 300
+
+_main_loop:
+BZI R10 _main_done
+
+# memset(0x2000000, round, 8 KiB): FILL mode
+MOVW R0 0x2000000
+MOV R10 R1
+MOVW R2 8192
+MOVW R3 0x80000001
+BALI _dma
+
+# memcpy(0x2002000, 0x2000000, 8 KiB): COPY mode
+MOVW R0 0x2002000
+MOVW R1 0x2000000
+MOVW R2 8192
+MOVW R3 0x80000000
+BALI _dma
+
+ADDI R10 R10 -1
+BI _main_loop
+
+_main_done:
+# Dump the last word copied for comparison between engines
+MOVW R1 0x2003ffc
+LOAD R0 R1
+DUMP
+HALT
+
+_dma@0x1000200:
+# Transfers R2 bytes from R1 to R0 with the DMA CONTROL value in R3, and
+# waits for the transfer to finish
+ADDUI R7 R8 4
+STOR R0 R8
+STOR R1 R7
+ADDUI R7 R8 8
+STOR R2 R8
+STOR R3 R6
+
+_dma_wait:
+LOAD R4 R5
+AND R4 R9 R4
+BZI R4 _dma_done
+BI _dma_wait
+
+_dma_done:
+JUMP LR
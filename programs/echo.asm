@@ -0,0 +1,36 @@
+_main@0x1000000:
+# R7 = UART base (TXBUF), R6 = RXBUF, R5 = CONTROL
+LUH R7 0x5000
+ADDUI R7 R6 4
+ADDUI R7 R5 8
+
+# R4 = depth field shift, R3 = RX closed flag, R8 = TX flag
+LUH R4 0
+ADDUI R4 R4 16
+LUH R3 0
+ADDUI R3 R3 4
+LUH R8 0
+ADDUI R8 R8 1
+
+_poll:
+# Read the receive FIFO depth from the control register
+LOAD R1 R5
+SLR R1 R4 R2
+BZI R2 _empty
+
+_burst:
+# Echo one received byte
+LOADB R0 R6
+STOR R0 R7
+STOR R8 R5
+
+# Drain the rest of the burst without polling the control register again
+ADDI R2 R2 -1
+BZI R2 _poll
+BI _burst
+
+_empty:
+# Stop once the input source has closed
+AND R1 R3 R1
+BZI R1 _poll
+HALT
@@ -0,0 +1,59 @@
+_main@0x1000000:
+# Sleeps with WFI while the timer interrupts every 1M instructions, and its
+# handler prints a dot. Stops after 10 ticks.
+# R7 = UART TXBUF, R6 = CONTROL, R8 = TX flag, R11 = '.'
+MOVW R7 0x50000000
+ADDUI R7 R6 8
+MOVW R8 1
+MOVW R11 0x2e
+
+# Vector table at the start of RAM, with the handler for line 0 (timer)
+MOVW R2 0x2000000
+MOVW R3 _timer_irq
+STOR R3 R2
+
+# Point the interrupt controller at the table and enable the timer's line
+MOVW R1 0x50003000
+ADDUI R1 R4 0xC
+STOR R2 R4
+ADDUI R1 R4 4
+MOVW R3 1
+STOR R3 R4
+
+# Start the timer with RELOAD = 999999 and TICKINT
+MOVW R1 0x50002000
+ADDUI R1 R4 4
+MOVW R3 999999
+STOR R3 R4
+MOVW R3 3
+STOR R3 R1
+
+# R9 = ticks; enable interrupts in SR
+LUH R9 0
+MOVW R3 8
+MOV R3 SR
+
+_sleep:
+WFI
+ADDI R9 R4 -10
+BZI R4 _done
+BI _sleep
+
+_done:
+# Stop taking interrupts and the timer, end the line and dump the registers
+# for comparison between engines
+LUH R3 0
+MOV R3 SR
+STOR R3 R1
+MOVW R0 0x0a
+STOR R0 R7
+STOR R8 R6
+DUMP
+HALT
+
+_timer_irq:
+# Count the tick and print a dot
+ADDI R9 R9 1
+STOR R11 R7
+STOR R8 R6
+RETI
@@ -0,0 +1,45 @@
+_main@0x1000000:
+# Prints a dot on each of 10 timer periods of 1M instructions, waiting for
+# each by polling the timer's STATUS register. The wait is an idle loop, so
+# the emulator skips it up to the timer's next event (see -p and -W).
+# R7 = UART TXBUF, R6 = UART CONTROL, R8 = TX flag
+MOVW R7 0x50000000
+ADDUI R7 R6 8
+MOVW R8 1
+
+# R5 = timer CONTROL, R4 = STATUS; start the timer with RELOAD = 999999
+MOVW R5 0x50002000
+ADDUI R5 R4 0xC
+ADDUI R5 R1 4
+MOVW R0 999999
+STOR R0 R1
+STOR R8 R5
+
+# R10 = periods left, R9 = '.'
+MOVW R10 10
+MOVW R9 0x2e
+
+_tick:
+# Wait for COUNTFLAG
+LOAD R1 R4
+BZI R1 _tick
+
+# Clear COUNTFLAG by reading CONTROL, and print a dot
+LOAD R1 R5
+STOR R9 R7
+STOR R8 R6
+
+ADDI R10 R10 -1
+BZI R10 _done
+BI _tick
+
+_done:
+# Stop the timer, end the line and dump the registers for comparison between
+# engines
+MOVW R0 0
+STOR R0 R5
+MOVW R9 0x0a
+STOR R9 R7
+STOR R8 R6
+DUMP
+HALT
@@ -0,0 +1,155 @@
+/**
+ * @brief A lock-free single-producer, single-consumer byte ring buffer.
+ *
+ * One thread may push while another pops without any locking. The head is
+ * only written by the producer and the tail only by the consumer; both are
+ * free-running counters, so the ring size must be a power of two.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include "architecture.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+typedef struct
+{
+    byte_t* data;
+    word_t size;
+
+    _Atomic word_t head;
+    _Atomic word_t tail;
+} ring_t;
+
+/**
+ * @brief Allocates a ring of the given size (a power of two).
+ */
+static inline bool ring_init(ring_t* ring, word_t size)
+{
+    ring->data = (byte_t*)malloc(size);
+    ring->size = size;
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    return ring->data != NULL;
+}
+
+static inline void ring_free(ring_t* ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+}
+
+/**
+ * @brief Returns the number of bytes in the ring.
+ */
+static inline word_t ring_count(ring_t* ring)
+{
+    return atomic_load(&ring->head) - atomic_load(&ring->tail);
+}
+
+/**
+ * @brief Pushes up to len bytes (producer side). Returns the number of bytes
+ *        pushed, which is less than len if the ring fills up.
+ */
+static inline word_t ring_push(ring_t* ring, const byte_t* data, word_t len)
+{
+    word_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    word_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    word_t space = ring->size - (head - tail);
+    word_t offset = head & (ring->size - 1);
+    word_t first;
+
+    if(len > space)
+        len = space;
+
+    first = ring->size - offset;
+
+    if(first > len)
+        first = len;
+
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, data + first, len - first);
+
+    atomic_store(&ring->head, head + len);
+
+    return len;
+}
+
+/**
+ * @brief Describes the bytes in the ring as (at most) two contiguous
+ *        segments, without consuming them (consumer side). Returns the number
+ *        of segments.
+ */
+static inline int ring_peek(ring_t* ring, struct iovec iov[2])
+{
+    word_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    word_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    word_t count = head - tail;
+    word_t offset = tail & (ring->size - 1);
+    word_t first = ring->size - offset;
+
+    if(count == 0)
+        return 0;
+
+    iov[0].iov_base = ring->data + offset;
+
+    if(first >= count)
+    {
+        iov[0].iov_len = count;
+        return 1;
+    }
+
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = count - first;
+
+    return 2;
+}
+
+/**
+ * @brief Releases len bytes previously returned by ring_peek() (consumer
+ *        side).
+ */
+static inline void ring_consume(ring_t* ring, word_t len)
+{
+    atomic_store(&ring->tail,
+                 atomic_load_explicit(&ring->tail, memory_order_relaxed) +
+                 len);
+}
+
+/**
+ * @brief Pops up to len bytes (consumer side). Returns the number of bytes
+ *        popped.
+ */
+static inline word_t ring_pop(ring_t* ring, byte_t* data, word_t len)
+{
+    struct iovec iov[2];
+    int segments = ring_peek(ring, iov);
+    word_t popped = 0;
+    word_t chunk;
+    int i;
+
+    for(i = 0; (i < segments) && (popped < len); i++)
+    {
+        chunk = iov[i].iov_len;
+
+        if(chunk > len - popped)
+            chunk = len - popped;
+
+        memcpy(data + popped, iov[i].iov_base, chunk);
+        popped += chunk;
+    }
+
+    ring_consume(ring, popped);
+
+    return popped;
+}
+
+#endif // RING_H
@@ -0,0 +1,410 @@
+#include "snapshot.h"
+#include "devices.h"
+#include "machine.h"
+#include "processor.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SNAPSHOT_NUM_CHUNKS \
+        ((ARCH_ROM_SIZE + ARCH_RAM_SIZE) / SNAPSHOT_CHUNK_SIZE)
+
+typedef struct
+{
+    word_t refs;
+    byte_t data[SNAPSHOT_CHUNK_SIZE];
+} snapshot_chunk_t;
+
+typedef struct
+{
+    uint64_t instret;
+    uint64_t cycles;
+    register_map_t regs;
+    device_log_pos_t log;
+
+    /*
+     * The contents of machine->memory (the ROM, then the RAM).
+     */
+    snapshot_chunk_t* chunks[SNAPSHOT_NUM_CHUNKS];
+} snapshot_t;
+
+typedef struct snapshot_history
+{
+    uint64_t interval;
+
+    /*
+     * The furthest the machine has executed. Device reads before this are
+     * replayed.
+     */
+    uint64_t frontier;
+
+    /*
+     * A ring of snapshots, oldest first.
+     */
+    snapshot_t snapshots[SNAPSHOT_MAX_COUNT];
+    word_t first;
+    word_t count;
+} snapshot_history_t;
+
+/**
+ * @brief Returns the i'th oldest snapshot.
+ */
+#define snapshot_at(__i__) \
+        (&machine->snapshots->snapshots[(machine->snapshots->first + (__i__)) \
+                                        % SNAPSHOT_MAX_COUNT])
+
+/**
+ * @brief Releases a snapshot's references to its chunks.
+ */
+static void snapshot_release(snapshot_t* snapshot, word_t num_chunks)
+{
+    word_t i;
+
+    for(i = 0; i < num_chunks; i++)
+        if(--snapshot->chunks[i]->refs == 0)
+            free(snapshot->chunks[i]);
+}
+
+/**
+ * @brief Saves the machine's current state as the newest snapshot, dropping
+ *        the oldest one if the ring is full.
+ */
+static void snapshot_take()
+{
+    snapshot_history_t* history = machine->snapshots;
+    snapshot_t* previous = NULL;
+    snapshot_t* snapshot;
+    byte_t* memory;
+    word_t i;
+
+    /*
+     * Snapshots are taken between instructions executed by proc_step(), so
+     * the ALU flags in SR must be built first.
+     */
+    proc_flags_sync();
+
+    if(history->count == SNAPSHOT_MAX_COUNT)
+    {
+        snapshot_release(snapshot_at(0), SNAPSHOT_NUM_CHUNKS);
+
+        history->first = (history->first + 1) % SNAPSHOT_MAX_COUNT;
+        history->count--;
+
+        /*
+         * Nothing before the oldest snapshot can be replayed any more.
+         */
+        device_log_trim(&snapshot_at(0)->log);
+    }
+
+    if(history->count > 0)
+        previous = snapshot_at(history->count - 1);
+
+    snapshot = snapshot_at(history->count);
+
+    for(i = 0; i < SNAPSHOT_NUM_CHUNKS; i++)
+    {
+        memory = machine->memory + i * SNAPSHOT_CHUNK_SIZE;
+
+        if((previous != NULL) &&
+           (memcmp(previous->chunks[i]->data, memory,
+                   SNAPSHOT_CHUNK_SIZE) == 0))
+        {
+            snapshot->chunks[i] = previous->chunks[i];
+            snapshot->chunks[i]->refs++;
+            continue;
+        }
+
+        snapshot->chunks[i] =
+                (snapshot_chunk_t*)malloc(sizeof(snapshot_chunk_t));
+
+        /*
+         * Out of memory: carry on without this snapshot.
+         */
+        if(snapshot->chunks[i] == NULL)
+        {
+            snapshot_release(snapshot, i);
+            return;
+        }
+
+        snapshot->chunks[i]->refs = 1;
+        memcpy(snapshot->chunks[i]->data, memory, SNAPSHOT_CHUNK_SIZE);
+    }
+
+    snapshot->instret = machine->instret;
+    snapshot->cycles = machine->cycles;
+    snapshot->regs = machine->regs;
+    device_log_tell(&snapshot->log);
+
+    history->count++;
+}
+
+/**
+ * @brief Puts the machine back into the state saved in a snapshot. Device
+ *        reads are replayed from there on, up to the furthest the machine
+ *        has executed.
+ */
+static void snapshot_restore(const snapshot_t* snapshot)
+{
+    byte_t* memory;
+    word_t i, addr;
+    bool rom_changed = false;
+
+    for(i = 0; i < SNAPSHOT_NUM_CHUNKS; i++)
+    {
+        memory = machine->memory + i * SNAPSHOT_CHUNK_SIZE;
+
+        /*
+         * Leave untouched chunks alone; writing to the mapped program image
+         * would copy its pages.
+         */
+        if(memcmp(snapshot->chunks[i]->data, memory, SNAPSHOT_CHUNK_SIZE) == 0)
+            continue;
+
+        memcpy(memory, snapshot->chunks[i]->data, SNAPSHOT_CHUNK_SIZE);
+
+        if(i * SNAPSHOT_CHUNK_SIZE >= ARCH_ROM_SIZE)
+            continue;
+
+        /*
+         * Keep the predecoded ROM image coherent.
+         */
+        for(addr = 0; addr < SNAPSHOT_CHUNK_SIZE; addr += sizeof(word_t))
+            proc_predecode_word(ARCH_ROM_OFFSET + i * SNAPSHOT_CHUNK_SIZE +
+                                addr);
+
+        rom_changed = true;
+    }
+
+    if(rom_changed)
+    {
+        proc_block_invalidate();
+        proc_jit_invalidate();
+    }
+
+    machine->regs = snapshot->regs;
+    machine->instret = snapshot->instret;
+    machine->cycles = snapshot->cycles;
+
+    proc_flags_load();
+
+    device_log_replay(&snapshot->log, machine->snapshots->frontier);
+}
+
+/**
+ * @brief Starts logging device reads and taking a snapshot every interval
+ *        instructions, beginning with the machine's current state. Must be
+ *        called after the program has been loaded and the devices set up.
+ */
+bool snapshot_init(uint64_t interval)
+{
+    snapshot_history_t* history;
+
+    if((machine->device_log == NULL) && !device_log_init())
+        return false;
+
+    history = (snapshot_history_t*)calloc(1, sizeof(snapshot_history_t));
+
+    if(history == NULL)
+        return false;
+
+    history->interval = interval ? interval : 1;
+    history->frontier = machine->instret;
+
+    machine->snapshots = history;
+
+    snapshot_take();
+
+    return history->count > 0;
+}
+
+/**
+ * @brief Frees the machine's snapshots.
+ */
+void snapshot_destroy()
+{
+    snapshot_history_t* history = machine->snapshots;
+    word_t i;
+
+    if(history == NULL)
+        return;
+
+    for(i = 0; i < history->count; i++)
+        snapshot_release(snapshot_at(i), SNAPSHOT_NUM_CHUNKS);
+
+    free(history);
+
+    machine->snapshots = NULL;
+}
+
+/**
+ * @brief Takes a snapshot if one is due. Must be called whenever the machine
+ *        has executed some instructions.
+ */
+void snapshot_poll()
+{
+    snapshot_history_t* history = machine->snapshots;
+
+    if(machine->instret > history->frontier)
+        history->frontier = machine->instret;
+
+    if(machine->instret >= snapshot_next())
+        snapshot_take();
+}
+
+/**
+ * @brief Returns the guest time at which the next snapshot is due.
+ */
+uint64_t snapshot_next()
+{
+    snapshot_history_t* history = machine->snapshots;
+
+    return snapshot_at(history->count - 1)->instret + history->interval;
+}
+
+/**
+ * @brief Returns the earliest instruction that execution can go back to.
+ */
+uint64_t snapshot_oldest()
+{
+    return snapshot_at(0)->instret;
+}
+
+/**
+ * @brief Executes up to count instructions one at a time, taking snapshots
+ *        as they come due. Returns false if the processor halts first.
+ */
+bool snapshot_step(uint64_t count)
+{
+    uint64_t end = machine->instret + count;
+
+    bool halted = false;
+
+    /*
+     * The limit is not what stops the loop below, but it keeps idle loop
+     * skipping from going past the end (see processor_idle.c).
+     */
+    device_set_instret_limit(end);
+
+    proc_flags_load();
+
+    while(machine->instret < end)
+    {
+        if(!proc_step())
+        {
+            halted = true;
+            break;
+        }
+
+        device_poll(machine->instret);
+        snapshot_poll();
+    }
+
+    proc_flags_sync();
+
+    if(halted)
+        snapshot_poll();
+
+    return !halted;
+}
+
+/**
+ * @brief Moves the machine to the point just before the given instruction
+ *        executes, going back through the snapshots if it is in the past.
+ *        Returns false if the instruction is older than the oldest snapshot,
+ *        or if the processor halts before reaching it.
+ */
+bool snapshot_goto(uint64_t instret)
+{
+    word_t i;
+
+    if(instret < machine->instret)
+    {
+        if(instret < snapshot_oldest())
+            return false;
+
+        for(i = machine->snapshots->count - 1;
+            snapshot_at(i)->instret > instret; i--);
+
+        snapshot_restore(snapshot_at(i));
+    }
+
+    return snapshot_step(instret - machine->instret);
+}
+
+/**
+ * @brief Reads width bytes of memory, little-endian.
+ */
+static word_t snapshot_read_mem(word_t addr, word_t width)
+{
+    word_t value = 0;
+    word_t i;
+
+    for(i = 0; i < width; i++)
+        value |= (word_t)get_mem_byte(addr + i) << (8 * i);
+
+    return value;
+}
+
+/**
+ * @brief Goes back to the last instruction that changed the width bytes of
+ *        memory at addr, leaving the machine just before it executes and
+ *        storing its number in instret. If no instruction since the oldest
+ *        snapshot changed them, the machine is left where it was and false is
+ *        returned. The bytes must be in memory, not in a device.
+ */
+bool snapshot_find_change(word_t addr, word_t width, uint64_t* instret)
+{
+    uint64_t start = machine->instret;
+    uint64_t end = start;
+    uint64_t executing;
+    word_t value, current;
+    word_t i = machine->snapshots->count;
+    bool found;
+
+    /*
+     * Search the spans between snapshots, newest first, re-executing each
+     * one and watching the bytes.
+     */
+    while(i-- > 0)
+    {
+        if(snapshot_at(i)->instret >= end)
+            continue;
+
+        snapshot_restore(snapshot_at(i));
+
+        value = snapshot_read_mem(addr, width);
+        found = false;
+
+        while(machine->instret < end)
+        {
+            executing = machine->instret;
+
+            if(!proc_step())
+                break;
+
+            /*
+             * Interrupts and device actions (such as DMA transfers) are
+             * replayed here, and are charged to the instruction before them.
+             */
+            device_poll(machine->instret);
+
+            current = snapshot_read_mem(addr, width);
+
+            if(current != value)
+            {
+                (*instret) = executing;
+                value = current;
+                found = true;
+            }
+        }
+
+        if(found)
+            return snapshot_goto(*instret);
+
+        end = snapshot_at(i)->instret;
+    }
+
+    snapshot_goto(start);
+
+    return false;
+}
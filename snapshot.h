@@ -0,0 +1,41 @@
+/**
+ * @brief Snapshots for reverse execution.
+ *
+ * While snapshots are enabled, the machine's registers and memory are saved
+ * every interval instructions, and the values of device reads are logged (see
+ * devices.c). Going back to an earlier instruction restores the last snapshot
+ * taken at or before it and re-executes from there, replaying device reads
+ * from the log, so the re-execution is deterministic and the devices never see
+ * an access twice. A shorter interval makes going back faster and uses more
+ * memory.
+ *
+ * Memory is saved in chunks; a chunk that has not changed since the previous
+ * snapshot is shared with it rather than copied. Only the last
+ * SNAPSHOT_MAX_COUNT snapshots are kept, which bounds how far back execution
+ * can go.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "architecture.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SNAPSHOT_DEFAULT_INTERVAL (1000000)
+#define SNAPSHOT_MAX_COUNT (1024)
+#define SNAPSHOT_CHUNK_SIZE (4096)
+
+bool snapshot_init(uint64_t interval);
+void snapshot_destroy();
+void snapshot_poll();
+
+uint64_t snapshot_next();
+uint64_t snapshot_oldest();
+
+bool snapshot_step(uint64_t count);
+bool snapshot_goto(uint64_t instret);
+bool snapshot_find_change(word_t addr, word_t width, uint64_t* instret);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,296 @@
+#include "stats.h"
+#include "machine.h"
+#include "processor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* const stats_region_names[STATS_NUM_REGIONS] =
+{
+    "ram", "rom", "device"
+};
+
+/**
+ * @brief Returns the host time in nanoseconds.
+ */
+static uint64_t stats_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * @brief Maps zeroed memory for a stats_t, shared with the given file if fd
+ *        is not -1.
+ */
+static stats_t* stats_map(int fd)
+{
+    void* stats = mmap(NULL, sizeof(stats_t), PROT_READ | PROT_WRITE,
+                       (fd < 0) ? (MAP_PRIVATE | MAP_ANONYMOUS) : MAP_SHARED,
+                       fd, 0);
+
+    return (stats == MAP_FAILED) ? NULL : (stats_t*)stats;
+}
+
+/**
+ * @brief Gives the current machine a set of counters, starting now. Does
+ *        nothing unless the counters are compiled in.
+ */
+bool stats_init()
+{
+    stats_t* stats;
+
+    if(!stats_enabled())
+        return true;
+
+    stats = stats_map(-1);
+
+    if(stats == NULL)
+        return false;
+
+    memcpy(stats->magic, STATS_MAGIC, 4);
+    stats->version = STATS_VERSION;
+    stats->start_ns = stats_now();
+
+    machine->stats = stats;
+
+    return true;
+}
+
+/**
+ * @brief Frees the current machine's counters.
+ */
+void stats_destroy()
+{
+    if(machine->stats == NULL)
+        return;
+
+    munmap(machine->stats, sizeof(stats_t));
+
+    machine->stats = NULL;
+}
+
+/**
+ * @brief Moves the current machine's counters into a file, through which
+ *        other processes can read them (see stats_monitor()). Use a file in
+ *        /dev/shm to keep them off the disk.
+ */
+bool stats_share(const char* fname)
+{
+    stats_t* stats;
+    int fd;
+
+    if(machine->stats == NULL)
+    {
+        fprintf(stderr, "Counters are not compiled in; build emu-stats\n");
+        return false;
+    }
+
+    fd = open(fname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if(fd < 0)
+    {
+        fprintf(stderr, "Could not open stats %s: %s\n", fname,
+                strerror(errno));
+        return false;
+    }
+
+    stats = (ftruncate(fd, sizeof(stats_t)) == 0) ? stats_map(fd) : NULL;
+
+    close(fd);
+
+    if(stats == NULL)
+    {
+        fprintf(stderr, "Could not map stats %s: %s\n", fname,
+                strerror(errno));
+        return false;
+    }
+
+    memcpy(stats, machine->stats, sizeof(stats_t));
+    munmap(machine->stats, sizeof(stats_t));
+
+    machine->stats = stats;
+
+    return true;
+}
+
+/**
+ * @brief Marks the current machine's counters as final.
+ */
+void stats_finish()
+{
+    if(machine->stats == NULL)
+        return;
+
+    machine->stats->elapsed_ns = stats_now() - machine->stats->start_ns;
+    machine->stats->finished = 1;
+}
+
+/**
+ * @brief Prints a set of counters by region as a JSON object.
+ */
+static void stats_print_regions(FILE* file, const volatile uint64_t* counts)
+{
+    word_t i;
+
+    fprintf(file, "{");
+
+    for(i = 0; i < STATS_NUM_REGIONS; i++)
+        fprintf(file, "%s\"%s\": %llu", i ? ", " : "", stats_region_names[i],
+                (unsigned long long)counts[i]);
+
+    fprintf(file, "}");
+}
+
+/**
+ * @brief Writes the current machine's counters to a file ("-" for stdout) as
+ *        JSON.
+ */
+bool stats_write_json(const char* fname)
+{
+    const stats_t* stats = machine->stats;
+    double seconds;
+    FILE* file;
+    word_t i;
+    bool first = true;
+
+    if(stats == NULL)
+    {
+        fprintf(stderr, "Counters are not compiled in; build emu-stats\n");
+        return false;
+    }
+
+    file = (strcmp(fname, "-") == 0) ? stdout : fopen(fname, "w");
+
+    if(file == NULL)
+    {
+        fprintf(stderr, "Could not open stats %s: %s\n", fname,
+                strerror(errno));
+        return false;
+    }
+
+    seconds = stats->elapsed_ns * 1e-9;
+
+    fprintf(file, "{\n  \"instructions\": %llu,\n  \"seconds\": %.6f,\n"
+            "  \"mips\": %.2f,\n  \"opcodes\": {",
+            (unsigned long long)stats->instret, seconds,
+            seconds ? stats->instret / seconds / 1e6 : 0.0);
+
+    for(i = 0; i < 256; i++)
+    {
+        if(stats->opcodes[i] == 0)
+            continue;
+
+        if(proc_opcode_name(i) != NULL)
+            fprintf(file, "%s\n    \"%s\": %llu", first ? "" : ",",
+                    proc_opcode_name(i),
+                    (unsigned long long)stats->opcodes[i]);
+        else
+            fprintf(file, "%s\n    \"0x%02x\": %llu", first ? "" : ",", i,
+                    (unsigned long long)stats->opcodes[i]);
+
+        first = false;
+    }
+
+    fprintf(file, "\n  },\n  \"loads\": ");
+    stats_print_regions(file, stats->loads);
+    fprintf(file, ",\n  \"stores\": ");
+    stats_print_regions(file, stats->stores);
+    fprintf(file, ",\n  \"device_updates\": %llu,\n  \"decode_faults\": %llu"
+            "\n}\n", (unsigned long long)stats->device_updates,
+            (unsigned long long)stats->decode_faults);
+
+    if(file == stdout)
+        fflush(file);
+    else
+        fclose(file);
+
+    return true;
+}
+
+/**
+ * @brief Prints the counters shared through a file by a running emulator
+ *        once a second, until it finishes.
+ */
+bool stats_monitor(const char* fname)
+{
+    const stats_t* stats;
+    uint64_t instret, last_instret = 0;
+    uint64_t now, last_now;
+    int fd;
+
+    fd = open(fname, O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0)
+    {
+        fprintf(stderr, "Could not open stats %s: %s\n", fname,
+                strerror(errno));
+        return false;
+    }
+
+    stats = (const stats_t*)mmap(NULL, sizeof(stats_t), PROT_READ,
+                                 MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if((stats == MAP_FAILED) || (memcmp(stats->magic, STATS_MAGIC, 4) != 0) ||
+       (stats->version != STATS_VERSION))
+    {
+        fprintf(stderr, "%s does not hold emulator stats\n", fname);
+        return false;
+    }
+
+    last_now = stats->start_ns;
+
+    for(;;)
+    {
+        now = stats_now();
+        instret = stats->instret;
+
+        /*
+         * Once the emulator has finished, report its overall rate.
+         */
+        if(stats->finished)
+        {
+            now = stats->start_ns + stats->elapsed_ns;
+            last_now = stats->start_ns;
+            last_instret = 0;
+        }
+
+        printf("%10.3f s  %llu instructions  %.2f MIPS  loads %llu/%llu/%llu"
+               "  stores %llu/%llu/%llu (ram/rom/device)  device updates %llu"
+               "  decode faults %llu\n", (now - stats->start_ns) * 1e-9,
+               (unsigned long long)instret,
+               (now > last_now) ? (instret - last_instret) * 1e3 /
+                                  (now - last_now) : 0.0,
+               (unsigned long long)stats->loads[STATS_REGION_RAM],
+               (unsigned long long)stats->loads[STATS_REGION_ROM],
+               (unsigned long long)stats->loads[STATS_REGION_DEVICE],
+               (unsigned long long)stats->stores[STATS_REGION_RAM],
+               (unsigned long long)stats->stores[STATS_REGION_ROM],
+               (unsigned long long)stats->stores[STATS_REGION_DEVICE],
+               (unsigned long long)stats->device_updates,
+               (unsigned long long)stats->decode_faults);
+        fflush(stdout);
+
+        if(stats->finished)
+            break;
+
+        last_now = now;
+        last_instret = instret;
+
+        sleep(1);
+    }
+
+    munmap((void*)stats, sizeof(stats_t));
+
+    return true;
+}
@@ -0,0 +1,112 @@
+/**
+ * @brief Performance counters.
+ *
+ * The counters are only compiled in when STATS_ENABLED is defined (the
+ * emu-stats build); otherwise the counting macros expand to nothing, so the
+ * engines' hot paths are exactly as they would be without them.
+ *
+ * Each machine's counters live in a stats_t. It can be placed in a shared
+ * file mapping (stats_share()), through which an external monitor reads the
+ * counters while the machine runs; the layout below is that file's format.
+ * The counters are only ever incremented, and each is a naturally aligned
+ * 64-bit word, so a reader sees every counter whole without locking.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "architecture.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define STATS_MAGIC "DBST"
+#define STATS_VERSION (1)
+
+/*
+ * The regions that loads and stores are counted by.
+ */
+#define STATS_REGION_RAM (0)
+#define STATS_REGION_ROM (1)
+#define STATS_REGION_DEVICE (2)
+#define STATS_NUM_REGIONS (3)
+
+typedef struct stats
+{
+    char magic[4];
+    uint32_t version;
+
+    /*
+     * Set once the machine has stopped and elapsed_ns is final.
+     */
+    volatile uint32_t finished;
+    uint32_t reserved;
+
+    /*
+     * The host time (CLOCK_REALTIME) the counters started at, and the time
+     * they ran for, which is only kept up to date at the end.
+     */
+    uint64_t start_ns;
+    uint64_t elapsed_ns;
+
+    volatile uint64_t instret;
+    volatile uint64_t opcodes[256];
+    volatile uint64_t loads[STATS_NUM_REGIONS];
+    volatile uint64_t stores[STATS_NUM_REGIONS];
+    volatile uint64_t device_updates;
+    volatile uint64_t decode_faults;
+} stats_t;
+
+#ifdef STATS_ENABLED
+
+#define stats_enabled() (true)
+
+/**
+ * @brief Counts an event in one of the current machine's counters.
+ */
+#define stats_count(__counter__) \
+        (machine->stats->__counter__++)
+
+/**
+ * @brief Counts a retired instruction.
+ */
+#define stats_retire(__opcode__) \
+        do { \
+            machine->stats->instret++; \
+            machine->stats->opcodes[(__opcode__)]++; \
+        } while(0)
+
+/**
+ * @brief Counts a load or store made by an instruction, by the region of the
+ *        address it accessed.
+ */
+#define stats_access(__addr__, __write__) \
+        do { \
+            word_t __region__ = !mem_page_bias(__addr__) ? \
+                                STATS_REGION_DEVICE : \
+                                get_addr_in_rom(__addr__) ? \
+                                STATS_REGION_ROM : STATS_REGION_RAM; \
+            if(__write__) \
+                machine->stats->stores[__region__]++; \
+            else \
+                machine->stats->loads[__region__]++; \
+        } while(0)
+
+#else
+
+#define stats_enabled() (false)
+#define stats_count(__counter__) do {} while(0)
+#define stats_retire(__opcode__) do {} while(0)
+#define stats_access(__addr__, __write__) do {} while(0)
+
+#endif // STATS_ENABLED
+
+bool stats_init();
+void stats_destroy();
+bool stats_share(const char* fname);
+void stats_finish();
+bool stats_write_json(const char* fname);
+bool stats_monitor(const char* fname);
+
+#endif // STATS_H
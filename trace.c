@@ -0,0 +1,725 @@
+#include "trace.h"
+#include "machine.h"
+#include "memmap.h"
+#include "processor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+/*
+ * The largest record: a tag, a PC delta and a mask, and a value for every
+ * register, each varint taking up to five bytes.
+ */
+#define TRACE_MAX_RECORD (1 + 5 + 5 + TRACE_NUM_REGS * 5)
+
+typedef struct trace
+{
+    int fd;
+
+    byte_t buffer[TRACE_BUFFER_SIZE];
+    size_t used;
+
+    /*
+     * The state as of the last record, which the next record is encoded
+     * against.
+     */
+    word_t regs[TRACE_NUM_REGS];
+    word_t next_pc;
+    word_t last_addr;
+} trace_t;
+
+static const char* const trace_reg_names[TRACE_NUM_REGS] =
+{
+    "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "R8", "R9", "R10", "R11",
+    "PC", "LR", "SP", "SR"
+};
+
+#define trace_zigzag(__value__) \
+        (((word_t)(__value__) << 1) ^ (word_t)((int32_t)(__value__) >> 31))
+
+#define trace_unzigzag(__value__) \
+        (((__value__) >> 1) ^ -((__value__) & 1))
+
+/**
+ * @brief Appends a varint to a record.
+ */
+static inline byte_t* trace_put_varint(byte_t* p, word_t value)
+{
+    while(value >= 0x80)
+    {
+        *p++ = (byte_t)(value | 0x80);
+        value >>= 7;
+    }
+
+    *p++ = (byte_t)value;
+
+    return p;
+}
+
+/**
+ * @brief Returns a mask of the registers that differ from the last record.
+ */
+static inline word_t trace_changed_regs(trace_t* trace)
+{
+    const word_t* regs = (const word_t*)&machine->regs;
+    word_t mask = 0;
+    word_t i;
+
+    for(i = 0; i < TRACE_NUM_REGS; i++)
+        if(regs[i] != trace->regs[i])
+            mask |= (1 << i);
+
+    return mask;
+}
+
+/**
+ * @brief Appends a register mask and the registers it names to a record.
+ */
+static byte_t* trace_put_regs(trace_t* trace, byte_t* p, word_t mask)
+{
+    const word_t* regs = (const word_t*)&machine->regs;
+    word_t i;
+
+    p = trace_put_varint(p, mask);
+
+    for(i = 0; i < TRACE_NUM_REGS; i++)
+    {
+        if(mask & (1 << i))
+        {
+            p = trace_put_varint(p, regs[i] ^ trace->regs[i]);
+            trace->regs[i] = regs[i];
+        }
+    }
+
+    return p;
+}
+
+/**
+ * @brief Returns room for the next record, flushing the buffer if needed.
+ */
+static inline byte_t* trace_reserve(trace_t* trace)
+{
+    if(trace->used > TRACE_BUFFER_SIZE - TRACE_MAX_RECORD)
+        trace_flush();
+
+    return trace->buffer + trace->used;
+}
+
+/**
+ * @brief Starts tracing the current machine to a file.
+ */
+bool trace_init(const char* fname)
+{
+    trace_t* trace;
+    byte_t* p;
+
+    trace = (trace_t*)calloc(1, sizeof(trace_t));
+
+    if(trace == NULL)
+        return false;
+
+    trace->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if(trace->fd < 0)
+    {
+        fprintf(stderr, "Could not open trace %s: %s\n", fname,
+                strerror(errno));
+        free(trace);
+        return false;
+    }
+
+    machine->trace = trace;
+
+    memcpy(trace->buffer, TRACE_MAGIC, 4);
+    trace->buffer[4] = TRACE_VERSION;
+    trace->used = 5;
+
+    /*
+     * Record the starting state.
+     */
+    p = trace->buffer + trace->used;
+    *p++ = TRACE_TYPE_EVENT | (TRACE_EVENT_REGS << TRACE_EVENT_SHIFT);
+    p = trace_put_regs(trace, p, trace_changed_regs(trace));
+    trace->used = p - trace->buffer;
+
+    trace->next_pc = machine->regs.PC;
+
+    return true;
+}
+
+/**
+ * @brief Writes out the buffered records. Only uses write(), so that it can
+ *        be called from the crash handler.
+ */
+void trace_flush()
+{
+    trace_t* trace = machine->trace;
+    size_t done = 0;
+    ssize_t written;
+
+    if(trace == NULL)
+        return;
+
+    while(done < trace->used)
+    {
+        written = write(trace->fd, trace->buffer + done, trace->used - done);
+
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        done += written;
+    }
+
+    trace->used = 0;
+}
+
+/**
+ * @brief Stops tracing the current machine.
+ */
+void trace_destroy()
+{
+    if(machine->trace == NULL)
+        return;
+
+    trace_flush();
+
+    close(machine->trace->fd);
+    free(machine->trace);
+
+    machine->trace = NULL;
+}
+
+/**
+ * @brief Records the retirement of the instruction at pc. Called after it has
+ *        updated the registers.
+ */
+void trace_retire(word_t pc)
+{
+    trace_t* trace = machine->trace;
+    byte_t* p = trace_reserve(trace);
+    byte_t* tag = p++;
+    word_t mask;
+
+    proc_flags_sync();
+
+    *tag = TRACE_TYPE_INSTR;
+
+    if(pc != trace->next_pc)
+    {
+        *tag |= TRACE_INSTR_JUMP;
+        p = trace_put_varint(p, trace_zigzag(pc - trace->next_pc));
+    }
+
+    trace->next_pc = pc + sizeof(word_t);
+
+    /*
+     * The PC is implied by the next record.
+     */
+    mask = trace_changed_regs(trace) & ~(1 << TRACE_REG_PC);
+
+    if(mask)
+    {
+        *tag |= TRACE_INSTR_REGS;
+        p = trace_put_regs(trace, p, mask);
+    }
+
+    trace->used = p - trace->buffer;
+}
+
+/**
+ * @brief Records a load or store made by the instruction being executed.
+ */
+void trace_access(word_t addr, word_t width, word_t value, bool write)
+{
+    trace_t* trace = machine->trace;
+    byte_t* p = trace_reserve(trace);
+
+    /*
+     * Widths of 1, 2 and 4 bytes are stored as their log2.
+     */
+    *p++ = (mem_page_bias(addr) ? TRACE_TYPE_MEM : TRACE_TYPE_MMIO) |
+           ((width >> 1) << TRACE_ACCESS_WIDTH_SHIFT) |
+           (write ? TRACE_ACCESS_WRITE : 0);
+
+    p = trace_put_varint(p, trace_zigzag(addr - trace->last_addr));
+    p = trace_put_varint(p, value);
+
+    trace->last_addr = addr;
+    trace->used = p - trace->buffer;
+}
+
+/**
+ * @brief Records the processor halting at the current PC.
+ */
+void trace_halt()
+{
+    trace_t* trace = machine->trace;
+    byte_t* p = trace_reserve(trace);
+
+    *p++ = TRACE_TYPE_EVENT | (TRACE_EVENT_HALT << TRACE_EVENT_SHIFT);
+    p = trace_put_varint(p, trace_zigzag(machine->regs.PC - trace->next_pc));
+
+    trace->used = p - trace->buffer;
+}
+
+/*
+ * The flight recorder dump is formatted by hand and written with write(), so
+ * that it is safe to produce from a signal handler.
+ */
+
+static char* trace_format_str(char* p, const char* s)
+{
+    while(*s)
+        *p++ = *s++;
+
+    return p;
+}
+
+static char* trace_format_hex(char* p, word_t value, int digits)
+{
+    int i;
+
+    *p++ = '0';
+    *p++ = 'x';
+
+    for(i = digits - 1; i >= 0; i--)
+        *p++ = "0123456789abcdef"[(value >> (i * 4)) & 0xF];
+
+    return p;
+}
+
+static char* trace_format_dec(char* p, word_t value)
+{
+    char digits[10];
+    int n = 0;
+
+    do
+    {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while(value);
+
+    while(n)
+        *p++ = digits[--n];
+
+    return p;
+}
+
+static void trace_write_line(char* line, char* end)
+{
+    ssize_t written;
+
+    *end++ = '\n';
+
+    while(line < end)
+    {
+        written = write(STDERR_FILENO, line, end - line);
+
+        if(written <= 0)
+            break;
+
+        line += written;
+    }
+}
+
+/**
+ * @brief Prints one reconstructed instruction of the flight recorder.
+ */
+static void trace_flight_print(uint64_t instret, word_t pc)
+{
+    regidx_t ra, rb, rc;
+    word_t instr, imm;
+    opcode_t opcode;
+    char line[160];
+    char* p;
+
+    p = trace_format_str(line, "  ");
+    p = trace_format_dec(p, (word_t)instret);
+    p = trace_format_str(p, "\t");
+    p = trace_format_hex(p, pc, 8);
+    p = trace_format_str(p, ": ");
+
+    /*
+     * Reading a device register could have side effects.
+     */
+    if(!mem_page_bias(pc) || !mem_page_bias(pc + sizeof(word_t) - 1))
+    {
+        p = trace_format_str(p, "(not in memory)");
+        trace_write_line(line, p);
+        return;
+    }
+
+    instr = get_mem_word(pc);
+    proc_instr_decode(instr, &ra, &rb, &rc, &imm, &opcode);
+
+    p = trace_format_hex(p, instr, 8);
+    p = trace_format_str(p, "  (OPC: ");
+    p = trace_format_hex(p, opcode, 2);
+    p = trace_format_str(p, ", RA: ");
+    p = trace_format_dec(p, ra);
+    p = trace_format_str(p, ", RB: ");
+    p = trace_format_dec(p, rb);
+    p = trace_format_str(p, ", RC: ");
+    p = trace_format_dec(p, rc);
+    p = trace_format_str(p, ", IMM: ");
+    p = trace_format_hex(p, imm, 4);
+    p = trace_format_str(p, ")");
+    trace_write_line(line, p);
+}
+
+/**
+ * @brief Prints a run of instructions that the flight recorder did not see.
+ */
+static void trace_flight_print_missing(uint64_t count)
+{
+    char line[160];
+    char* p;
+
+    p = trace_format_str(line, "  (");
+    p = trace_format_dec(p, (word_t)count);
+    p = trace_format_str(p, " instructions not recorded)");
+    trace_write_line(line, p);
+}
+
+/**
+ * @brief Prints the last instructions of the current machine, from its flight
+ *        recorder, and its registers to stderr.
+ */
+void trace_flight_dump(const char* reason)
+{
+    const word_t* regs;
+    trace_flight_entry_t entry;
+    uint64_t i, end, missing = 0;
+    char line[160];
+    char* p;
+
+    if(machine == NULL)
+        return;
+
+    /*
+     * The instruction being executed has not been retired yet; include it.
+     */
+    end = machine->instret + 1;
+
+    p = trace_format_str(line, "Flight recorder (");
+    p = trace_format_str(p, reason);
+    p = trace_format_str(p, ") at instruction ");
+    p = trace_format_dec(p, (word_t)machine->instret);
+    p = trace_format_str(p, ":");
+    trace_write_line(line, p);
+
+    i = (end > TRACE_FLIGHT_ENTRIES) ? end - TRACE_FLIGHT_ENTRIES : 0;
+
+    for(; i != end; i++)
+    {
+        entry = machine->flight[i & (TRACE_FLIGHT_ENTRIES - 1)];
+
+        /*
+         * Entries left over from earlier instructions mean that these ran
+         * in translated code.
+         */
+        if((word_t)(entry >> 32) != (word_t)i)
+        {
+            missing++;
+            continue;
+        }
+
+        if(missing)
+        {
+            trace_flight_print_missing(missing);
+            missing = 0;
+        }
+
+        trace_flight_print(i, (word_t)entry);
+    }
+
+    if(missing)
+        trace_flight_print_missing(missing);
+
+    proc_flags_sync();
+
+    regs = (const word_t*)&machine->regs;
+    p = line;
+
+    for(i = 0; i < TRACE_NUM_REGS; i++)
+    {
+        p = trace_format_str(p, "  ");
+        p = trace_format_str(p, trace_reg_names[i]);
+        p = trace_format_str(p, "=");
+        p = trace_format_hex(p, regs[i], 8);
+
+        if((i % 4) == 3)
+        {
+            trace_write_line(line, p);
+            p = line;
+        }
+    }
+}
+
+/**
+ * @brief Dumps the flight recorder of the machine that crashed, saves its
+ *        trace, then lets the signal take its default action.
+ */
+static void trace_crash_handler(int sig)
+{
+    const char* reason;
+
+    switch(sig)
+    {
+        case SIGSEGV:   reason = "crashed: SIGSEGV"; break;
+        case SIGBUS:    reason = "crashed: SIGBUS (was the program file "
+                                 "rewritten while it ran?)"; break;
+        case SIGILL:    reason = "crashed: SIGILL"; break;
+        case SIGFPE:    reason = "crashed: SIGFPE"; break;
+        default:        reason = "crashed: SIGABRT"; break;
+    }
+
+    if(machine != NULL)
+    {
+        trace_flight_dump(reason);
+        trace_flush();
+    }
+
+    raise(sig);
+}
+
+/**
+ * @brief Dumps the flight recorder if the emulator crashes. The handler runs
+ *        on an alternate stack so that it also works after a stack overflow
+ *        on the main thread.
+ */
+void trace_install_crash_handler()
+{
+    static const int signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+    static byte_t stack[64 * 1024];
+    struct sigaction action;
+    stack_t alt_stack;
+    size_t i;
+
+    alt_stack.ss_sp = stack;
+    alt_stack.ss_size = sizeof(stack);
+    alt_stack.ss_flags = 0;
+    sigaltstack(&alt_stack, NULL);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = trace_crash_handler;
+    action.sa_flags = SA_RESETHAND | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+
+    for(i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+        sigaction(signals[i], &action, NULL);
+}
+
+/**
+ * @brief Reads a varint from a trace file. Returns false at the end of the
+ *        file.
+ */
+static bool trace_get_varint(FILE* fp, word_t* value)
+{
+    int c, shift = 0;
+
+    (*value) = 0;
+
+    do
+    {
+        if((c = getc(fp)) == EOF)
+            return false;
+
+        (*value) |= (word_t)(c & 0x7F) << shift;
+        shift += 7;
+    } while((c & 0x80) && (shift < 35));
+
+    return true;
+}
+
+/**
+ * @brief Reads a register mask and the registers it names.
+ */
+static bool trace_get_regs(FILE* fp, word_t* regs, word_t* mask)
+{
+    word_t i, value;
+
+    if(!trace_get_varint(fp, mask))
+        return false;
+
+    for(i = 0; i < TRACE_NUM_REGS; i++)
+    {
+        if((*mask) & (1 << i))
+        {
+            if(!trace_get_varint(fp, &value))
+                return false;
+
+            regs[i] ^= value;
+        }
+    }
+
+    return true;
+}
+
+static void trace_print_regs(FILE* out, const word_t* regs, word_t mask)
+{
+    word_t i;
+
+    for(i = 0; i < TRACE_NUM_REGS; i++)
+        if(mask & (1 << i))
+            fprintf(out, "  %s=0x%08x", trace_reg_names[i], regs[i]);
+}
+
+/**
+ * @brief Decodes a trace file into text, one line per instruction followed by
+ *        the accesses it made.
+ */
+bool trace_decode(const char* fname, FILE* out)
+{
+    static const char* const width_names[] = {"byte", "hword", "word", "?"};
+
+    FILE* fp = fopen(fname, "rb");
+    word_t regs[TRACE_NUM_REGS] = {0};
+    word_t next_pc = 0, last_addr = 0;
+    word_t delta, mask, addr, value;
+    uint64_t instret = 0;
+    char header[5];
+    int tag;
+
+    /*
+     * Accesses come before the instruction that made them; hold them until
+     * it is printed.
+     */
+    char (*accesses)[64] = NULL;
+    size_t num_accesses = 0;
+    size_t max_accesses = 0;
+    bool ok = true;
+    size_t i;
+
+    if(fp == NULL)
+    {
+        fprintf(stderr, "Could not open trace %s: %s\n", fname,
+                strerror(errno));
+        return false;
+    }
+
+    if((fread(header, 1, 5, fp) != 5) || memcmp(header, TRACE_MAGIC, 4) ||
+       (header[4] != TRACE_VERSION))
+    {
+        fprintf(stderr, "%s is not a version %d trace\n", fname,
+                TRACE_VERSION);
+        fclose(fp);
+        return false;
+    }
+
+    while(ok && ((tag = getc(fp)) != EOF))
+    {
+        switch(tag & TRACE_TYPE_MASK)
+        {
+            case TRACE_TYPE_INSTR:
+                delta = 0;
+                mask = 0;
+
+                if(((tag & TRACE_INSTR_JUMP) && !trace_get_varint(fp, &delta))
+                   || ((tag & TRACE_INSTR_REGS) &&
+                       !trace_get_regs(fp, regs, &mask)))
+                {
+                    ok = false;
+                    break;
+                }
+
+                regs[TRACE_REG_PC] = next_pc + trace_unzigzag(delta);
+                next_pc = regs[TRACE_REG_PC] + sizeof(word_t);
+
+                fprintf(out, "%10llu  0x%08x", (unsigned long long)instret++,
+                        regs[TRACE_REG_PC]);
+                trace_print_regs(out, regs, mask);
+                fputc('\n', out);
+
+                for(i = 0; i < num_accesses; i++)
+                    fprintf(out, "%24s%s\n", "", accesses[i]);
+
+                num_accesses = 0;
+                break;
+
+            case TRACE_TYPE_MEM:
+            case TRACE_TYPE_MMIO:
+                if(!trace_get_varint(fp, &delta) ||
+                   !trace_get_varint(fp, &value))
+                {
+                    ok = false;
+                    break;
+                }
+
+                addr = last_addr + trace_unzigzag(delta);
+                last_addr = addr;
+
+                if(num_accesses == max_accesses)
+                {
+                    max_accesses = max_accesses ? max_accesses * 2 : 4;
+                    accesses = realloc(accesses, max_accesses *
+                                       sizeof(accesses[0]));
+                }
+
+                snprintf(accesses[num_accesses++], sizeof(accesses[0]),
+                         "%s %s %-5s 0x%08x %s 0x%08x",
+                         ((tag & TRACE_TYPE_MASK) == TRACE_TYPE_MMIO) ?
+                         "mmio" : "mem ",
+                         (tag & TRACE_ACCESS_WRITE) ? "store" : "load ",
+                         width_names[(tag >> TRACE_ACCESS_WIDTH_SHIFT) & 3],
+                         addr, (tag & TRACE_ACCESS_WRITE) ? "<-" : "->",
+                         value);
+                break;
+
+            case TRACE_TYPE_EVENT:
+                switch(tag >> TRACE_EVENT_SHIFT)
+                {
+                    case TRACE_EVENT_REGS:
+                        if(!trace_get_regs(fp, regs, &mask))
+                        {
+                            ok = false;
+                            break;
+                        }
+
+                        next_pc = regs[TRACE_REG_PC];
+
+                        fprintf(out, "%10s  registers", "");
+                        trace_print_regs(out, regs, mask);
+                        fputc('\n', out);
+                        break;
+
+                    case TRACE_EVENT_HALT:
+                        if(!trace_get_varint(fp, &delta))
+                        {
+                            ok = false;
+                            break;
+                        }
+
+                        fprintf(out, "%10s  0x%08x  halt\n", "",
+                                next_pc + trace_unzigzag(delta));
+                        break;
+
+                    default:
+                        fprintf(stderr, "Unknown trace event %d\n",
+                                tag >> TRACE_EVENT_SHIFT);
+                        ok = false;
+                        break;
+                }
+                break;
+        }
+    }
+
+    if(!ok && !ferror(fp) && feof(fp))
+        fprintf(stderr, "%s is truncated\n", fname);
+
+    free(accesses);
+    fclose(fp);
+
+    return ok;
+}
@@ -0,0 +1,99 @@
+/**
+ * @brief Binary execution trace and flight recorder.
+ *
+ * A trace file starts with the 4-byte magic "DBTR" and a version byte,
+ * followed by a stream of records. Each record starts with a tag byte whose
+ * low two bits give the record type; numbers that follow are LEB128 varints,
+ * and signed ones are zigzag-encoded first.
+ *
+ *  INSTR   An instruction retired. TRACE_INSTR_JUMP: the PC differs from the
+ *          previous instruction's PC + 4, and the signed delta follows.
+ *          TRACE_INSTR_REGS: a mask of the registers it changed (other than
+ *          the PC) follows, then each changed register, XORed with its
+ *          previous value, in index order.
+ *  MEM     A load or store to memory, recorded before the INSTR record of the
+ *  MMIO    instruction that made it (or to a device). Bits 2-3 hold the log2
+ *          of the width and TRACE_ACCESS_WRITE marks a store. The signed
+ *          delta from the previous access's address follows, then the value.
+ *  EVENT   Bits 2-7 hold the event. TRACE_EVENT_REGS is followed by a
+ *          register mask and values as for INSTR, and sets the registers
+ *          without retiring an instruction (the trace starts with one).
+ *          TRACE_EVENT_HALT marks the processor halting, and is followed by
+ *          the signed delta of the PC it halted at.
+ *
+ * The flight recorder is separate from the trace and always on: each machine
+ * keeps the PCs of the last TRACE_FLIGHT_ENTRIES instructions that the
+ * interpreters executed, and dumps them to stderr (with the instruction words
+ * as they are in memory at that point) on the first decode fault or if the
+ * emulator crashes. Translated code is not recorded.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "architecture.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC "DBTR"
+#define TRACE_VERSION (1)
+
+#define TRACE_TYPE_MASK (0x03)
+#define TRACE_TYPE_INSTR (0x00)
+#define TRACE_TYPE_MEM (0x01)
+#define TRACE_TYPE_MMIO (0x02)
+#define TRACE_TYPE_EVENT (0x03)
+
+#define TRACE_INSTR_JUMP (0x04)
+#define TRACE_INSTR_REGS (0x08)
+
+#define TRACE_ACCESS_WIDTH_SHIFT (2)
+#define TRACE_ACCESS_WRITE (0x10)
+
+#define TRACE_EVENT_SHIFT (2)
+#define TRACE_EVENT_REGS (0)
+#define TRACE_EVENT_HALT (1)
+
+/*
+ * The number of registers recorded (all of register_map_t), and the index of
+ * the PC, which INSTR records leave implicit.
+ */
+#define TRACE_NUM_REGS (sizeof(register_map_t) / sizeof(word_t))
+#define TRACE_REG_PC (12)
+
+/*
+ * The number of instructions kept by the flight recorder (a power of two).
+ */
+#define TRACE_FLIGHT_ENTRIES (256)
+
+/*
+ * A flight recorder entry: the low half of the instruction's number in the
+ * high word and its PC in the low word. Entries are indexed by the
+ * instruction count, which the engines maintain anyway, so recording is a
+ * single store; the number tells the dump which entries are current.
+ */
+typedef uint64_t trace_flight_entry_t;
+
+/**
+ * @brief Records the instruction about to execute at __pc__ in the current
+ *        machine's flight recorder.
+ */
+#define trace_flight_record(__pc__) \
+        (machine->flight[machine->instret & (TRACE_FLIGHT_ENTRIES - 1)] = \
+         ((uint64_t)machine->instret << 32) | (word_t)(__pc__))
+
+bool trace_init(const char* fname);
+void trace_destroy();
+void trace_flush();
+void trace_retire(word_t pc);
+void trace_access(word_t addr, word_t width, word_t value, bool write);
+void trace_halt();
+
+void trace_flight_dump(const char* reason);
+void trace_install_crash_handler();
+
+bool trace_decode(const char* fname, FILE* out);
+
+#endif // TRACE_H